@@ -0,0 +1,28 @@
+// android/src/main/cpp/alloc_audit.h
+#pragma once
+
+#include <cstdint>
+
+// ===== 堆分配计数（-DLLM_ALLOC_AUDIT=ON 时启用）=====
+// 替换全局 operator new，按线程计数；解码循环据此校验稳态每 token 零分配。
+// 定义的是全局替换函数，每个可执行文件/共享库只能由一个翻译单元包含
+#ifdef LLM_ALLOC_AUDIT
+#include <cstdlib>
+#include <new>
+static thread_local uint64_t t_alloc_count = 0;
+void* operator new(size_t n) {
+    ++t_alloc_count;
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t n) { return operator new(n); }
+void* operator new(size_t n, const std::nothrow_t&) noexcept { ++t_alloc_count; return std::malloc(n ? n : 1); }
+void* operator new[](size_t n, const std::nothrow_t&) noexcept { ++t_alloc_count; return std::malloc(n ? n : 1); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+static inline uint64_t alloc_count() { return t_alloc_count; }
+#else
+static inline uint64_t alloc_count() { return 0; }
+#endif
@@ -0,0 +1,432 @@
+// android/src/main/cpp/fused_sampler.h
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "llama.h"
+
+// ===== SIMD argmax =====
+// 先向量化求最大值，再找第一个等于它的下标（与标量循环同样取最靠前的那个）
+inline int32_t simd_argmax(const float* x, int32_t n) {
+    if (n <= 0) return -1;
+    int32_t i = 0;
+    float mx = x[0];
+#if defined(__AVX2__)
+    if (n >= 8) {
+        __m256 m = _mm256_loadu_ps(x);
+        for (i = 8; i + 8 <= n; i += 8) m = _mm256_max_ps(m, _mm256_loadu_ps(x + i));
+        __m128 h = _mm_max_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1));
+        h = _mm_max_ps(h, _mm_movehl_ps(h, h));
+        h = _mm_max_ss(h, _mm_shuffle_ps(h, h, 1));
+        mx = _mm_cvtss_f32(h);
+    }
+#elif defined(__SSE2__)
+    if (n >= 4) {
+        __m128 m = _mm_loadu_ps(x);
+        for (i = 4; i + 4 <= n; i += 4) m = _mm_max_ps(m, _mm_loadu_ps(x + i));
+        m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+        m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+        mx = _mm_cvtss_f32(m);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    if (n >= 4) {
+        float32x4_t m = vld1q_f32(x);
+        for (i = 4; i + 4 <= n; i += 4) m = vmaxq_f32(m, vld1q_f32(x + i));
+        mx = vmaxvq_f32(m);
+    }
+#endif
+    for (; i < n; ++i) mx = x[i] > mx ? x[i] : mx;
+    int32_t j = 0;
+#if defined(__AVX2__)
+    const __m256 t = _mm256_set1_ps(mx);
+    for (; j + 8 <= n; j += 8) {
+        const int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(x + j), t, _CMP_EQ_OQ));
+        if (mask) return j + __builtin_ctz(mask);
+    }
+#elif defined(__SSE2__)
+    const __m128 t = _mm_set1_ps(mx);
+    for (; j + 4 <= n; j += 4) {
+        const int mask = _mm_movemask_ps(_mm_cmpeq_ps(_mm_loadu_ps(x + j), t));
+        if (mask) return j + __builtin_ctz(mask);
+    }
+#endif
+    for (; j < n; ++j) if (x[j] == mx) return j;
+    return 0;   // 全是 NaN
+}
+
+// ===== 单遍融合采样器 =====
+// 与 penalties → top_k → min_p → top_p → temp/greedy → dist 链在统计上等价，但不再对整个词表
+// （Qwen 约 15 万）逐级遍历/排序：
+// - 重复惩罚只作用于窗口里出现过的少数 token（稀疏），
+// - top-k：等距抽样估出阈值，一遍 SIMD 扫描只收集超过阈值的少量候选，再 nth_element，
+// - min-p / top-p / 温度 / 抽样只在这 k 个候选上做。
+// 惩罚只会改动窗口里的 P 个 token，所以先取原始 logits 的 top-(k+P)，去掉其中被惩罚的，
+// 再补上 P 个惩罚后的值，重选 top-k，结果与先惩罚整表再取 top-k 相同。
+// top_k <= 0 时退回整表（先按 min-p 阈值筛一遍再排序）。非线程安全，每个请求一份（见采样器缓存）。
+// 惩罚窗口与计数表在构造时按 penalty_last_n 一次分配好，accept/sample 不再申请内存。
+struct FusedSamplerParams {
+    float    temp           = 0.8f;
+    int32_t  top_k          = 40;
+    float    top_p          = 0.95f;
+    float    min_p          = 0.05f;
+    size_t   min_keep       = 1;
+    int32_t  penalty_last_n = 256;
+    float    penalty_repeat = 1.10f;
+    uint32_t seed           = LLAMA_DEFAULT_SEED;
+};
+
+class FusedSampler {
+public:
+    explicit FusedSampler(const FusedSamplerParams& p) : p_(p) {
+        p_.penalty_last_n = std::max(0, p_.penalty_last_n);
+        const size_t n = (size_t)p_.penalty_last_n;
+        // 开放寻址表装载率不超过 1/2：窗口里最多 n 个不同 token
+        size_t cap = 16;
+        while (cap < 2 * n) cap <<= 1;
+        slots_.assign(cap, Slot{});
+        slot_shift_ = 32;
+        for (size_t c = cap; c > 1; c >>= 1) --slot_shift_;
+        hist_.reserve(n);
+        uniq_.reserve(n);
+        // top-k 路径的候选数有上限（见 collect_above），一次留够；不限 top_k 时第一次采样按词表大小留
+        if (p_.top_k > 0) {
+            cand_.reserve(cand_limit() + kSimdSlack);
+            probs_.reserve((size_t)p_.top_k);
+        }
+        probe_.reserve(kProbe);
+        reset();
+    }
+
+    // token id == 下标的稠密 logits（llama_get_logits_ith 的结果）；返回采到的 token，不 accept
+    llama_token sample(const float* logits, int32_t n_vocab) {
+        if (!logits || n_vocab <= 0) return LLAMA_TOKEN_NULL;
+        const bool greedy = !(p_.temp > 0.0f);
+        if (greedy) {
+            // 确定性模式：惩罚后的 argmax。原始最大值不在惩罚窗口里时，只需与窗口里惩罚后的值比一比
+            const int32_t a = simd_argmax(logits, n_vocab);
+            if (!penalizing()) return a;
+            if (!penalized(a)) {
+                llama_token best = a;
+                float bl = logits[a];
+                for (const Uniq& u : uniq_) {
+                    if (u.id >= n_vocab) continue;
+                    const float l = penalize(logits[u.id]);
+                    if (l > bl || (l == bl && u.id < best)) { bl = l; best = u.id; }
+                }
+                return best;
+            }
+        }
+        const size_t k = greedy ? 1 : ((p_.top_k > 0 && p_.top_k < n_vocab) ? (size_t)p_.top_k : (size_t)n_vocab);
+        cand_.clear();
+        if (k < (size_t)n_vocab) {
+            top_scan(logits, n_vocab, k + penalized_count());
+            if (penalizing()) {
+                cand_.erase(std::remove_if(cand_.begin(), cand_.end(), [this](const Cand& c) { return penalized(c.id); }),
+                            cand_.end());
+                for (const Uniq& u : uniq_) {
+                    if (u.id < n_vocab) cand_.push_back({penalize(logits[u.id]), u.id});
+                }
+            }
+        } else {
+            full_scan(logits, n_vocab);
+        }
+        return finish(k);
+    }
+
+    // 通用入口：cur_p 任意（可能不稠密或已被前级裁剪），返回 cur_p 中被选中的下标
+    int64_t apply(llama_token_data_array* cur_p) {
+        if (!cur_p || cur_p->size == 0) return -1;
+        const size_t n = cur_p->size;
+        const bool dense = cur_p->data[0].id == 0 && cur_p->data[n - 1].id == (llama_token)(n - 1) && !cur_p->sorted;
+        if (dense) {
+            dense_.resize(n);
+            for (size_t i = 0; i < n; ++i) dense_[i] = cur_p->data[i].logit;
+            return sample(dense_.data(), (int32_t)n);   // 稠密时下标即 token id
+        }
+        cand_.clear();
+        for (size_t i = 0; i < n; ++i) {
+            const llama_token t = cur_p->data[i].id;
+            const float l = cur_p->data[i].logit;
+            cand_.push_back({penalized(t) ? penalize(l) : l, t});
+        }
+        const bool greedy = !(p_.temp > 0.0f);
+        const size_t k = greedy ? 1 : ((p_.top_k > 0 && (size_t)p_.top_k < n) ? (size_t)p_.top_k : n);
+        const llama_token id = finish(k);
+        for (size_t i = 0; i < n; ++i) if (cur_p->data[i].id == id) return (int64_t)i;
+        return -1;
+    }
+
+    void accept(llama_token t) {
+        if (p_.penalty_last_n == 0 || t < 0) return;
+        if (hist_.size() < (size_t)p_.penalty_last_n) {
+            hist_.push_back(t);
+        } else {
+            count_sub(hist_[hist_head_]);
+            hist_[hist_head_] = t;
+            hist_head_ = (hist_head_ + 1) % hist_.size();
+        }
+        count_add(t);
+    }
+
+    // 清空惩罚窗口并重新取种子（LLAMA_DEFAULT_SEED = 每次随机）
+    void reset() {
+        hist_.clear();
+        hist_head_ = 0;
+        std::fill(slots_.begin(), slots_.end(), Slot{});
+        uniq_.clear();
+        rng_.seed(p_.seed == LLAMA_DEFAULT_SEED ? std::random_device{}() : p_.seed);
+    }
+
+    const FusedSamplerParams& params() const { return p_; }
+
+private:
+    struct Cand {
+        float       logit;
+        llama_token id;
+    };
+
+    // 窗口内出现过的不同 token 及其次数，稠密存放便于遍历；slots_ 是 token -> uniq_ 下标的线性探测表
+    struct Uniq {
+        llama_token id;
+        int32_t     n;
+    };
+    struct Slot {
+        llama_token id  = LLAMA_TOKEN_NULL;   // 空槽
+        int32_t     idx = 0;
+    };
+
+    size_t slot_of(llama_token t) const {
+        return (size_t)(((uint32_t)t * 0x9E3779B1u) >> slot_shift_);
+    }
+
+    // t 所在的槽，或探测链上第一个空槽
+    size_t find_slot(llama_token t) const {
+        const size_t mask = slots_.size() - 1;
+        size_t i = slot_of(t);
+        while (slots_[i].id != LLAMA_TOKEN_NULL && slots_[i].id != t) i = (i + 1) & mask;
+        return i;
+    }
+
+    void count_add(llama_token t) {
+        Slot& s = slots_[find_slot(t)];
+        if (s.id == t) { ++uniq_[(size_t)s.idx].n; return; }
+        s.id  = t;
+        s.idx = (int32_t)uniq_.size();
+        uniq_.push_back({t, 1});
+    }
+
+    void count_sub(llama_token t) {
+        const size_t mask = slots_.size() - 1;
+        size_t i = find_slot(t);
+        if (slots_[i].id != t) return;
+        const size_t u = (size_t)slots_[i].idx;
+        if (--uniq_[u].n > 0) return;
+        // uniq_ 里拿末尾补洞，并改它在表里的下标
+        if (u + 1 != uniq_.size()) {
+            uniq_[u] = uniq_.back();
+            slots_[find_slot(uniq_[u].id)].idx = (int32_t)u;
+        }
+        uniq_.pop_back();
+        // 线性探测的删除：把后面仍能前移的条目逐个挪进空位，不留墓碑
+        size_t hole = i;
+        for (size_t j = (i + 1) & mask; slots_[j].id != LLAMA_TOKEN_NULL; j = (j + 1) & mask) {
+            const size_t home = slot_of(slots_[j].id);
+            // home 不在 (hole, j] 这段循环区间里，说明 j 可以挪到 hole
+            if (((j - home) & mask) >= ((j - hole) & mask)) {
+                slots_[hole] = slots_[j];
+                hole = j;
+            }
+        }
+        slots_[hole] = Slot{};
+    }
+
+    bool penalizing() const { return p_.penalty_last_n > 0 && p_.penalty_repeat != 1.0f && !uniq_.empty(); }
+    size_t penalized_count() const { return penalizing() ? uniq_.size() : 0; }
+    bool penalized(llama_token t) const { return penalizing() && t >= 0 && slots_[find_slot(t)].id == t; }
+
+    // 与 llama.cpp penalties 相同：正 logit 除以惩罚系数，负的乘以
+    float penalize(float l) const { return l <= 0.0f ? l * p_.penalty_repeat : l / p_.penalty_repeat; }
+
+    // 原始 logits 的 top-m（无序）写进 cand_。先在等距抽样的值上估一个阈值（期望留下约 3m 个），
+    // 再一遍 SIMD 扫描收集超过阈值的下标，最后 nth_element；留下的不足 m 个（分布极端）时整表退回小根堆
+    void top_scan(const float* logits, int32_t n, size_t m) {
+        m = std::min(m, (size_t)n);
+        const int32_t n_probe = std::min<int32_t>(n, kProbe);
+        const int32_t stride = n / n_probe;
+        probe_.resize((size_t)n_probe);
+        for (int32_t i = 0; i < n_probe; ++i) probe_[(size_t)i] = logits[(size_t)i * stride];
+        const size_t r = std::min<size_t>((size_t)n_probe, m * (size_t)n_probe / (size_t)n * 3 + 8);
+        std::nth_element(probe_.begin(), probe_.begin() + (ptrdiff_t)(r - 1), probe_.end(), std::greater<float>());
+        if (!collect_above(logits, n, probe_[r - 1], std::max(cand_limit(), m)) || cand_.size() < m) {
+            cand_.clear();
+            heap_scan(logits, n, m);
+            return;
+        }
+        std::nth_element(cand_.begin(), cand_.begin() + (ptrdiff_t)(m - 1), cand_.end(),
+                         [](const Cand& a, const Cand& b) { return a.logit > b.logit; });
+        cand_.resize(m);
+    }
+
+    // 阈值估得太低时候选会很多：超过 limit 就放弃（返回 false，调用方退回小根堆），
+    // 这样 cand_ 不会超出预留的容量
+    size_t cand_limit() const {
+        return std::max<size_t>(kProbe, 8 * ((size_t)std::max(0, p_.top_k) + (size_t)p_.penalty_last_n));
+    }
+
+    // logits >= thr 的全部追加到 cand_；超过 limit 个返回 false
+    bool collect_above(const float* logits, int32_t n, float thr, size_t limit) {
+        int32_t i = 0;
+        auto take = [&](int32_t j) { if (logits[j] >= thr) cand_.push_back({logits[j], (llama_token)j}); };
+#if defined(__AVX2__)
+        const __m256 t = _mm256_set1_ps(thr);
+        for (; i + 8 <= n; i += 8) {
+            int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(logits + i), t, _CMP_GE_OQ));
+            while (mask) { const int b = __builtin_ctz(mask); mask &= mask - 1; cand_.push_back({logits[i + b], (llama_token)(i + b)}); }
+            if (cand_.size() > limit) return false;
+        }
+#elif defined(__SSE2__)
+        const __m128 t = _mm_set1_ps(thr);
+        for (; i + 4 <= n; i += 4) {
+            int mask = _mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(logits + i), t));
+            while (mask) { const int b = __builtin_ctz(mask); mask &= mask - 1; cand_.push_back({logits[i + b], (llama_token)(i + b)}); }
+            if (cand_.size() > limit) return false;
+        }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+        const float32x4_t t = vdupq_n_f32(thr);
+        for (; i + 8 <= n; i += 8) {
+            const uint32x4_t g0 = vcgeq_f32(vld1q_f32(logits + i), t);
+            const uint32x4_t g1 = vcgeq_f32(vld1q_f32(logits + i + 4), t);
+            if (vmaxvq_u32(vorrq_u32(g0, g1)) == 0) continue;
+            for (int32_t j = i; j < i + 8; ++j) take(j);
+            if (cand_.size() > limit) return false;
+        }
+#endif
+        for (; i < n; ++i) {
+            take(i);
+            if (cand_.size() > limit) return false;
+        }
+        return true;
+    }
+
+    // 兜底：小根堆，超过堆顶才入堆
+    void heap_scan(const float* logits, int32_t n, size_t m) {
+        auto gt = [](const Cand& a, const Cand& b) { return a.logit > b.logit; };
+        int32_t i = 0;
+        for (; i < (int32_t)m; ++i) cand_.push_back({logits[i], (llama_token)i});
+        std::make_heap(cand_.begin(), cand_.end(), gt);
+        for (; i < n; ++i) {
+            if (!(logits[i] > cand_.front().logit)) continue;
+            std::pop_heap(cand_.begin(), cand_.end(), gt);
+            cand_.back() = {logits[i], (llama_token)i};
+            std::push_heap(cand_.begin(), cand_.end(), gt);
+        }
+    }
+
+    // 不限 top_k：惩罚后整表，min-p 打开时先按阈值筛掉绝大部分
+    void full_scan(const float* logits, int32_t n) {
+        cand_.reserve((size_t)n);
+        probs_.reserve((size_t)n);
+        auto value = [&](int32_t i) {
+            return penalized(i) ? penalize(logits[i]) : logits[i];
+        };
+        if (p_.min_p > 0.0f && p_.min_p <= 1.0f) {
+            float mx = -INFINITY;
+            for (int32_t i = 0; i < n; ++i) mx = std::max(mx, value(i));
+            const float thr = mx + logf(p_.min_p);
+            for (int32_t i = 0; i < n; ++i) {
+                const float l = value(i);
+                if (l >= thr) cand_.push_back({l, (llama_token)i});
+            }
+            if (cand_.size() >= p_.min_keep) return;
+            cand_.clear();
+        }
+        for (int32_t i = 0; i < n; ++i) cand_.push_back({value(i), (llama_token)i});
+    }
+
+    // cand_ 已是惩罚后的候选：取 top-k 排序，min-p → top-p → 温度 → 抽样
+    llama_token finish(size_t k) {
+        if (cand_.empty()) return LLAMA_TOKEN_NULL;
+        auto desc = [](const Cand& a, const Cand& b) { return a.logit > b.logit; };
+        k = std::min(k, cand_.size());
+        std::partial_sort(cand_.begin(), cand_.begin() + (ptrdiff_t)k, cand_.end(), desc);
+        cand_.resize(k);
+        if (!(p_.temp > 0.0f)) return cand_[0].id;
+
+        size_t n = cand_.size();
+        if (p_.min_p > 0.0f && p_.min_p <= 1.0f) {
+            const float thr = cand_[0].logit + logf(p_.min_p);
+            size_t i = 1;
+            for (; i < n; ++i) if (cand_[i].logit < thr && i >= p_.min_keep) break;
+            n = i;
+        }
+        probs_.resize(n);
+        if (p_.top_p > 0.0f && p_.top_p < 1.0f) {
+            double sum = 0;
+            for (size_t i = 0; i < n; ++i) { probs_[i] = expf(cand_[i].logit - cand_[0].logit); sum += probs_[i]; }
+            double cum = 0;
+            for (size_t i = 0; i < n; ++i) {
+                cum += probs_[i] / sum;
+                if (cum >= p_.top_p && i + 1 >= p_.min_keep) { n = i + 1; break; }
+            }
+        }
+        const float inv_t = 1.0f / p_.temp;
+        double sum = 0;
+        for (size_t i = 0; i < n; ++i) { probs_[i] = expf((cand_[i].logit - cand_[0].logit) * inv_t); sum += probs_[i]; }
+        double r = std::uniform_real_distribution<double>(0.0, sum)(rng_);
+        for (size_t i = 0; i < n; ++i) {
+            r -= probs_[i];
+            if (r < 0) return cand_[i].id;
+        }
+        return cand_[n - 1].id;
+    }
+
+    FusedSamplerParams                   p_;
+    std::vector<llama_token>             hist_;        // 惩罚窗口（环形）
+    size_t                               hist_head_ = 0;
+    std::vector<Uniq>                    uniq_;        // 窗口内各 token 出现次数
+    std::vector<Slot>                    slots_;       // 2 的幂，至少是窗口长度的 2 倍
+    int                                  slot_shift_ = 28;
+    std::mt19937                         rng_;
+    std::vector<Cand>                    cand_;
+    std::vector<float>                   probs_;
+    std::vector<float>                   dense_;
+    std::vector<float>                   probe_;       // 估阈值用的抽样
+
+    static constexpr int32_t kProbe     = 4096;
+    static constexpr size_t  kSimdSlack = 8;   // collect_above 一组最多多放的个数
+};
+
+// ---- 作为 llama_sampler 注册（llama_sampler_i），可进链、可 clone ----
+namespace fused_sampler_detail {
+inline FusedSampler* self(const llama_sampler* s) { return static_cast<FusedSampler*>(s->ctx); }
+inline const char* name(const llama_sampler*) { return "fused"; }
+inline void accept(llama_sampler* s, llama_token t) { self(s)->accept(t); }
+inline void apply(llama_sampler* s, llama_token_data_array* cur_p) { cur_p->selected = self(s)->apply(cur_p); }
+inline void reset(llama_sampler* s) { self(s)->reset(); }
+inline llama_sampler* clone(const llama_sampler* s);
+inline void free(llama_sampler* s) { delete self(s); }
+inline const llama_sampler_i iface = {name, accept, apply, reset, clone, free};
+inline llama_sampler* clone(const llama_sampler* s) { return llama_sampler_init(&iface, new FusedSampler(*self(s))); }
+}  // namespace fused_sampler_detail
+
+inline llama_sampler* fused_sampler_init(const FusedSamplerParams& p) {
+    return llama_sampler_init(&fused_sampler_detail::iface, new FusedSampler(p));
+}
+
+// smpl 是融合采样器时返回其实现（可直接在原始 logits 上采样，省掉候选数组），否则 nullptr
+inline FusedSampler* fused_sampler_of(llama_sampler* smpl) {
+    return smpl && smpl->iface == &fused_sampler_detail::iface ? fused_sampler_detail::self(smpl) : nullptr;
+}
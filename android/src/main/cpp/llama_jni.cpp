@@ -1,15 +1,33 @@
 #include <jni.h>
 #include <atomic>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cstdint>
 #include <algorithm>
 #include <limits>
 #include <memory>
+#include <new>
 #include <mutex>
-#include <unistd.h> // sysconf
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <unistd.h> // sysconf, fsync
+#include <sys/stat.h>
+#include <zlib.h>
 
 #include "llama.h"
+#include "alloc_audit.h"
+#include "fused_sampler.h"
+#include "prefix_cache.h"
+#include "sampling_rcu.h"
+#include "stop_matcher.h"
+#include "think_filter.h"
+#include "utf8_stream.h"
 #include <android/log.h>
 
 #define LOG_TAG "MyNativeModule"
@@ -22,10 +40,184 @@ static llama_model*       g_model   = nullptr;
 static llama_context*     g_ctx     = nullptr;
 static const llama_vocab* g_vocab   = nullptr;
 static std::atomic<bool>  g_stop{false};
+static std::atomic<int64_t> g_deadline_us{0};   // 当前请求截止时间（steady_clock 微秒），0 = 不限
+static std::atomic<int64_t> g_stop_at_us{0};    // nativeStop 的时刻，用于统计 stop→空闲 延迟
 static std::mutex         g_mutex;
 
 static llama_context_params g_cparams{};  // 记住最近一次 init 的 cparams，便于重建上下文
 
+// ===== JNI 句柄缓存：JNI_OnLoad 时解析一次，生成线程直接用 =====
+struct JniCache {
+    JavaVM*   vm          = nullptr;
+    jclass    cls         = nullptr;   // LlamaNative（全局引用）
+    jmethodID on_token    = nullptr;   // onNativeToken(String text, int nTokens)
+    jmethodID on_progress = nullptr;   // onNativeProgress(long id, int done, int total)
+    jmethodID on_done     = nullptr;   // onNativeDone(long)
+    jmethodID on_result   = nullptr;   // onNativeResult(long, String)
+    jmethodID on_segment  = nullptr;   // onNativeSegment(int kind, int index, String text)
+    jmethodID on_begin    = nullptr;   // onNativeBegin(long id)
+    jmethodID on_thought  = nullptr;   // onNativeThought(String text, int nTokens)
+};
+static JniCache g_jni;
+
+// 回调里 Java 抛出的异常不能带着继续调 JNI：打印后清掉
+static inline void jni_clear_exception(JNIEnv* env) {
+    if (env->ExceptionCheck()) {
+        env->ExceptionDescribe();
+        env->ExceptionClear();
+    }
+}
+
+// ===== 性能统计（nativeGetPerfStats 以 JSON 导出）=====
+struct PerfStats {
+    uint64_t requests        = 0;
+    uint64_t ctx_allocs      = 0;   // llama_init_from_model 次数（KV/计算图整块分配）
+    uint64_t ctx_frees       = 0;
+    uint64_t mem_clears      = 0;   // 通过 memory API 复位的次数（不分配）
+    uint64_t standby_swaps   = 0;   // 上下文损坏时换上备用上下文的次数
+    double   ctx_alloc_ms    = 0;   // 累计分配耗时
+    double   setup_ms_last   = 0;   // 单次请求准备耗时：复位 + tokenize + 会话对齐（不含 prefill 计算）
+    double   setup_ms_total  = 0;
+    PrefixCache::Stats prefix;      // 前缀 KV 缓存命中/淘汰
+    uint64_t prefill_tokens  = 0;   // 分块 prefill：累计 token / 耗时、最近一次吞吐与块大小
+    double   prefill_ms      = 0;
+    double   prefill_tps_last = 0;
+    int32_t  prefill_chunk_last = 0;
+    int64_t  peak_rss_kb     = 0;   // /proc/self/status VmHWM
+    uint64_t steady_tokens   = 0;   // 稳态（跳过前几个 token）解码的 token 数与其间的堆分配次数
+    uint64_t steady_allocs   = 0;
+    double   ingest_us_last  = 0;   // 最近一次请求：Java 字符串 -> UTF-8 的耗时/字节数，prompt tokenize 耗时/token 数
+    uint64_t ingest_bytes_last = 0;
+    double   tokenize_ms_last  = 0;
+    uint64_t prompt_tokens_last = 0;
+    double   piece_table_ms  = 0;   // 词表 piece 表构建耗时与占用
+    double   piece_table_kb  = 0;
+    double   detok_ns_legacy = 0;   // 单 token detok 抽样耗时：llama_token_to_piece vs 查表
+    double   detok_ns_table  = 0;
+    double   stop_latency_ms_last = 0;   // stop→请求返回 的延迟，分阶段记录
+    double   stop_latency_ms_prefill = 0;
+    double   stop_latency_ms_decode  = 0;
+    uint64_t aborts          = 0;   // 计算图被 abort 回调中途打断的次数
+    uint64_t deadline_hits   = 0;
+    uint64_t stream_flushes  = 0;   // 流式合并：onNativeToken 回调次数 / 覆盖的 token 数
+    uint64_t stream_tokens   = 0;
+    double   stream_hold_ms_total = 0;       // token 从产生到送出的累计滞留
+    double   stream_flush_per_sec_last = 0;  // 最近一次请求的每秒桥调用数与最大滞留
+    double   stream_hold_ms_max_last   = 0;
+    uint64_t ring_records    = 0;   // 零拷贝环：写入记录数、反压停顿、水位
+    uint64_t ring_stalls     = 0;
+    double   ring_stall_ms   = 0;
+    uint64_t ring_high_water = 0;   // 字节
+    double   essay_first_sentence_ms_last = 0;   // 流式作文：首句事件 / 全文完成距请求开始的耗时
+    double   essay_total_ms_last          = 0;
+    uint64_t essay_sentences_last         = 0;
+    uint64_t queue_started     = 0;   // 调度：开始执行的请求数及其排队等待
+    double   queue_wait_ms_last  = 0;
+    double   queue_wait_ms_total = 0;
+    double   queue_wait_ms_max   = 0;
+    uint64_t queue_expired     = 0;   // 排队期间就过了截止时间
+    uint64_t preemptions       = 0;   // 后台请求让位给交互请求的次数
+    uint64_t cancelled_by_id   = 0;
+    uint64_t batch_runs        = 0;   // 连续批处理：每步 decode 的序列数、生成/prefill token 数、聚合吞吐
+    uint64_t batch_steps       = 0;
+    uint64_t batch_slot_steps  = 0;
+    uint64_t batch_tokens      = 0;
+    uint64_t batch_prefill_tokens = 0;
+    uint64_t batch_active_max  = 0;
+    double   batch_tps_last    = 0;
+    uint64_t batch_forks       = 0;   // 从同批序列分叉共享前缀（seq_cp）的次数与省下的 prefill token
+    uint64_t batch_fork_tokens = 0;
+    double   generate_tps_last = 0;   // 逐个生成（run_generate）的解码吞吐，对照 batch_tps_last
+    double   set_sampling_us_last = 0;   // setSampling 本身的耗时（不再等生成结束）
+    double   set_sampling_us_max  = 0;
+    uint64_t sampling_swaps       = 0;   // 生成中途换采样链的次数
+    uint64_t grammar_compiles     = 0;   // 语法约束：编译（缓存未命中）/命中/解析失败
+    uint64_t grammar_compile_hits = 0;
+    uint64_t grammar_errors       = 0;
+    uint64_t grammar_tokens       = 0;   // 受约束的 token 数 = 采到即合法的 + 整表重采的
+    uint64_t grammar_fast         = 0;
+    uint64_t grammar_scans        = 0;
+    double   grammar_fast_us      = 0;   // 采到即合法：只检查一个 token 的耗时
+    double   grammar_scan_us      = 0;   // 不合法：整表过语法 + 重采的耗时（即不先试采样时每个 token 的代价）
+    double   grammar_us_total     = 0;   // 语法检查在每 token 上的总开销
+    uint64_t finish_eog           = 0;   // 生成结束原因：EOG（eos/<|im_end|> 等）/ 停止串 / 到 max_new
+    uint64_t finish_stop_string   = 0;
+    uint64_t finish_limit         = 0;
+    uint64_t finish_tokens        = 0;   // 上面三类请求生成的 token 总数
+    uint64_t stop_held_max        = 0;   // 停止串匹配扣住未发的最大字节数
+    uint64_t chat_tokens_last     = 0;   // 最近一轮 chat 生成的 token 数（含推理段）与解码耗时
+    double   chat_decode_ms_last  = 0;
+    uint64_t think_tokens_last    = 0;   // Qwen3 推理段 token 数：最近一轮 / 累计
+    uint64_t think_tokens_total   = 0;
+    uint64_t think_budget_hits    = 0;   // 推理段到上限被强制结束的次数
+    uint64_t sample_calls    = 0;   // 每 token 采样（选 token + accept）的次数与累计耗时
+    double   sample_us_total = 0;
+    double   sampler_setup_us_last  = 0;  // 每个请求拿到自己的采样器（缓存原型 clone + reset）的耗时
+    double   sampler_setup_us_total = 0;
+    uint64_t sampler_setups         = 0;
+    uint64_t sampler_cache_hits     = 0;  // 按参数哈希命中已构建的原型链
+    uint64_t sampler_cache_misses   = 0;
+    double   session_save_ms = 0;   // 最近一次会话落盘/恢复耗时与文件大小
+    double   session_load_ms = 0;
+    uint64_t session_file_bytes = 0;
+};
+static PerfStats  g_perf;
+static std::mutex g_perf_mutex;     // 只护 g_perf，避免读统计时等 g_mutex
+
+static inline int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// ===== 取消：stop 标志 + 请求截止时间 =====
+static inline bool should_abort() {
+    if (g_stop.load(std::memory_order_relaxed)) return true;
+    const int64_t dl = g_deadline_us.load(std::memory_order_relaxed);
+    return dl > 0 && now_us() > dl;
+}
+
+// 挂到 llama_set_abort_callback：ggml 在图计算的节点之间调用，返回 true 即中途放弃本次 decode
+static bool llama_abort_cb(void*) { return should_abort(); }
+
+// stop 标志由调度器在取出任务时（持队列锁）清零，这里只设截止时间；
+// 否则 cancel(id) 落在“取出任务”和“开始执行”之间会被清掉
+static void begin_request(int64_t deadline_us) {
+    g_deadline_us.store(deadline_us, std::memory_order_relaxed);
+}
+
+// 解码循环的堆分配统计：前 kWarmTokens 个 token 允许缓冲扩容，之后每个 token 应为 0
+struct SteadyAllocMeter {
+    static constexpr int kWarmTokens = 4;
+    int      n      = 0;
+    uint64_t base   = 0;
+    void tick() {
+        if (++n == kWarmTokens) base = alloc_count();
+    }
+    void finish() {
+        if (n <= kWarmTokens) return;
+        const uint64_t allocs = alloc_count() - base;
+        if (allocs > 0) LOGW("decode loop: %llu heap allocations over %d steady tokens",
+                             (unsigned long long)allocs, n - kWarmTokens);
+        std::lock_guard<std::mutex> lk(g_perf_mutex);
+        g_perf.steady_tokens += (uint64_t)(n - kWarmTokens);
+        g_perf.steady_allocs += allocs;
+    }
+};
+
+// 请求返回前调用：统计 stop→空闲 延迟（in_prefill 区分阶段）和截止时间命中
+static void end_request(bool in_prefill) {
+    const int64_t stop_at = g_stop_at_us.exchange(0, std::memory_order_relaxed);
+    const int64_t dl = g_deadline_us.exchange(0, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    if (stop_at > 0) {
+        double ms = (now_us() - stop_at) / 1000.0;
+        g_perf.stop_latency_ms_last = ms;
+        (in_prefill ? g_perf.stop_latency_ms_prefill : g_perf.stop_latency_ms_decode) = ms;
+    } else if (dl > 0 && now_us() > dl) {
+        g_perf.deadline_hits++;
+    }
+}
+
 struct SamplerParams {
     float temp           = 0.8f;
     float top_p          = 0.95f;
@@ -34,32 +226,65 @@ struct SamplerParams {
     int   repeat_last_n  = 256;
     float min_p          = 0.05f;
     size_t min_keep      = 1;   // 给 top_p/min_p 用
+    uint64_t version     = 0;   // 发布序号，0 = 默认参数
 };
-static SamplerParams g_samp;     // 由 nativeSetSampling() 动态修改
+
+// ===== 采样参数发布（RCU，见 sampling_rcu.h）=====
+// nativeSetSampling 发布快照，不拿 g_mutex，生成中调用也立即返回；生成线程下一个 token 生效
+static SnapshotRcu<SamplerParams> g_samp_rcu;
+
+// 生成线程：当前发布的版本号
+static inline uint64_t sampling_version() { return g_samp_rcu.version(); }
+
+// 生成线程：拷贝当前快照，并声明更旧的快照已不再被读
+static SamplerParams sampling_snapshot() { return g_samp_rcu.snapshot(); }
+
+// 生成线程：两个请求之间不持有快照，空闲期间的发布随手回收旧快照
+static void sampling_quiesce() { g_samp_rcu.quiesce(); }
+
+static void publish_sampling(const SamplerParams& np) { g_samp_rcu.publish(np); }
 
 // ===== ChatML（Qwen3 风格）=====
-static std::string build_chatml_prompt(const std::string& user) {
-    std::string s;
-    s += "<|im_start|>system\nYou are a helpful assistant.<|im_end|>\n";
-    s += "<|im_start|>user\n" + user + "<|im_end|>\n";
+struct ChatMessage {
+    std::string role;     // system / user / assistant
+    std::string content;
+};
+
+// 渲染整段对话；首条不是 system 时补默认 system，保证前缀稳定（便于与 KV 里的历史做 diff）
+// 写进复用的 s（先按总长预留，拼接过程中不再扩容）。
+// no_think：与 Qwen3 模板 enable_thinking=false 一致，在回答开头预填空推理段，模型直接作答
+static void build_chatml_prompt(const std::vector<ChatMessage>& msgs, std::string& s, bool no_think) {
+    static const char kDefaultSystem[] = "<|im_start|>system\nYou are a helpful assistant.<|im_end|>\n";
+    size_t total = sizeof(kDefaultSystem) + 64;
+    for (const auto& m : msgs) total += m.role.size() + m.content.size() + 24;
+    s.clear();
+    s.reserve(total);
+    if (msgs.empty() || msgs.front().role != "system") {
+        s += kDefaultSystem;
+    }
+    for (const auto& m : msgs) {
+        s.append("<|im_start|>").append(m.role).append("\n").append(m.content).append("<|im_end|>\n");
+    }
     s += "<|im_start|>assistant\n";
-    return s;
+    if (no_think) s += "<think>\n\n</think>\n\n";
 }
 
 // ===== 作文 prompt（保留）=====
+// 固定的要求放在最前面，作为所有作文请求共享的前缀（命中前缀 KV 缓存）；
+// 与 LLMPlugin.buildEssayPrompt 保持逐字一致
+static const char* const kEssayPromptHead =
+        "Write an essay that follows these requirements:\n"
+        "- Clear structure with introduction, body, and conclusion.\n"
+        "- Use simple sentences suitable for ESL learners.\n"
+        "- Avoid overly complex grammar. Keep the vocabulary practical.\n";
+
 static std::string build_essay_prompt(
         const std::string& title,
         int                word_limit,
         const std::string& lang,
         const std::vector<std::string>& hi_err,
         const std::vector<std::string>& hi_freq) {
-    std::string s;
-    s += "Write a " + lang + " essay.\n";
-    s += "Title: " + title + "\n";
-    s += "Length: ~" + std::to_string(std::max(50, word_limit)) + " words.\n";
-    s += "Requirements:\n";
-    s += "- Clear structure with introduction, body, and conclusion.\n";
-    s += "- Use simple sentences suitable for ESL learners.\n";
+    std::string s = kEssayPromptHead;
     if (!hi_err.empty()) {
         s += "- Pay attention to commonly mistaken words: ";
         for (size_t i = 0; i < hi_err.size(); ++i) {
@@ -74,136 +299,324 @@ static std::string build_essay_prompt(
             s += (i + 1 == hi_freq.size()) ? ".\n" : ", ";
         }
     }
-    s += "- Avoid overly complex grammar. Keep the vocabulary practical.\n";
+    s += "Language: " + lang + "\n";
+    s += "Title: " + title + "\n";
+    s += "Length: ~" + std::to_string(std::max(50, word_limit)) + " words.\n";
     s += "Now produce only the final essay content.\n";
     return s;
 }
 
-// ===== UTF-8 安全拼接 =====
-static std::string g_pending_utf8;
-
-// ========== 新增：UTF-8 -> UTF-16 安全解码器（只解到“完整码点”为止”） ==========
-static size_t utf8_decode_to_utf16_partial(const std::string &in,
-                                           std::u16string &out_u16) {
-    out_u16.clear();
-    const uint8_t *p = (const uint8_t *)in.data();
-    size_t i = 0, n = in.size();
-
-    auto emit_u16 = [&](uint32_t cp) {
-        if (cp <= 0xFFFF) {
-            // 避免直接落入代理区
-            if (cp >= 0xD800 && cp <= 0xDFFF) cp = 0xFFFD;
-            out_u16.push_back((char16_t)cp);
-        } else if (cp <= 0x10FFFF) {
-            cp -= 0x10000;
-            char16_t hi = (char16_t)(0xD800 + (cp >> 10));
-            char16_t lo = (char16_t)(0xDC00 + (cp & 0x3FF));
-            out_u16.push_back(hi);
-            out_u16.push_back(lo);
-        } else {
-            out_u16.push_back((char16_t)0xFFFD);
-        }
-    };
-
-    while (i < n) {
-        uint8_t b0 = p[i];
-
-        if (b0 < 0x80) {
-            // ASCII
-            emit_u16(b0);
-            ++i;
-        } else if ((b0 & 0xE0) == 0xC0) {
-            if (i + 1 >= n) break; // 不完整
-            uint8_t b1 = p[i + 1];
-            if ((b1 & 0xC0) != 0x80) { emit_u16(0xFFFD); ++i; continue; }
-            uint32_t cp = ((b0 & 0x1F) << 6) | (b1 & 0x3F);
-            // 过短（Overlong）修正
-            if (cp < 0x80) cp = 0xFFFD;
-            emit_u16(cp);
-            i += 2;
-        } else if ((b0 & 0xF0) == 0xE0) {
-            if (i + 2 >= n) break;
-            uint8_t b1 = p[i + 1], b2 = p[i + 2];
-            if ((b1 & 0xC0) != 0x80 || (b2 & 0xC0) != 0x80) { emit_u16(0xFFFD); ++i; continue; }
-            uint32_t cp = ((b0 & 0x0F) << 12) | ((b1 & 0x3F) << 6) | (b2 & 0x3F);
-            // 过短或代理区
-            if (cp < 0x800) cp = 0xFFFD;
-            emit_u16(cp);
-            i += 3;
-        } else if ((b0 & 0xF8) == 0xF0) {
-            if (i + 3 >= n) break;
-            uint8_t b1 = p[i + 1], b2 = p[i + 2], b3 = p[i + 3];
-            if ((b1 & 0xC0) != 0x80 || (b2 & 0xC0) != 0x80 || (b3 & 0xC0) != 0x80) { emit_u16(0xFFFD); ++i; continue; }
-            uint32_t cp = ((b0 & 0x07) << 18) | ((b1 & 0x3F) << 12) | ((b2 & 0x3F) << 6) | (b3 & 0x3F);
-            // 合法范围
-            if (cp < 0x10000 || cp > 0x10FFFF) cp = 0xFFFD;
-            emit_u16(cp);
-            i += 4;
-        } else {
-            // 非法起始字节，跳过 1
-            emit_u16(0xFFFD);
-            ++i;
-        }
+// 已知的固定 prompt 头（字节数）：ChatML 的 system 段、作文的要求段。0 表示没有
+static size_t prompt_head_bytes(const std::string& prompt) {
+    static const std::string kSys = "<|im_start|>system\n";
+    static const std::string kEnd = "<|im_end|>\n";
+    if (prompt.compare(0, kSys.size(), kSys) == 0) {
+        size_t e = prompt.find(kEnd, kSys.size());
+        return e == std::string::npos ? 0 : e + kEnd.size();
     }
-    // 返回“已安全消费”的字节数（剩余的是不完整尾巴，留给下一次）
-    return i;
+    const size_t n = std::char_traits<char>::length(kEssayPromptHead);
+    if (prompt.compare(0, n, kEssayPromptHead) == 0) return n;
+    return 0;
 }
 
-// ========== 修改：用 UTF-16 发给 Java（避免 NewStringUTF 的 Modified-UTF8 限制） ==========
-static void emit_utf8_safely(JNIEnv* env, jobject cb, jclass /*cbCls*/, jmethodID midOnToken,
-                             const std::string& chunk) {
-    // 累积 UTF-8
-    g_pending_utf8.append(chunk);
+// ===== 批次缓冲 =====
+struct BatchBuf {
+    std::vector<llama_token>   token;
+    std::vector<llama_pos>     pos;
+    std::vector<int32_t>       n_seq_id;
+    std::vector<llama_seq_id>  seq_id_store;
+    std::vector<llama_seq_id*> seq_id_ptrs;
+    std::vector<int8_t>        logits;
 
-    // 尝试解码尽可能多的“完整码点”
-    std::u16string u16;
-    size_t consumed = utf8_decode_to_utf16_partial(g_pending_utf8, u16);
-    if (consumed == 0 || u16.empty()) {
-        // 还没有完整码点，等下次
-        return;
+    void resize(int n) {
+        token.resize(n); pos.resize(n);
+        n_seq_id.assign(n, 1);
+        seq_id_store.assign(n, 0);
+        seq_id_ptrs.resize(n);
+        logits.assign(n, 0);
+        for (int i = 0; i < n; ++i) seq_id_ptrs[i] = &seq_id_store[i];
+    }
+    // 只增不减：容量够就什么都不做（热路径上不分配）
+    void ensure(int n) { if ((int)token.size() < n) resize(n); }
+    llama_batch as_batch() { return as_batch((int)token.size()); }
+    llama_batch as_batch(int n) {
+        llama_batch b{};
+        b.n_tokens = n;
+        b.token    = token.data();
+        b.embd     = nullptr;
+        b.pos      = pos.data();
+        b.n_seq_id = n_seq_id.data();
+        b.seq_id   = seq_id_ptrs.data();
+        b.logits   = logits.data();
+        return b;
     }
+};
 
-    // 从 pending 中移除已消费字节
-    g_pending_utf8.erase(0, consumed);
+// ===== 解码热路径的预分配缓冲：init 时按 n_batch / n_vocab 一次分配，之后每个 token 零堆分配 =====
+struct DecodeArena {
+    BatchBuf                      batch;     // prefill 块与单步 decode 共用
+    std::vector<llama_token_data> cand;      // 采样候选（n_vocab）
+    std::vector<float>            masked;    // 语法过滤后的 logits（n_vocab，只在整表重采时用）
+    std::string                   piece;     // detok 输出
+    std::string                   released;  // 过停止串匹配后可以放出的字节
+    Utf8Stream                    utf8;      // 流式解码状态（未凑成完整码点的尾巴放在固定 carry 里）
+    std::string                   out;       // 一次性生成的累积输出
+    std::string                   prompt;    // 渲染后的 ChatML prompt
+    std::vector<llama_token>      ptok;      // prompt 的 token
+
+    void reserve(int n_batch, int n_vocab) {
+        batch.ensure(std::max(1, n_batch));
+        cand.resize((size_t)std::max(0, n_vocab));
+        masked.resize((size_t)std::max(0, n_vocab));
+        piece.reserve(256);
+        released.reserve(256);
+    }
+    void release() {
+        *this = DecodeArena{};
+    }
+};
+static DecodeArena g_arena;
+
+// ===== 零拷贝 token 流：Java 分配的 direct ByteBuffer 做单生产者/单消费者环形缓冲 =====
+// 布局：[0,8) head（生产者发布位置），[64,72) tail（消费者已读位置），[128, 128+cap) 数据，cap 为 2 的幂
+// 记录 16 字节对齐：{int32 kind, int32 units, int64 value} + UTF-16 文本
+//   kind 1 = 文本（value = token 数），2 = 请求结束（value = 请求 id），0 = 填充到环尾，
+//   3/4 = 作文的整句/整段（value = 序号，文本不拆分），5 = 之后的文本属于哪个请求（value = 请求 id），
+//   6 = 推理段文本（Qwen3 的 <think>，value = token 数，与 1 一样可拆）
+// 消费者在 nativeRingAwait 里回写 tail 并等新数据（条件变量唤醒，不回调 Java）；
+// 环满时生产者等消费者腾出空间（不丢数据、内存恒定），只有断开（nativeRingAttach(null)）才停止等待。
+// 写不进环而改走直接回调之前，先等环里已发布的记录被读完，回调不会越过排在前面的记录
+// （生成线程是唯一的生产者，等待期间不会有新记录）
+enum RingRecord : int32_t { kRecPad = 0, kRecText = 1, kRecEnd = 2, kRecSentence = 3, kRecParagraph = 4, kRecBegin = 5, kRecThought = 6 };
+static constexpr uint32_t kRingHeader = 128;
+static constexpr uint32_t kRingRecHdr = 16;
+static constexpr int64_t  kRingStallLogUs = 10 * 1000 * 1000;   // 消费者久不动时每 10s 告警一次（仍然等）
+
+struct StreamRing {
+    std::mutex              mu;
+    std::condition_variable cv;        // 双向：生产者发布 / 消费者腾出空间
+    uint8_t*                base = nullptr;
+    uint64_t                cap  = 0;
+    jobject                 ref  = nullptr;   // ByteBuffer 全局引用，保证内存存活
+
+    bool attached() const { return base != nullptr; }
+    uint64_t head() const { return __atomic_load_n(reinterpret_cast<uint64_t*>(base), __ATOMIC_ACQUIRE); }
+    uint64_t tail() const { return __atomic_load_n(reinterpret_cast<uint64_t*>(base + 64), __ATOMIC_ACQUIRE); }
+    void set_head(uint64_t v) { __atomic_store_n(reinterpret_cast<uint64_t*>(base), v, __ATOMIC_RELEASE); }
+    void set_tail(uint64_t v) { __atomic_store_n(reinterpret_cast<uint64_t*>(base + 64), v, __ATOMIC_RELEASE); }
+    uint8_t* at(uint64_t pos) { return base + kRingHeader + (pos & (cap - 1)); }
+};
+static StreamRing g_ring;
 
-    // 通过 UTF-16 构建 Java 字符串
-    jstring jtok = env->NewString(reinterpret_cast<const jchar*>(u16.data()),
-                                  static_cast<jsize>(u16.size()));
-    if (!jtok) return;
-    env->CallVoidMethod(cb, midOnToken, jtok);
-    env->DeleteLocalRef(jtok);
+static inline uint64_t ring_rec_size(uint32_t units) {
+    return ((uint64_t)kRingRecHdr + (uint64_t)units * 2 + 15) & ~(uint64_t)15;
 }
 
-static void flush_pending(JNIEnv* env, jobject cb, jclass /*cbCls*/, jmethodID midOnToken) {
-    if (g_pending_utf8.empty()) return;
+// 写一条记录（必要时先填充到环尾）；调用方保证 ring_rec_size(units) <= cap / 2。
+// 空间不够就等消费者；等待中被断开返回 false（这条没写）
+static bool ring_put(std::unique_lock<std::mutex>& lk, int32_t kind, const char16_t* p, uint32_t units, int64_t value) {
+    StreamRing& r = g_ring;
+    const uint64_t need = ring_rec_size(units);
+    uint64_t head = r.head();
+    const uint64_t to_end = r.cap - (head & (r.cap - 1));
+    const uint64_t total = need > to_end ? to_end + need : need;
+
+    // 等空间：消费者慢时生产者停下（反压），按停顿次数/时长记统计
+    uint64_t tail = r.tail();
+    if (r.cap - (head - tail) < total) {
+        const int64_t t0 = now_us();
+        int64_t last_log = t0;
+        while (r.cap - (head - (tail = r.tail())) < total) {
+            r.cv.wait_for(lk, std::chrono::milliseconds(10));
+            if (!r.attached()) return false;
+            if (now_us() - last_log > kRingStallLogUs) {
+                last_log = now_us();
+                LOGW("stream ring: consumer stalled for %.1f s, still waiting", (last_log - t0) / 1e6);
+            }
+        }
+        std::lock_guard<std::mutex> plk(g_perf_mutex);
+        g_perf.ring_stalls++;
+        g_perf.ring_stall_ms += (now_us() - t0) / 1000.0;
+    }
 
-    std::u16string u16;
-    size_t consumed = utf8_decode_to_utf16_partial(g_pending_utf8, u16);
+    if (need > to_end) {
+        int32_t pad[4] = {kRecPad, 0, 0, 0};
+        memcpy(r.at(head), pad, sizeof(pad));
+        head += to_end;
+    }
+    uint8_t* dst = r.at(head);
+    memcpy(dst, &kind, 4);
+    memcpy(dst + 4, &units, 4);
+    memcpy(dst + 8, &value, 8);
+    if (units) memcpy(dst + kRingRecHdr, p, (size_t)units * 2);
+    r.set_head(head + need);
+    r.cv.notify_all();
+
+    std::lock_guard<std::mutex> plk(g_perf_mutex);
+    g_perf.ring_records++;
+    g_perf.ring_high_water = std::max<uint64_t>(g_perf.ring_high_water, head + need - r.tail());
+    return true;
+}
+
+// 等消费者读完环里已发布的记录（或环被断开）
+static void ring_wait_drained(std::unique_lock<std::mutex>& lk) {
+    StreamRing& r = g_ring;
+    while (r.attached() && r.tail() != r.head()) r.cv.wait_for(lk, std::chrono::milliseconds(10));
+}
 
-    if (consumed > 0 && !u16.empty()) {
-        jstring jtok = env->NewString(reinterpret_cast<const jchar*>(u16.data()),
-                                      static_cast<jsize>(u16.size()));
-        if (jtok) {
-            env->CallVoidMethod(cb, midOnToken, jtok);
-            env->DeleteLocalRef(jtok);
+// 文本超过半个环时切成多条，token 数记在第一条上；全部写进返回 true。
+// 返回 false 时 *written = 已写进环的 UTF-16 单元数（只有文本会部分写入），调用方只需回调剩下的部分，
+// 且此时环里已没有未读记录。句/段记录放不下时不拆，等环读空后返回 false，整条走回调
+static bool ring_write(int32_t kind, const char16_t* p, size_t units, int64_t value, size_t* written = nullptr) {
+    if (written) *written = 0;
+    std::unique_lock<std::mutex> lk(g_ring.mu);
+    if (!g_ring.attached()) return false;
+    const size_t max_units = (size_t)(g_ring.cap / 2 - kRingRecHdr) / 2;
+    if (kind != kRecText && kind != kRecThought && units > max_units) {
+        ring_wait_drained(lk);
+        return false;
+    }
+    size_t done = 0;
+    do {
+        size_t n = std::min(units - done, max_units);
+        if (done + n < units && n > 1 && p[done + n - 1] >= 0xD800 && p[done + n - 1] <= 0xDBFF) --n;   // 不拆开代理对
+        if (!ring_put(lk, kind, p + done, (uint32_t)n, done == 0 ? value : 0)) {
+            if (written) *written = done;
+            return false;
         }
-        g_pending_utf8.erase(0, consumed);
+        done += n;
+    } while (done < units);
+    return true;
+}
+
+// ===== 流式合并：多个 token 攒成一次 onNativeToken，减少 JNI/Capacitor 桥调用 =====
+// flush_ms / flush_chars 任一到达即发；boundary 额外在词/句边界处发。全 0 = 每个 token 发一次
+enum StreamBoundary : int32_t { kBoundaryNone = 0, kBoundaryWord = 1, kBoundarySentence = 2 };
+static std::atomic<int32_t> g_stream_flush_ms{0};      // nativeSetStreamPolicy 随时可改，下个请求生效
+static std::atomic<int32_t> g_stream_flush_chars{0};
+static std::atomic<int32_t> g_stream_boundary{kBoundaryNone};
+
+static inline bool is_sentence_end(char16_t c) {
+    switch (c) {
+        case u'.': case u'!': case u'?': case u'\n':
+        case u'。': case u'！': case u'？': case u'；': case u';':
+            return true;
+        default:
+            return false;
     }
+}
+static inline bool is_word_end(char16_t c) {
+    if (c == u' ' || c == u'\t' || c == u',' || c == u':' || c == u'，' || c == u'、' || c == u'：') return true;
+    if (c >= 0x4E00 && c <= 0x9FFF) return true;   // CJK 没有空格，每个字都算词边界
+    return is_sentence_end(c);
+}
 
-    // 若仍有残留（不完整尾巴），为了输出对齐，可以在结束时丢弃或补 U+FFFD：
-    if (!g_pending_utf8.empty()) {
-        // 方案 A：丢弃
-        // g_pending_utf8.clear();
+// 标记之后的 token 流属于哪个请求：后台请求被抢占、或多个请求同批生成时，
+// 不同请求的文本会在同一条流里交错；只在归属变化时发一次（只在生成线程访问）
+static int64_t g_stream_owner = 0;
+static void emit_begin(JNIEnv* env, jobject cb, int64_t id) {
+    if (id == 0 || id == g_stream_owner) return;
+    g_stream_owner = id;
+    if (ring_write(kRecBegin, nullptr, 0, id)) return;
+    env->CallVoidMethod(cb, g_jni.on_begin, (jlong)id);
+    jni_clear_exception(env);
+}
 
-        // 方案 B：输出一个 U+FFFD 表示替代字符
-        std::u16string repl(1, (char16_t)0xFFFD);
-        jstring jtok2 = env->NewString(reinterpret_cast<const jchar*>(repl.data()), 1);
-        if (jtok2) {
-            env->CallVoidMethod(cb, midOnToken, jtok2);
-            env->DeleteLocalRef(jtok2);
+struct TokenStreamer {
+    int64_t        owner       = 0;   // 所属请求 id
+    int32_t        flush_ms    = 0;
+    int32_t        flush_chars = 0;
+    int32_t        boundary    = kBoundaryNone;
+    int32_t        channel     = kRecText;   // buf 属于回答（kRecText）还是推理段（kRecThought）
+    std::u16string buf;               // 待发的 UTF-16（容量预留，不随 token 分配）
+    int32_t        n_tokens    = 0;   // buf 里包含的 token 数（含还没凑成完整码点的）
+    int64_t        first_us    = 0;   // buf 里最早一个 token 的到达时间
+    int64_t        arrive_sum  = 0;   // buf 里各 token 到达时间之和，用于算平均滞留
+    // 本次请求统计
+    int64_t        begin_us    = 0;
+    uint64_t       flushes     = 0;
+    uint64_t       tokens      = 0;
+    double         hold_ms_sum = 0;
+    double         hold_ms_max = 0;
+
+    void begin(int64_t owner_id) {
+        owner       = owner_id;
+        flush_ms    = std::max(0, g_stream_flush_ms.load(std::memory_order_relaxed));
+        flush_chars = std::max(0, g_stream_flush_chars.load(std::memory_order_relaxed));
+        boundary    = g_stream_boundary.load(std::memory_order_relaxed);
+        channel = kRecText;
+        buf.clear();
+        buf.reserve(1024);
+        n_tokens = 0; first_us = 0; arrive_sum = 0;
+        begin_us = now_us(); flushes = 0; tokens = 0; hold_ms_sum = 0; hold_ms_max = 0;
+    }
+    void add_text(const char16_t* p, size_t n) { buf.append(p, n); }
+    void add_token(int64_t t_us) {
+        if (n_tokens == 0) first_us = t_us;
+        ++n_tokens;
+        arrive_sum += t_us;
+    }
+    bool due(int64_t t_us) const {
+        if (buf.empty()) return false;
+        if (flush_ms == 0 && flush_chars == 0 && boundary == kBoundaryNone) return true;
+        if (flush_ms > 0 && t_us - first_us >= (int64_t)flush_ms * 1000) return true;
+        if (flush_chars > 0 && (int32_t)buf.size() >= flush_chars) return true;
+        const char16_t last = buf.back();
+        if (boundary == kBoundarySentence && is_sentence_end(last)) return true;
+        if (boundary == kBoundaryWord && is_word_end(last)) return true;
+        return false;
+    }
+    void flush(JNIEnv* env, jobject cb, int64_t t_us) {
+        if (buf.empty()) return;
+        emit_begin(env, cb, owner);
+        // 挂了环就写环（不建 jstring），否则直接回调；环中途断开时只回调没写进去的部分
+        size_t written = 0;
+        if (!ring_write(channel, buf.data(), buf.size(), n_tokens, &written)) {
+            jstring jtext = env->NewString(reinterpret_cast<const jchar*>(buf.data() + written), static_cast<jsize>(buf.size() - written));
+            if (jtext) {
+                env->CallVoidMethod(cb, channel == kRecThought ? g_jni.on_thought : g_jni.on_token, jtext, (jint)(written ? 0 : n_tokens));
+                env->DeleteLocalRef(jtext);
+                jni_clear_exception(env);
+            }
         }
-        g_pending_utf8.clear();
+        const double hold_ms = ((double)n_tokens * (double)t_us - (double)arrive_sum) / 1000.0;
+        hold_ms_sum += hold_ms;
+        hold_ms_max  = std::max(hold_ms_max, (t_us - first_us) / 1000.0);
+        tokens      += (uint64_t)n_tokens;
+        flushes++;
+        buf.clear();
+        n_tokens = 0; arrive_sum = 0;
     }
+    // 回答/推理段切换：先把另一边攒着的发掉，两路文本不混在一条记录里
+    void set_channel(JNIEnv* env, jobject cb, int32_t ch) {
+        if (ch == channel) return;
+        flush(env, cb, now_us());
+        channel = ch;
+    }
+};
+static TokenStreamer g_streamer;
+
+// ===== UTF-8 安全拼接 =====
+// UTF-8 片段接着上次的尾巴解码，完整码点直接追加到合并缓冲
+// （走 UTF-16，避免 NewStringUTF 的 Modified-UTF8 限制）
+static void emit_utf8_safely(std::string_view chunk) {
+    g_arena.utf8.feed(chunk.data(), chunk.size(), g_streamer.buf);
+}
+
+// 请求结束：残留的不完整尾巴补 U+FFFD，连同合并缓冲一起发出，并记统计
+static void flush_pending(JNIEnv* env, jobject cb) {
+    g_arena.utf8.finish(g_streamer.buf);
+    const int64_t t = now_us();
+    g_streamer.flush(env, cb, t);
+
+    const TokenStreamer& st = g_streamer;
+    const double secs = (t - st.begin_us) / 1e6;
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    g_perf.stream_flushes       += st.flushes;
+    g_perf.stream_tokens        += st.tokens;
+    g_perf.stream_hold_ms_total += st.hold_ms_sum;
+    g_perf.stream_flush_per_sec_last = secs > 0 ? st.flushes / secs : 0;
+    g_perf.stream_hold_ms_max_last   = st.hold_ms_max;
 }
 
 // ===== API 轻封装 =====
@@ -216,317 +629,1631 @@ static inline int32_t vocab_size(const llama_vocab* vocab) {
 static inline llama_token tok_eos(const llama_vocab* vocab) {
     return llama_vocab_eos(vocab);
 }
+// 生成结束符：eos 之外还有 <|im_end|>（EOT）、<|endoftext|> 等
+static inline bool tok_is_eog(const llama_vocab* vocab, llama_token t) {
+    return llama_vocab_is_eog(vocab, t);
+}
 static inline int token_to_piece(const llama_vocab* vocab, llama_token t, char* buf, int n) {
     return llama_token_to_piece(vocab, t, buf, n, 0, false);
 }
 static inline llama_token greedy_argmax(const float* logits, int32_t n_vocab) {
-    int32_t best = 0;
-    float bests = -std::numeric_limits<float>::infinity();
-    for (int32_t i = 0; i < n_vocab; ++i) {
-        if (logits[i] > bests) {
-            bests = logits[i]; best = i;
-        }
-    }
-    return (llama_token)best;
+    const int32_t best = simd_argmax(logits, n_vocab);
+    return best < 0 ? LLAMA_TOKEN_NULL : (llama_token)best;
 }
 
+// 结果写进复用的 out：先按已有容量试一次，不够再按返回的长度扩容重试（通常只扫一遍文本）
+static void tokenize_into(const char* text, size_t len, bool add_special, bool parse_special,
+                          std::vector<llama_token>& out) {
+    out.resize(std::max<size_t>(out.capacity(), 16));
+    int32_t n = llama_tokenize(g_vocab, text, (int32_t)len, out.data(), (int32_t)out.size(), add_special, parse_special);
+    if (n < 0) {
+        out.resize((size_t)-n);
+        n = llama_tokenize(g_vocab, text, (int32_t)len, out.data(), (int32_t)out.size(), add_special, parse_special);
+    }
+    out.resize(n < 0 ? 0 : (size_t)n);
+}
+// 请求 prompt 的 tokenize，记耗时
+static void tokenize_prompt(const std::string& prompt, std::vector<llama_token>& out) {
+    const int64_t t0 = now_us();
+    tokenize_into(prompt.data(), prompt.size(), true, true, out);
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    g_perf.tokenize_ms_last   = (now_us() - t0) / 1000.0;
+    g_perf.prompt_tokens_last = out.size();
+}
 static std::vector<llama_token> tokenize_text(const std::string& text, bool add_special, bool parse_special) {
-    int32_t need = llama_tokenize(g_vocab, text.c_str(), (int32_t)text.size(), nullptr, 0, add_special, parse_special);
-    if (need < 0) need = -need;
-    std::vector<llama_token> out(need);
-    int32_t n = llama_tokenize(g_vocab, text.c_str(), (int32_t)text.size(), out.data(), (int32_t)out.size(), add_special, parse_special);
-    if (n < 0) out.clear(); else out.resize(n);
+    std::vector<llama_token> out;
+    out.reserve(text.size() / 2 + 16);
+    tokenize_into(text.data(), text.size(), add_special, parse_special, out);
     return out;
 }
-static std::string detok_piece(llama_token t) {
+// 旧路径：逐 token 调 llama_token_to_piece 写进复用的 out；返回 false 表示空 piece
+static bool detok_piece_slow(llama_token t, std::string& out) {
     char buf[256];
     int m = token_to_piece(g_vocab, t, buf, (int)sizeof(buf));
-    if (m <= 0) return {};
-    return std::string(buf, buf + m);
+    if (m <= 0) { out.clear(); return false; }
+    out.assign(buf, (size_t)m);
+    return true;
 }
 
-// ===== 上下文保护/重置 =====
-static void rebuild_context_if_needed() {
-    // 重建上下文（当无法清 KV 时的兜底）
-    if (g_ctx) { llama_free(g_ctx); g_ctx = nullptr; }
-    g_ctx = llama_init_from_model(g_model, g_cparams);
-}
+// ===== 词表 piece 表：init 时把整个词表 detok 一遍，之后按下标取 =====
+// bytes/off：所有 piece 的 UTF-8 拼成一个字节池，off[t]..off[t+1] 是 token t；
+// u16/u16_off：piece 本身由完整码点组成时预先转好的 UTF-16，否则为空区间（流式输出走拼接路径）
+struct PieceTable {
+    std::vector<char>     bytes;
+    std::vector<uint32_t> off;
+    std::vector<char16_t> u16;
+    std::vector<uint32_t> u16_off;
+    std::vector<uint8_t>  whole;      // 1 = u16 可直接用
+
+    bool empty() const { return off.empty(); }
+    int32_t size() const { return off.empty() ? 0 : (int32_t)off.size() - 1; }
+
+    void clear() { *this = PieceTable{}; }
+
+    bool build(const llama_vocab* vocab) {
+        clear();
+        const int32_t n = vocab_size(vocab);
+        if (n <= 0) return false;
+        off.resize((size_t)n + 1);
+        u16_off.resize((size_t)n + 1);
+        whole.assign((size_t)n, 0);
+        bytes.reserve((size_t)n * 4);
+        u16.reserve((size_t)n * 2);
+
+        std::vector<char> buf(256);
+        std::u16string tmp;
+        Utf8Stream dec;
+        for (int32_t t = 0; t < n; ++t) {
+            off[t]     = (uint32_t)bytes.size();
+            u16_off[t] = (uint32_t)u16.size();
+            int m = token_to_piece(vocab, t, buf.data(), (int)buf.size());
+            if (m < 0) {                       // 缓冲不够，按返回的长度重试
+                buf.resize((size_t)-m);
+                m = token_to_piece(vocab, t, buf.data(), (int)buf.size());
+            }
+            if (m <= 0) continue;
+            bytes.insert(bytes.end(), buf.data(), buf.data() + m);
+            tmp.clear();
+            dec.reset();
+            if (dec.feed(buf.data(), (size_t)m, tmp) > 0 && dec.pending() == 0) {
+                u16.insert(u16.end(), tmp.begin(), tmp.end());
+                whole[t] = 1;
+            }
+        }
+        off[n]     = (uint32_t)bytes.size();
+        u16_off[n] = (uint32_t)u16.size();
+        bytes.shrink_to_fit();
+        u16.shrink_to_fit();
+        return true;
+    }
 
-static void reset_session() {
-#if defined(LLAMA_SUPPORTS_KV_CACHE_CLEAR) || defined(LLAMA_KV_CACHE_CLEAR)
-    llama_kv_cache_clear(g_ctx);
-#else
-    // 没有 kv_clear/seq_rm，就重建上下文
-    rebuild_context_if_needed();
-#endif
+    std::string_view piece(llama_token t) const {
+        if (t < 0 || t >= size()) return {};
+        return std::string_view(bytes.data() + off[t], off[t + 1] - off[t]);
+    }
+    // 整 piece 的 UTF-16；不是完整码点时返回 false
+    bool utf16(llama_token t, const char16_t*& p, size_t& n) const {
+        if (t < 0 || t >= size() || !whole[t]) return false;
+        p = u16.data() + u16_off[t];
+        n = u16_off[t + 1] - u16_off[t];
+        return true;
+    }
+    size_t footprint() const {
+        return bytes.capacity() + u16.capacity() * sizeof(char16_t)
+             + (off.capacity() + u16_off.capacity()) * sizeof(uint32_t) + whole.capacity();
+    }
+};
+static PieceTable g_pieces;
+
+// 构建 piece 表，并抽样对比旧路径与查表的单 token 耗时
+static void build_piece_table() {
+    const int64_t t0 = now_us();
+    if (!g_pieces.build(g_vocab)) { LOGW("piece table build failed, fallback to token_to_piece"); return; }
+    const double build_ms = (now_us() - t0) / 1000.0;
+
+    const int32_t n_probe = std::min<int32_t>(g_pieces.size(), 4096);
+    std::string scratch; scratch.reserve(256);
+    size_t sink = 0;
+    int64_t t1 = now_us();
+    for (int32_t t = 0; t < n_probe; ++t) { detok_piece_slow(t, scratch); sink += scratch.size(); }
+    int64_t t2 = now_us();
+    for (int32_t t = 0; t < n_probe; ++t) { auto v = g_pieces.piece(t); scratch.assign(v.data(), v.size()); sink += scratch.size(); }
+    int64_t t3 = now_us();
+
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    g_perf.piece_table_ms   = build_ms;
+    g_perf.piece_table_kb   = (double)g_pieces.footprint() / 1024.0;
+    g_perf.detok_ns_legacy  = n_probe ? (t2 - t1) * 1000.0 / n_probe : 0;
+    g_perf.detok_ns_table   = n_probe ? (t3 - t2) * 1000.0 / n_probe : 0;
+    LOGI("piece table: n=%d %.1fKB build=%.1fms detok legacy=%.0fns table=%.0fns (%zu)",
+         g_pieces.size(), g_perf.piece_table_kb, build_ms, g_perf.detok_ns_legacy, g_perf.detok_ns_table, sink);
 }
 
-// 适配上下文长度，预留余量
-static std::vector<llama_token> fit_to_context(const std::vector<llama_token>& in, int32_t n_ctx_capacity) {
-    const int32_t reserve = 32;
-    if ((int32_t)in.size() <= n_ctx_capacity - reserve) return in;
-    int32_t keep = std::max(0, n_ctx_capacity - reserve);
-    std::vector<llama_token> out;
-    if (keep > 0) out.insert(out.end(), in.end() - keep, in.end());
-    return out;
+// 查表取 piece；表不可用时退回旧路径（写进 scratch）
+static std::string_view detok_piece(llama_token t, std::string& scratch) {
+    if (!g_pieces.empty()) return g_pieces.piece(t);
+    if (!detok_piece_slow(t, scratch)) return {};
+    return scratch;
 }
-static std::unique_ptr<llama_sampler, void(*)(llama_sampler*)> g_sampler{nullptr, llama_sampler_free};
-// ===== 采样器链（新版签名）=====
-struct SamplerDeleter { void operator()(llama_sampler* s) const { if (s) llama_sampler_free(s); } };
 
-static void rebuild_sampler_chain() {
-    if (!g_model) return;
-    llama_sampler *chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+// ===== 作文流式：在累积的 UTF-8 正文上切句/切段，整句/整段作为事件送出 =====
+// 句末：. ! ? 后跟空白（避免把 3.5 切开），或全角 。！？；段末：空行
+struct EssaySegmenter {
+    size_t   scan       = 0;   // 下一个要检查的字节
+    size_t   sent_start = 0;
+    size_t   para_start = 0;
+    int32_t  n_sent     = 0;
+    int32_t  n_para     = 0;
+    int64_t  t_begin_us = 0;
+    double   first_sentence_ms = -1;
+    std::u16string u16;         // 事件文本的 UTF-16 暂存
+
+    void begin() { *this = EssaySegmenter{}; u16.reserve(1024); t_begin_us = now_us(); }
+};
+static EssaySegmenter g_segmenter;
 
-    llama_sampler_chain_add(chain, llama_sampler_init_penalties(g_samp.repeat_last_n, g_samp.repeat_penalty, 0.0f, 0.0f));
+static inline bool is_blank_utf8(const char* p, size_t n) {
+    for (size_t i = 0; i < n; ++i) if (p[i] != ' ' && p[i] != '\n' && p[i] != '\t' && p[i] != '\r') return false;
+    return true;
+}
 
-    if (g_samp.top_k > 0) {
-        llama_sampler_chain_add(chain, llama_sampler_init_top_k(g_samp.top_k));
-    }
-    if (g_samp.min_p > 0.0f) {
-        llama_sampler_chain_add(chain, llama_sampler_init_min_p(g_samp.min_p, g_samp.min_keep));
-    }
-    if (g_samp.top_p > 0.0f && g_samp.top_p < 1.0f) {
-        llama_sampler_chain_add(chain, llama_sampler_init_top_p(g_samp.top_p, g_samp.min_keep));
+// 先把合并缓冲里的 token 发掉，保证事件排在对应文本之后
+static void emit_segment(JNIEnv* env, jobject cb, int32_t kind, int32_t index, const char* p, size_t n) {
+    while (n > 0 && (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r')) { ++p; --n; }
+    while (n > 0 && (p[n - 1] == ' ' || p[n - 1] == '\n' || p[n - 1] == '\t' || p[n - 1] == '\r')) --n;
+    g_streamer.flush(env, cb, now_us());
+    emit_begin(env, cb, g_streamer.owner);
+    std::u16string& u16 = g_segmenter.u16;
+    u16.clear();
+    Utf8Stream dec;
+    dec.feed(p, n, u16);
+    dec.finish(u16);
+    if (ring_write(kind, u16.data(), u16.size(), index)) return;
+    jstring jtext = env->NewString(reinterpret_cast<const jchar*>(u16.data()), static_cast<jsize>(u16.size()));
+    if (!jtext) return;
+    env->CallVoidMethod(cb, g_jni.on_segment, (jint)kind, (jint)index, jtext);
+    env->DeleteLocalRef(jtext);
+    jni_clear_exception(env);
+}
+
+static void segment_sentence(JNIEnv* env, jobject cb, const std::string& out, size_t end) {
+    EssaySegmenter& sg = g_segmenter;
+    if (end > sg.sent_start && !is_blank_utf8(out.data() + sg.sent_start, end - sg.sent_start)) {
+        emit_segment(env, cb, kRecSentence, sg.n_sent++, out.data() + sg.sent_start, end - sg.sent_start);
+        if (sg.first_sentence_ms < 0) sg.first_sentence_ms = (now_us() - sg.t_begin_us) / 1000.0;
     }
-    if (g_samp.temp > 0.0f) {
-        llama_sampler_chain_add(chain, llama_sampler_init_temp(g_samp.temp));
-    } else {
-        llama_sampler_chain_add(chain, llama_sampler_init_greedy());
+    sg.sent_start = end;
+}
+
+static void segment_paragraph(JNIEnv* env, jobject cb, const std::string& out, size_t end) {
+    EssaySegmenter& sg = g_segmenter;
+    segment_sentence(env, cb, out, end);
+    if (end > sg.para_start && !is_blank_utf8(out.data() + sg.para_start, end - sg.para_start)) {
+        emit_segment(env, cb, kRecParagraph, sg.n_para++, out.data() + sg.para_start, end - sg.para_start);
     }
-    llama_sampler_chain_add(chain, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
-    g_sampler.reset(chain);
+    sg.para_start = end;
 }
 
-static llama_token sample_next_token(llama_context* ctx, llama_sampler* smpl) {
-    if (!ctx || !smpl) return LLAMA_TOKEN_NULL;
+// 每个 token 追加到 out 后调用；final = 生成结束，把剩余部分作为最后一句/一段
+static void segment_essay(JNIEnv* env, jobject cb, const std::string& out, bool final) {
+    EssaySegmenter& sg = g_segmenter;
+    const size_t n = out.size();
+    const char* s = out.data();
+    size_t i = sg.scan;
+    for (; i < n; ++i) {
+        const unsigned char c = (unsigned char)s[i];
+        if (c == '\n') {
+            if (i + 1 >= n) break;                                   // 等下一个字节判断是否空行
+            if (s[i + 1] == '\n') { segment_paragraph(env, cb, out, i + 2); ++i; }
+        } else if (c == '.' || c == '!' || c == '?') {
+            if (i + 1 >= n) break;
+            const char nx = s[i + 1];
+            if (nx == ' ' || nx == '\n' || nx == '\t') segment_sentence(env, cb, out, i + 1);
+            else if (nx == '"' || nx == '\'') { segment_sentence(env, cb, out, i + 2); ++i; }   // 闭引号归本句
+        } else if ((c == 0xE3 || c == 0xEF) && i + 2 < n) {
+            const unsigned char b1 = (unsigned char)s[i + 1], b2 = (unsigned char)s[i + 2];
+            // 。= E3 80 82，！= EF BC 81，？= EF BC 9F
+            if ((c == 0xE3 && b1 == 0x80 && b2 == 0x82) || (c == 0xEF && b1 == 0xBC && (b2 == 0x81 || b2 == 0x9F))) {
+                segment_sentence(env, cb, out, i + 3);
+                i += 2;
+            }
+        } else if ((c == 0xE3 || c == 0xEF) && !final) {
+            break;                                                   // 全角标点还没收全
+        }
+    }
+    sg.scan = i;
+    if (final) segment_paragraph(env, cb, out, n);
+}
 
-    // 直接用“最后一步 logits”：idx = -1（符合最新版头文件示例）
-    // 该调用内部会执行：apply + select（并不会自动 accept）
-    llama_token id = llama_sampler_sample(smpl, ctx, -1);  // <-- 关键
+static void note_essay_stream(int64_t t_start_us) {
+    const EssaySegmenter& sg = g_segmenter;
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    g_perf.essay_first_sentence_ms_last = sg.first_sentence_ms;
+    g_perf.essay_total_ms_last          = (now_us() - t_start_us) / 1000.0;
+    g_perf.essay_sentences_last         = (uint64_t)sg.n_sent;
+}
 
-    // 选择成功后要 accept，更新内部状态（比如重复惩罚、grammar 等）
-    if (id != LLAMA_TOKEN_NULL) {
-        llama_sampler_accept(smpl, id);
+// 流式输出一个 token：没有待拼接的半个码点且 piece 自身完整时，直接用预转好的 UTF-16；
+// 按合并策略决定是否立即回调
+static void emit_token(JNIEnv* env, jobject cb, llama_token t, std::string& scratch) {
+    const char16_t* p = nullptr;
+    size_t n = 0;
+    if (g_arena.utf8.pending() == 0 && g_pieces.utf16(t, p, n)) {
+        g_streamer.add_text(p, n);
+    } else {
+        std::string_view piece = detok_piece(t, scratch);
+        if (!piece.empty()) emit_utf8_safely(piece);
     }
-    return id;
+    const int64_t now = now_us();
+    g_streamer.add_token(now);
+    if (g_streamer.due(now)) g_streamer.flush(env, cb, now);
 }
 
-// ===== 通用 prefill =====
-struct BatchBuf {
-    std::vector<llama_token>   token;
-    std::vector<llama_pos>     pos;
-    std::vector<int32_t>       n_seq_id;
-    std::vector<llama_seq_id>  seq_id_store;
-    std::vector<llama_seq_id*> seq_id_ptrs;
-    std::vector<int8_t>        logits;
+// ===== 停止串（用户传入）：当前请求的匹配器，批处理时按槽位换进来 =====
+static StopMatcher g_stop_strings;
 
-    void resize(int n) {
-        token.resize(n); pos.resize(n);
-        n_seq_id.assign(n, 1);
-        seq_id_store.assign(n, 0);
-        seq_id_ptrs.resize(n);
-        logits.assign(n, 0);
-        for (int i = 0; i < n; ++i) seq_id_ptrs[i] = &seq_id_store[i];
+// 放出一段输出文本：stream 时进合并缓冲，out 非空时追加到正文。
+// 有停止串时先过匹配器，只放出确定不属于停止串的字节；命中返回 true（停止串本身不输出）
+static bool emit_text_checked(std::string_view bytes, bool stream, std::string* out) {
+    if (g_stop_strings.empty()) {
+        if (stream) emit_utf8_safely(bytes);
+        if (out) out->append(bytes.data(), bytes.size());
+        return false;
     }
-    llama_batch as_batch() {
-        llama_batch b{};
-        b.n_tokens = (int)token.size();
-        b.token    = token.data();
-        b.embd     = nullptr;
-        b.pos      = pos.data();
-        b.n_seq_id = n_seq_id.data();
-        b.seq_id   = seq_id_ptrs.data();
-        b.logits   = logits.data();
-        return b;
+    std::string& rel = g_arena.released;
+    rel.clear();
+    const bool hit = g_stop_strings.feed(bytes, rel);
+    if (stream && !rel.empty()) emit_utf8_safely(rel);
+    if (out) out->append(rel);
+    if (g_stop_strings.held() > 0) {
+        std::lock_guard<std::mutex> lk(g_perf_mutex);
+        g_perf.stop_held_max = std::max<uint64_t>(g_perf.stop_held_max, g_stop_strings.held());
     }
-};
+    return hit;
+}
 
-static bool prefill_tokens(const std::vector<llama_token>& ptok, int32_t& cur_pos, bool want_logits) {
-    if (ptok.empty()) return false;
-    BatchBuf pre; pre.resize((int)ptok.size());
-    for (int i = 0; i < (int)ptok.size(); ++i) {
-        pre.token[i]  = ptok[i];
-        pre.pos[i]    = i;
-        pre.logits[i] = (i + 1 == (int)ptok.size()) ? (want_logits ? 1 : 0) : 0;
-    }
-    if (llama_decode(g_ctx, pre.as_batch()) != 0) {
-        LOGE("prefill decode failed");
+// 一个 token 的文本已进合并缓冲：计数，按合并策略决定是否立即回调
+static void stream_token_done(JNIEnv* env, jobject cb) {
+    const int64_t now = now_us();
+    g_streamer.add_token(now);
+    if (g_streamer.due(now)) g_streamer.flush(env, cb, now);
+}
+
+// 输出一个 token（见 emit_text_checked）；没有停止串时走 emit_token 的预转 UTF-16 快路径
+static bool emit_checked(JNIEnv* env, jobject cb, llama_token t, std::string& scratch, bool stream, std::string* out) {
+    if (g_stop_strings.empty()) {
+        if (stream) emit_token(env, cb, t, scratch);
+        if (out) {
+            std::string_view pv = detok_piece(t, scratch);
+            out->append(pv.data(), pv.size());
+        }
         return false;
     }
-    cur_pos = (int)ptok.size();
-    return true;
+    const bool hit = emit_text_checked(detok_piece(t, scratch), stream, out);
+    if (stream) stream_token_done(env, cb);
+    return hit;
 }
 
-// ===== JNI: init =====
-extern "C" JNIEXPORT jboolean JNICALL
-Java_com_kingsun_plugins_llm_LlamaNative_nativeInit(JNIEnv* env, jclass, jstring modelPath_, jint nCtx) {
-    std::lock_guard<std::mutex> lk(g_mutex);
+// 生成结束（非停止串命中）：扣住的尾巴不是停止串，补发出去；之后照常 flush_pending
+static void release_held(bool stream, std::string* out) {
+    if (g_stop_strings.held() == 0) return;
+    std::string& rel = g_arena.released;
+    rel.clear();
+    g_stop_strings.finish(rel);
+    if (stream) emit_utf8_safely(rel);
+    if (out) out->append(rel);
+}
 
-    const char* p = env->GetStringUTFChars(modelPath_, nullptr);
-    std::string path = p ? p : "";
-    env->ReleaseStringUTFChars(modelPath_, p);
+// Limit 只在确实生成满 max_new 时计入（打断/出错/上下文满的不算）
+enum class FinishReason { Eog, StopString, Limit };
+static void note_finish(FinishReason r, size_t n_tokens, size_t max_new) {
+    if (r == FinishReason::Limit && n_tokens < max_new) return;
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    switch (r) {
+        case FinishReason::Eog:        g_perf.finish_eog++; break;
+        case FinishReason::StopString: g_perf.finish_stop_string++; break;
+        case FinishReason::Limit:      g_perf.finish_limit++; break;
+    }
+    g_perf.finish_tokens += n_tokens;
+}
 
-    if (g_ctx) { llama_free(g_ctx); g_ctx = nullptr; }
-    if (g_model) { llama_model_free(g_model); g_model = nullptr; }
-    g_vocab = nullptr;
-    g_pending_utf8.clear();
+// ===== Qwen3 思考模式：回复开头的 <think>…</think> 按请求策略处理 =====
+// Inline：原样进 token 流（旧行为）；Off：模板里预填空推理段，模型直接回答；
+// Separate：推理段走单独的通道（onNativeThought / 环记录 6）；Hidden：推理段丢弃。
+// 除 Off 外都可设推理 token 上限，到了就补上结束标签逼模型转入回答
+enum ThinkMode : int32_t { kThinkInline = 0, kThinkOff = 1, kThinkSeparate = 2, kThinkHidden = 3 };
+static constexpr char kThinkClose[] = "\n</think>\n\n";
+static ThinkFilter g_think;
+static int32_t     g_think_mode = kThinkInline;   // 当前 chat 请求的（只在生成线程访问）
+
+// 切分出来的一段：推理段按策略送到推理通道或丢弃，回答照常过停止串
+static void think_emit(JNIEnv* env, jobject cb, ThinkFilter::Part part, std::string_view text, bool& hit, bool& visible) {
+    if (part == ThinkFilter::kThought) {
+        if (g_think_mode != kThinkSeparate) return;
+        g_streamer.set_channel(env, cb, kRecThought);
+        emit_utf8_safely(text);
+        visible = true;
+    } else if (!hit) {
+        g_streamer.set_channel(env, cb, kRecText);
+        hit = emit_text_checked(text, true, nullptr);
+        visible = true;
+    }
+}
 
-    llama_backend_init();
+// chat 输出一个 token；命中停止串返回 true。隐藏掉的推理 token 不计入 llmToken 的 token 数
+static bool emit_chat_token(JNIEnv* env, jobject cb, llama_token t, std::string& scratch) {
+    if (g_think_mode == kThinkOff) return emit_checked(env, cb, t, scratch, true, nullptr);
+    std::string_view pv = detok_piece(t, scratch);
+    bool hit = false, visible = false;
+    if (g_think_mode == kThinkInline) {
+        g_think.feed(pv, [](ThinkFilter::Part, std::string_view) {});   // 只跟踪是否在推理段（预算）
+        hit = emit_text_checked(pv, true, nullptr);
+        visible = true;
+    } else {
+        g_think.feed(pv, [&](ThinkFilter::Part part, std::string_view text) {
+            think_emit(env, cb, part, text, hit, visible);
+        });
+    }
+    if (visible) stream_token_done(env, cb);
+    return hit;
+}
 
-    llama_model_params mparams = llama_model_default_params();
-    mparams.use_mmap  = true;
-    mparams.use_mlock = false;
+// chat 结束：切分器里扣住的字节（不完整的标签）按所在部分放出，再放出停止串扣住的尾巴
+static void finish_chat_stream(JNIEnv* env, jobject cb, bool stopped) {
+    if (stopped) return;
+    if (g_think_mode == kThinkSeparate || g_think_mode == kThinkHidden) {
+        bool hit = false, visible = false;
+        g_think.finish([&](ThinkFilter::Part part, std::string_view text) {
+            think_emit(env, cb, part, text, hit, visible);
+        });
+        if (hit) return;
+    }
+    g_streamer.set_channel(env, cb, kRecText);
+    release_held(true, nullptr);
+}
 
-    g_model = llama_model_load_from_file(path.c_str(), mparams);
-    if (!g_model) { LOGE("load model failed"); llama_backend_free(); return JNI_FALSE; }
+// ===== 会话：记录当前 KV（seq 0）里实际存放的 token，下标即位置 =====
+static std::vector<llama_token> g_session_tokens;
+// 滚动窗口：前 n_keep 个 token 固定（system/指令头，充当 attention sink），
+// 之后丢弃过 n_discarded 个；g_session_tokens[n_keep..] 对应完整对话的 [n_keep + n_discarded..]
+static size_t g_session_n_keep      = 0;
+static size_t g_session_n_discarded = 0;
+static constexpr int32_t kGenReserve = 32;   // prefill 后至少给生成留的位置
 
-    g_vocab = llama_model_get_vocab(g_model);
-    if (!g_vocab) { LOGE("get vocab failed"); llama_model_free(g_model); g_model=nullptr; llama_backend_free(); return JNI_FALSE; }
+// ===== 前缀 KV 缓存（system 段 / 作文要求段）=====
+static PrefixCache g_prefix_cache;
 
-    g_cparams = llama_context_default_params();
-    g_cparams.n_ctx    = (nCtx > 0 ? nCtx : 2048);
-    g_cparams.type_k   = GGML_TYPE_Q8_0;
-    g_cparams.type_v   = GGML_TYPE_Q8_0;
-    int ncpu = std::max(2, (int)sysconf(_SC_NPROCESSORS_ONLN) - 1);
-    g_cparams.n_threads = ncpu;
+static void publish_prefix_stats() {
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    g_perf.prefix = g_prefix_cache.stats();
+}
 
-    g_ctx = llama_init_from_model(g_model, g_cparams);
-    if (!g_ctx) {
-        LOGE("new context failed");
-        llama_model_free(g_model); g_model=nullptr; g_vocab=nullptr;
-        llama_backend_free();
-        return JNI_FALSE;
-    }
+// ===== 上下文生命周期：init 时分配一次，之后只走 memory API 复位 =====
+static llama_context* g_ctx_standby = nullptr;  // 预热好的备用上下文（可选，占一份 KV 内存）
+static bool           g_keep_standby = false;
+static bool           g_ctx_broken   = false;   // decode 致命错误后置位，下个请求开始前恢复
+
+static llama_context* create_context() {
+    int64_t t0 = now_us();
+    llama_context* ctx = llama_init_from_model(g_model, g_cparams);
+    if (!ctx) return nullptr;
+
+    // 预热：跑一个 token 把计算图和权重页面拉起来，再清掉 KV
+    llama_token warm = llama_vocab_bos(g_vocab);
+    if (warm == LLAMA_TOKEN_NULL) warm = 0;
+    llama_decode(ctx, llama_batch_get_one(&warm, 1));
+    llama_memory_clear(llama_get_memory(ctx), false);
+    llama_set_abort_callback(ctx, llama_abort_cb, nullptr);
+
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    g_perf.ctx_allocs++;
+    g_perf.ctx_alloc_ms += (now_us() - t0) / 1000.0;
+    return ctx;
+}
 
-    LOGI("nativeInit OK n_ctx=%d threads=%d", g_cparams.n_ctx, g_cparams.n_threads);
-    return JNI_TRUE;
+static void destroy_context(llama_context*& ctx) {
+    if (!ctx) return;
+    llama_free(ctx);
+    ctx = nullptr;
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    g_perf.ctx_frees++;
 }
 
-// ===== JNI: free =====
-extern "C" JNIEXPORT void JNICALL
-Java_com_kingsun_plugins_llm_LlamaNative_nativeFree(JNIEnv*, jclass) {
-    std::lock_guard<std::mutex> lk(g_mutex);
-    if (g_ctx)   { llama_free(g_ctx); g_ctx = nullptr; }
-    if (g_model) { llama_model_free(g_model); g_model = nullptr; }
-    g_vocab = nullptr;
-    g_pending_utf8.clear();
-    llama_backend_free();
+static void ensure_standby() {
+    if (g_keep_standby && !g_ctx_standby && g_model) g_ctx_standby = create_context();
 }
 
-// ===== JNI: stop =====
-extern "C" JNIEXPORT void JNICALL
-Java_com_kingsun_plugins_llm_LlamaNative_nativeStop(JNIEnv*, jclass) {
-    g_stop.store(true, std::memory_order_relaxed);
+// 只在上下文不可用（decode 致命错误）时才换新：优先换上备用的，再补一个备用
+static void rebuild_context_if_needed() {
+    if (g_ctx && !g_ctx_broken) return;
+    destroy_context(g_ctx);
+    if (g_ctx_standby) {
+        g_ctx = g_ctx_standby;
+        g_ctx_standby = nullptr;
+        std::lock_guard<std::mutex> lk(g_perf_mutex);
+        g_perf.standby_swaps++;
+    } else {
+        g_ctx = create_context();
+    }
+    g_ctx_broken = false;
+    g_session_tokens.clear();
+    g_session_n_keep      = 0;
+    g_session_n_discarded = 0;
+    ensure_standby();
 }
 
-// ===== JNI: set sampling =====
-extern "C" JNIEXPORT void JNICALL
-Java_com_kingsun_plugins_llm_LlamaNative_nativeSetSampling(JNIEnv*, jclass,
-                                                         jfloat temp, jfloat topP, jint topK, jfloat repeatPenalty, jint repeatLastN, jfloat minP) {
-    std::lock_guard<std::mutex> lk(g_mutex);
-    g_samp.temp           = std::max(0.f, (float)temp);
-    g_samp.top_p          = std::clamp((float)topP, 0.f, 1.f);
-    g_samp.top_k          = std::max(0, (int)topK);
-    g_samp.repeat_penalty = std::max(0.0f, (float)repeatPenalty);
-    g_samp.repeat_last_n  = std::max(0, (int)repeatLastN);
-    g_samp.min_p          = std::clamp((float)minP, 0.f, 1.f);
-    // min_keep 保持 1，避免采样坍缩
-    g_samp.min_keep       = 1;
+// llama_decode 返回值：<-1 为致命错误，KV 状态不可信
+static inline void note_decode_result(int32_t rc) {
+    if (rc < -1) {
+        LOGE("llama_decode fatal rc=%d, context will be replaced", rc);
+        g_ctx_broken = true;
+    }
 }
 
-// ===== JNI: chat 流式 =====
-extern "C" JNIEXPORT void JNICALL
-Java_com_kingsun_plugins_llm_LlamaNative_nativeChatStream(JNIEnv* env, jobject thiz, jstring userText_) {
-    std::lock_guard<std::mutex> lk(g_mutex);
-    if (!g_ctx || !g_model || !g_vocab) { LOGE("not initialized"); return; }
+// 被 abort（rc == 2）时已算完的 ubatch 会留在 KV 里：删掉 pos_start 之后的部分，
+// 让 KV 与 g_session_tokens（只在 decode 成功后追加）重新一致，上下文可直接复用
+static void rollback_aborted_decode(int32_t rc, int32_t pos_start) {
+    if (rc != 2) return;
+    llama_memory_seq_rm(llama_get_memory(g_ctx), 0, pos_start, -1);
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    g_perf.aborts++;
+}
 
-    jclass cbCls = env->GetObjectClass(thiz);
-    if (!cbCls) return;
-    jmethodID midOnToken = env->GetMethodID(cbCls, "onNativeToken", "(Ljava/lang/String;)V");
-    jmethodID midOnDone  = env->GetMethodID(cbCls, "onNativeDone",  "()V");
-    if (!midOnToken || !midOnDone) { env->DeleteLocalRef(cbCls); return; }
+static void reset_session() {
+    g_session_tokens.clear();
+    g_session_n_keep      = 0;
+    g_session_n_discarded = 0;
+    llama_memory_clear(llama_get_memory(g_ctx), false);   // 只清元数据，不碰缓冲区
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    g_perf.mem_clears++;
+}
 
-    const char* ut = env->GetStringUTFChars(userText_, nullptr);
-    std::string user = ut ? ut : "";
-    env->ReleaseStringUTFChars(userText_, ut);
+static void note_request_setup(int64_t t_start_us) {
+    double ms = (now_us() - t_start_us) / 1000.0;
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    g_perf.requests++;
+    g_perf.setup_ms_last   = ms;
+    g_perf.setup_ms_total += ms;
+}
 
-    std::string prompt = build_chatml_prompt(user);
+using SamplerPtr = std::unique_ptr<llama_sampler, void(*)(llama_sampler*)>;
+// 当前请求自己的采样器实例（请求开始时从缓存 clone，请求之间不共享惩罚历史）
+static SamplerPtr g_sampler{nullptr, llama_sampler_free};
+static uint64_t g_sampler_version = 0;   // g_sampler 按哪一版参数建的（只在生成线程访问）
+static bool     g_sampler_greedy  = false;   // 当前请求要求确定性解码（批改/纠错），换参数时也保持
+// ===== 采样器链（新版签名）=====
 
-    // 清 session（没有 KV 清理 API 就重建上下文）
-    reset_session();
-    g_pending_utf8.clear();
-    g_stop.store(false, std::memory_order_relaxed);
+// 默认用融合采样器（fused_sampler.h）；编译时定义 LLM_SAMPLER_CHAIN 退回 llama.cpp 的逐级链，便于对照
+static llama_sampler* make_sampler_chain(const SamplerParams& sp) {
+#ifndef LLM_SAMPLER_CHAIN
+    FusedSamplerParams fp;
+    fp.temp           = sp.temp;
+    fp.top_k          = sp.top_k;
+    fp.top_p          = sp.top_p;
+    fp.min_p          = sp.min_p;
+    fp.min_keep       = sp.min_keep;
+    fp.penalty_last_n = sp.repeat_last_n;
+    fp.penalty_repeat = sp.repeat_penalty;
+    return fused_sampler_init(fp);
+#else
+    llama_sampler *chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
 
-    auto ptok = tokenize_text(prompt, true, true);
-    ptok = fit_to_context(ptok, llama_n_ctx(g_ctx));
+    llama_sampler_chain_add(chain, llama_sampler_init_penalties(sp.repeat_last_n, sp.repeat_penalty, 0.0f, 0.0f));
 
-    int32_t cur_pos = 0;
-    if (!prefill_tokens(ptok, cur_pos, true)) {
-        env->CallVoidMethod(thiz, midOnDone);
-        env->DeleteLocalRef(cbCls);
-        return;
+    if (sp.top_k > 0) {
+        llama_sampler_chain_add(chain, llama_sampler_init_top_k(sp.top_k));
     }
-
-    if (!g_sampler) {
-        rebuild_sampler_chain();
+    if (sp.min_p > 0.0f) {
+        llama_sampler_chain_add(chain, llama_sampler_init_min_p(sp.min_p, sp.min_keep));
     }
-    BatchBuf step; step.resize(1);
-    const int32_t max_new = 512;
-
-    for (int i = 0; i < max_new && !g_stop.load(std::memory_order_relaxed); ++i, ++cur_pos) {
-        llama_token next = sample_next_token(g_ctx, g_sampler.get());
-        if (next == LLAMA_TOKEN_NULL) {
-            LOGW("sampler returned NULL token, fallback to greedy or stop");
-            // 可选：fallback
+    if (sp.top_p > 0.0f && sp.top_p < 1.0f) {
+        llama_sampler_chain_add(chain, llama_sampler_init_top_p(sp.top_p, sp.min_keep));
+    }
+    if (sp.temp > 0.0f) {
+        llama_sampler_chain_add(chain, llama_sampler_init_temp(sp.temp));
+    } else {
+        llama_sampler_chain_add(chain, llama_sampler_init_greedy());
+    }
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    return chain;
+#endif
+}
+
+// ===== 采样器缓存 =====
+// 按参数哈希缓存构建好的原型链（原型本身从不 accept/apply，状态始终是干净的）。
+// 每个请求 clone 一份再 reset：重复惩罚历史清空、dist 重新取随机种子，
+// 不同参数的请求交替排队时各自命中自己的原型，不再重建，也不共享可变状态。
+// 只在持 g_mutex 的生成路径与 nativeFree 里访问
+struct SamplerCache {
+    struct Entry {
+        uint64_t   key = 0;
+        SamplerPtr proto{nullptr, llama_sampler_free};
+        uint64_t   last_use = 0;
+    };
+    static constexpr size_t kMaxEntries = 8;
+    std::vector<Entry> entries;
+    uint64_t           tick = 0;
+};
+static SamplerCache g_sampler_cache;
+
+// 参与构链的字段做 FNV-1a；version 只是发布序号，不参与
+static uint64_t sampler_params_hash(const SamplerParams& sp) {
+    uint64_t h = 1469598103934665603ull;
+    auto mix = [&h](const void* p, size_t n) {
+        const uint8_t* b = static_cast<const uint8_t*>(p);
+        for (size_t i = 0; i < n; ++i) { h ^= b[i]; h *= 1099511628211ull; }
+    };
+    mix(&sp.temp, sizeof(sp.temp));
+    mix(&sp.top_p, sizeof(sp.top_p));
+    mix(&sp.top_k, sizeof(sp.top_k));
+    mix(&sp.repeat_penalty, sizeof(sp.repeat_penalty));
+    mix(&sp.repeat_last_n, sizeof(sp.repeat_last_n));
+    mix(&sp.min_p, sizeof(sp.min_p));
+    mix(&sp.min_keep, sizeof(sp.min_keep));
+    return h;
+}
+
+// 返回调用方独占的新实例；hit 非空时写入是否命中缓存
+static llama_sampler* new_request_sampler(const SamplerParams& sp, bool* hit = nullptr) {
+    const uint64_t key = sampler_params_hash(sp);
+    auto& es = g_sampler_cache.entries;
+    SamplerCache::Entry* e = nullptr;
+    for (auto& x : es) if (x.key == key) { e = &x; break; }
+    if (hit) *hit = e != nullptr;
+    if (!e) {
+        if (es.size() >= SamplerCache::kMaxEntries) {
+            auto lru = std::min_element(es.begin(), es.end(), [](const auto& a, const auto& b) { return a.last_use < b.last_use; });
+            es.erase(lru);
+        }
+        es.emplace_back();
+        e = &es.back();
+        e->key = key;
+        e->proto.reset(make_sampler_chain(sp));
+    }
+    e->last_use = ++g_sampler_cache.tick;
+    llama_sampler* smpl = llama_sampler_clone(e->proto.get());
+    llama_sampler_reset(smpl);
+    return smpl;
+}
+
+static void note_sampler_setup(int64_t t0_us, bool hit) {
+    const double us = (double)(now_us() - t0_us);
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    g_perf.sampler_setups++;
+    g_perf.sampler_setup_us_last   = us;
+    g_perf.sampler_setup_us_total += us;
+    (hit ? g_perf.sampler_cache_hits : g_perf.sampler_cache_misses)++;
+}
+
+// 确定性请求只把温度压成 0：融合采样器走惩罚后的 SIMD argmax，其余参数照旧参与缓存键
+static SamplerParams sampling_for(bool greedy) {
+    SamplerParams sp = sampling_snapshot();
+    if (greedy) sp.temp = 0.0f;
+    return sp;
+}
+
+// 请求开始：换上本请求自己的采样器
+static void rebuild_sampler_chain(const SamplerParams& sp) {
+    if (!g_model) return;
+    const int64_t t0 = now_us();
+    bool hit = false;
+    g_sampler.reset(new_request_sampler(sp, &hit));
+    g_sampler_version = sp.version;
+    note_sampler_setup(t0, hit);
+}
+
+// 采样链跟上最新发布的参数；n_generated = 本请求已生成的 token 数（它们在 g_session_tokens 末尾），
+// 换链时重新 accept 其中最近 repeat_last_n 个，重复惩罚不因改参数而清空
+static void sync_sampler(int32_t n_generated) {
+    if (g_sampler && sampling_version() == g_sampler_version) return;
+    const SamplerParams sp = sampling_for(g_sampler_greedy);
+    if (!g_model) return;
+    g_sampler.reset(new_request_sampler(sp));
+    g_sampler_version = sp.version;
+    if (n_generated <= 0) return;
+    const size_t n = std::min({(size_t)n_generated, (size_t)std::max(0, sp.repeat_last_n), g_session_tokens.size()});
+    for (size_t i = g_session_tokens.size() - n; i < g_session_tokens.size(); ++i) {
+        llama_sampler_accept(g_sampler.get(), g_session_tokens[i]);
+    }
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    g_perf.sampling_swaps++;
+}
+
+// ===== 语法约束（GBNF）=====
+// 编译好的语法按原文缓存（llama_sampler_init_grammar 每次都要解析整段 GBNF），每个请求 clone 一份状态。
+// 采样先不管语法，采到的 token 单独过一次语法，合法就直接用（绝大多数 token 如此）；
+// 不合法才把整张词表过一遍语法、在允许的 token 里重采（与 llama.cpp common_sampler 的做法相同）。
+// 只有温度、没有截断时两者同分布：P(t) = p(t) + P(拒绝)·p(t)/Z = p(t)/Z；带 top_k/top_p 时重采在过滤后的集合上重新截断。
+// 允许集合不缓存：libllama 不暴露语法的解析栈，按 token 历史做键在不同请求间几乎不会重复
+struct GrammarEntry {
+    std::string gbnf;
+    SamplerPtr  proto{nullptr, llama_sampler_free};
+    uint64_t    last_use = 0;
+};
+// 编译结果的大小与 GBNF 文本成正比，按文本字节限额做 LRU；单个超过限额的只给本次请求用、不进缓存
+// 提交线程编译（解析失败当场拒绝请求），生成线程只 clone，所以缓存用单独的锁、不占 g_mutex
+static constexpr size_t kGrammarCacheBytes = 256 * 1024;
+static std::mutex g_grammar_mu;
+static std::vector<std::shared_ptr<GrammarEntry>> g_grammar_cache;   // 持 g_grammar_mu 访问
+static size_t   g_grammar_cache_bytes = 0;
+static uint64_t g_grammar_tick = 0;
+static const llama_vocab* g_grammar_vocab = nullptr;   // 编译用的词表：init 成功后设置，free 清空
+
+// 一个请求的语法状态
+struct GrammarState {
+    std::shared_ptr<GrammarEntry> entry;
+    SamplerPtr smpl{nullptr, llama_sampler_free};
+};
+static GrammarState g_grammar;   // run_chat / run_generate 当前请求的
+
+static void grammar_end(GrammarState& gs) {
+    gs.smpl.reset();
+    gs.entry.reset();
+}
+
+// 换词表时清空缓存（编译好的语法绑定词表）；vocab 为空表示模型已释放，之后的提交一律编译失败
+static void grammar_cache_reset(const llama_vocab* vocab) {
+    std::lock_guard<std::mutex> lk(g_grammar_mu);
+    g_grammar_cache.clear();
+    g_grammar_cache_bytes = 0;
+    g_grammar_vocab = vocab;
+}
+
+// 查缓存或编译；解析失败（或模型未加载）返回空
+static std::shared_ptr<GrammarEntry> grammar_compile(const std::string& gbnf) {
+    std::lock_guard<std::mutex> lk(g_grammar_mu);
+    if (!g_grammar_vocab) return nullptr;
+    std::shared_ptr<GrammarEntry> e;
+    for (auto& x : g_grammar_cache) if (x->gbnf == gbnf) { e = x; break; }
+    const bool hit = e != nullptr;
+    if (!e) {
+        llama_sampler* proto = llama_sampler_init_grammar(g_grammar_vocab, gbnf.c_str(), "root");
+        if (!proto) {
+            LOGE("grammar parse failed (%zu bytes)", gbnf.size());
+            std::lock_guard<std::mutex> plk(g_perf_mutex);
+            g_perf.grammar_errors++;
+            return nullptr;
+        }
+        e = std::make_shared<GrammarEntry>();
+        e->gbnf = gbnf;
+        e->proto.reset(proto);
+        if (gbnf.size() <= kGrammarCacheBytes) {
+            while (g_grammar_cache_bytes + gbnf.size() > kGrammarCacheBytes) {
+                auto lru = std::min_element(g_grammar_cache.begin(), g_grammar_cache.end(),
+                    [](const auto& a, const auto& b) { return a->last_use < b->last_use; });
+                g_grammar_cache_bytes -= (*lru)->gbnf.size();
+                g_grammar_cache.erase(lru);
+            }
+            g_grammar_cache.push_back(e);
+            g_grammar_cache_bytes += gbnf.size();
+        }
+    }
+    e->last_use = ++g_grammar_tick;
+    std::lock_guard<std::mutex> plk(g_perf_mutex);
+    (hit ? g_perf.grammar_compile_hits : g_perf.grammar_compiles)++;
+    return e;
+}
+
+// entry 为空表示不约束（提交时已编译好，任务持有引用，缓存淘汰不影响）
+static bool grammar_begin(GrammarState& gs, const std::shared_ptr<GrammarEntry>& e) {
+    grammar_end(gs);
+    if (!e) return true;
+    gs.entry = e;
+    gs.smpl.reset(llama_sampler_clone(e->proto.get()));
+    return gs.smpl != nullptr;
+}
+
+static void grammar_accept(GrammarState& gs, llama_token t) {
+    if (gs.smpl) llama_sampler_accept(gs.smpl.get(), t);
+}
+
+// 整表过一遍语法，在允许的 token 里重采：不允许的 logits 置 -inf 后交给同一个采样器
+static llama_token sample_grammar_scan(GrammarState& gs, const float* logits, int32_t n_vocab, llama_sampler* smpl) {
+    auto& cand = g_arena.cand;
+    for (int32_t i = 0; i < n_vocab; ++i) cand[i] = llama_token_data{i, logits[i], 0.0f};
+    llama_token_data_array arr{cand.data(), (size_t)n_vocab, -1, false};
+    llama_sampler_apply(gs.smpl.get(), &arr);
+    bool any = false;
+    for (size_t i = 0; i < arr.size && !any; ++i) any = arr.data[i].logit != -INFINITY;
+    if (!any) return LLAMA_TOKEN_NULL;
+    if (FusedSampler* fs = fused_sampler_of(smpl)) {
+        // 语法采样器只改 logit、不重排，cand[i] 仍对应 token i
+        float* m = g_arena.masked.data();
+        for (int32_t i = 0; i < n_vocab; ++i) m[i] = cand[i].logit;
+        return fs->sample(m, n_vocab);
+    }
+    llama_sampler_apply(smpl, &arr);
+    if (arr.selected < 0 || arr.selected >= (int64_t)arr.size) return LLAMA_TOKEN_NULL;
+    return arr.data[arr.selected].id;
+}
+
+// idx：取第几个输出位置的 logits（-1 = 最后一个；同批多序列时传该序列在 batch 中的下标）
+// gs：语法约束（可为空）；语法已走完（只剩结束符可选）时返回 eos，由调用方按正常结束处理
+static llama_token sample_next_token(llama_context* ctx, llama_sampler* smpl, int32_t idx = -1,
+                                     GrammarState* gs = nullptr) {
+    if (!ctx || !smpl) return LLAMA_TOKEN_NULL;
+
+    const int64_t t0 = now_us();
+    const float* logits = llama_get_logits_ith(ctx, idx);
+    auto& cand = g_arena.cand;
+    if (!logits || cand.empty()) return LLAMA_TOKEN_NULL;
+    const int32_t n_vocab = (int32_t)cand.size();
+    llama_token id = LLAMA_TOKEN_NULL;
+    if (FusedSampler* fs = fused_sampler_of(smpl)) {
+        // 融合采样器直接读 logits，不填 n_vocab 大小的候选数组
+        id = fs->sample(logits, n_vocab);
+    } else {
+        // 等价于 llama_sampler_sample(smpl, ctx, idx)，但候选数组用 arena 里预分配的，
+        // 避免它每个 token 新建一个 n_vocab 大小的 vector
+        for (int32_t i = 0; i < n_vocab; ++i) cand[i] = llama_token_data{i, logits[i], 0.0f};
+        llama_token_data_array arr{cand.data(), (size_t)n_vocab, -1, false};
+        llama_sampler_apply(smpl, &arr);
+        if (arr.selected < 0 || arr.selected >= (int64_t)arr.size) return LLAMA_TOKEN_NULL;
+        id = arr.data[arr.selected].id;
+    }
+
+    const bool constrained = gs && gs->smpl;
+    const int64_t t_g = constrained ? now_us() : 0;
+    bool fast = false;
+    if (constrained && id != LLAMA_TOKEN_NULL) {
+        llama_token_data one{id, logits[id], 0.0f};
+        llama_token_data_array single{&one, 1, -1, false};
+        llama_sampler_apply(gs->smpl.get(), &single);
+        fast = one.logit != -INFINITY;
+    }
+    if (constrained && !fast) id = sample_grammar_scan(*gs, logits, n_vocab, smpl);
+
+    // 选择成功后要 accept，更新内部状态（比如重复惩罚、grammar 等）
+    if (id != LLAMA_TOKEN_NULL) {
+        llama_sampler_accept(smpl, id);
+        if (constrained) grammar_accept(*gs, id);
+    }
+    const int64_t t1 = now_us();
+    {
+        std::lock_guard<std::mutex> lk(g_perf_mutex);
+        g_perf.sample_calls++;
+        g_perf.sample_us_total += (double)(t1 - t0);
+        if (constrained) {
+            g_perf.grammar_tokens++;
+            g_perf.grammar_us_total += (double)(t1 - t_g);
+            if (fast) {
+                g_perf.grammar_fast++;
+                g_perf.grammar_fast_us += (double)(t1 - t_g);
+            } else {
+                g_perf.grammar_scans++;
+                g_perf.grammar_scan_us += (double)(t1 - t_g);
+            }
+        }
+    }
+    // 语法约束下：结束符（含 <|im_end|> 等 EOG）或无路可走都按 eos 收尾
+    if (constrained && (id == LLAMA_TOKEN_NULL || llama_vocab_is_eog(g_vocab, id))) return tok_eos(g_vocab);
+    return id;
+}
+
+// ===== 分块 prefill：按 n_batch 切块，块间汇报进度、检查 stop =====
+// 单个请求可能分几段 prefill（固定头 + 剩余部分），done/total 按整个请求累计
+struct PrefillProgress {
+    int32_t done      = 0;
+    int32_t total     = 0;
+    bool    cancelled = false;
+    std::function<void(int32_t done, int32_t total)> notify;   // 由 JNI 入口设置，可为空
+};
+static PrefillProgress g_prefill;
+static int32_t         g_prefill_chunk = 0;   // 0 = 跟随 llama_n_batch；可由 nativeSetPrefillChunk 调整
+static int32_t         g_parallel      = 1;   // 同批生成的作文序列数（init 设置），1 = 不批处理
+
+static int64_t read_peak_rss_kb() {
+    FILE* f = fopen("/proc/self/status", "r");
+    if (!f) return 0;
+    char line[128];
+    long long kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "VmHWM:", 6) == 0) { sscanf(line + 6, "%lld", &kb); break; }
+    }
+    fclose(f);
+    return kb;
+}
+
+static void begin_prefill(int32_t total, std::function<void(int32_t, int32_t)> notify) {
+    g_prefill = PrefillProgress{};
+    g_prefill.total  = total;
+    g_prefill.notify = std::move(notify);
+}
+
+// 从 cur_pos 开始写入 ptok，成功后 cur_pos 前移；每块成功后追加到会话历史（取消时已写入的块仍然有效）
+static bool prefill_tokens(const llama_token* ptok, int32_t n, int32_t& cur_pos, bool want_logits) {
+    if (n <= 0) return false;
+    int32_t chunk = (int32_t)llama_n_batch(g_ctx);
+    if (g_prefill_chunk > 0) chunk = std::min(chunk, g_prefill_chunk);
+
+    const int64_t t0 = now_us();
+    BatchBuf& pre = g_arena.batch;
+    pre.ensure(std::min(n, chunk));
+    for (int32_t off = 0; off < n; off += chunk) {
+        if (should_abort()) {
+            LOGI("prefill cancelled at %d/%d", g_prefill.done, g_prefill.total);
+            g_prefill.cancelled = true;
+            return false;
+        }
+        const int32_t m = std::min(chunk, n - off);
+        for (int32_t i = 0; i < m; ++i) {
+            pre.token[i]  = ptok[off + i];
+            pre.pos[i]    = cur_pos + i;
+            pre.logits[i] = (off + i + 1 == n) ? (want_logits ? 1 : 0) : 0;
+        }
+        int32_t rc = llama_decode(g_ctx, pre.as_batch(m));
+        if (rc == 2) {
+            LOGI("prefill aborted at %d/%d", g_prefill.done, g_prefill.total);
+            rollback_aborted_decode(rc, cur_pos);
+            g_prefill.cancelled = true;
+            return false;
+        }
+        if (rc != 0) {
+            LOGE("prefill decode failed rc=%d", rc);
+            note_decode_result(rc);
+            return false;
+        }
+        g_session_tokens.insert(g_session_tokens.end(), ptok + off, ptok + off + m);
+        cur_pos += m;
+        g_prefill.done += m;
+        if (g_prefill.notify) g_prefill.notify(g_prefill.done, std::max(g_prefill.total, g_prefill.done));
+    }
+
+    const double ms = (now_us() - t0) / 1000.0;
+    const int64_t rss = read_peak_rss_kb();
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    g_perf.prefill_tokens    += (uint64_t)n;
+    g_perf.prefill_ms        += ms;
+    g_perf.prefill_tps_last   = ms > 0 ? n * 1000.0 / ms : 0;
+    g_perf.prefill_chunk_last = chunk;
+    g_perf.peak_rss_kb        = rss;
+    return true;
+}
+static bool prefill_tokens(const std::vector<llama_token>& ptok, int32_t& cur_pos, bool want_logits) {
+    return prefill_tokens(ptok.data(), (int32_t)ptok.size(), cur_pos, want_logits);
+}
+
+// ===== 多轮会话：与 KV 中的历史做 diff，只 prefill 新增部分 =====
+static size_t common_prefix_len(const std::vector<llama_token>& a, const std::vector<llama_token>& b) {
+    size_t n = std::min(a.size(), b.size()), i = 0;
+    while (i < n && a[i] == b[i]) ++i;
+    return i;
+}
+
+// 上下文平移：丢掉 [n_keep, n_keep + n_discard) 的 KV，后面的位置整体前移（需要 llama_memory_can_shift）
+static bool context_shift(int32_t n_discard, int32_t& cur_pos) {
+    llama_memory_t mem = llama_get_memory(g_ctx);
+    const int32_t n_keep = (int32_t)g_session_n_keep;
+    const int32_t n_past = (int32_t)g_session_tokens.size();
+    n_discard = std::min(n_discard, n_past - n_keep);
+    if (n_discard <= 0 || !llama_memory_can_shift(mem)) return false;
+
+    if (!llama_memory_seq_rm(mem, 0, n_keep, n_keep + n_discard)) return false;
+    llama_memory_seq_add(mem, 0, n_keep + n_discard, n_past, -n_discard);
+    g_session_tokens.erase(g_session_tokens.begin() + n_keep, g_session_tokens.begin() + n_keep + n_discard);
+    g_session_n_discarded += (size_t)n_discard;
+    cur_pos -= n_discard;
+    LOGI("context shift: keep=%d discard=%d past=%d", n_keep, n_discard, cur_pos);
+    return true;
+}
+
+// 生成时位置用尽：平移掉中间一半，继续生成而不重新 prefill
+static bool ensure_room_for_next(int32_t& cur_pos) {
+    if (cur_pos < (int32_t)llama_n_ctx(g_ctx)) return true;
+    return context_shift((cur_pos - (int32_t)g_session_n_keep) / 2, cur_pos);
+}
+
+// 把 seq 0 对齐到 ptok（完整对话）：保留公共前缀，删掉分叉之后的 KV，再 prefill 剩余 token。
+// 会话里可复用的比前缀缓存短时，改用缓存快照；head_len 为固定 prompt 头的 token 数，
+// prefill 跨过它时顺手存一份快照。超出窗口时固定前 n_pin 个 token，平移/丢弃中间部分。
+// 至少重算最后一个 token，保证拿得到采样用的 logits。
+static bool sync_session_to(const std::vector<llama_token>& ptok, size_t head_len, size_t n_pin, int32_t& cur_pos) {
+    if (ptok.empty()) return false;
+    const size_t limit = (size_t)std::max<int32_t>(1, (int32_t)llama_n_ctx(g_ctx) - kGenReserve);
+    auto& hist = g_session_tokens;
+
+    // keep_h：历史中可复用的 token 数；keep_v：对应到 ptok 的下标
+    size_t keep_h = 0, keep_v = 0;
+    const size_t n_keep = g_session_n_keep, n_disc = g_session_n_discarded;
+    if (n_disc > 0 && hist.size() >= n_keep && ptok.size() > n_keep + n_disc
+        && std::equal(hist.begin(), hist.begin() + (long)n_keep, ptok.begin())) {
+        // 窗口滑动过：跳过已丢弃的那段再比较
+        size_t c = 0, m = std::min(hist.size() - n_keep, ptok.size() - n_keep - n_disc);
+        while (c < m && hist[n_keep + c] == ptok[n_keep + n_disc + c]) ++c;
+        keep_h = n_keep + c;
+        keep_v = n_keep + n_disc + c;
+        if (keep_v >= ptok.size()) { --keep_h; --keep_v; }
+        if (keep_h < n_keep) keep_h = keep_v = 0;
+    } else {
+        keep_h = keep_v = common_prefix_len(hist, ptok);
+        if (n_disc > 0) keep_h = keep_v = std::min(keep_h, n_keep);   // 位置已平移过，只有固定段还可信
+        if (keep_v >= ptok.size()) keep_h = keep_v = ptok.size() - 1;
+    }
+    const bool windowed = keep_v != keep_h;
+    if (!windowed) {
+        g_session_n_keep      = std::min(n_pin, limit / 2);
+        g_session_n_discarded = 0;
+    }
+
+    size_t cached = 0;
+    if (!windowed && keep_h < head_len) {
+        bool wiped = false;
+        cached = g_prefix_cache.restore_longest(g_ctx, 0, ptok.data(), ptok.size() - 1, keep_h, &wiped);
+        if (wiped) {
+            hist.clear();
+            keep_h = keep_v = 0;
+        }
+    }
+    llama_memory_t mem = llama_get_memory(g_ctx);
+    if (cached > 0) {
+        keep_h = keep_v = cached;
+        hist.assign(ptok.begin(), ptok.begin() + (long)cached);
+    } else if (keep_h < hist.size()) {
+        if (!llama_memory_seq_rm(mem, 0, (llama_pos)keep_h, -1)) {
+            // 部分删除失败（如循环结构的模型），只能整段重来
+            llama_memory_seq_rm(mem, 0, -1, -1);
+            keep_h = keep_v = 0;
+            g_session_n_discarded = 0;
+        }
+        hist.resize(keep_h);
+    }
+    cur_pos = (int32_t)keep_h;
+
+    // 放不下：能平移就丢中间一段（至少一半，摊薄平移次数）；否则中间整段丢掉，只重算最近的部分
+    size_t tail = ptok.size() - keep_v;
+    if (keep_h + tail > limit) {
+        const size_t pin    = g_session_n_keep;
+        const size_t middle = keep_h > pin ? keep_h - pin : 0;
+        const size_t need   = keep_h + tail - limit;
+        if (need <= middle && context_shift((int32_t)std::min(middle, std::max(need, middle / 2)), cur_pos)) {
+            keep_h = (size_t)cur_pos;
+        } else {
+            if (keep_h > pin) {
+                llama_memory_seq_rm(mem, 0, (llama_pos)pin, -1);
+                hist.resize(pin);
+            } else if (keep_h < pin && !prefill_tokens(ptok.data() + keep_h, (int32_t)(pin - keep_h), cur_pos, false)) {
+                reset_session();
+                return false;
+            }
+            const size_t take = std::min(std::max(tail, (limit - pin) / 2), limit - pin);
+            const size_t start = std::max(pin, ptok.size() - take);
+            g_session_n_discarded = start - pin;
+            keep_h = pin;
+            keep_v = start;
+            cur_pos = (int32_t)keep_h;
+        }
+    }
+
+    LOGI("session sync: total=%d reused=%d cached=%d prefill=%d keep=%d discarded=%d",
+         (int)ptok.size(), (int)keep_h, (int)cached, (int)(ptok.size() - keep_v),
+         (int)g_session_n_keep, (int)g_session_n_discarded);
+
+    g_prefill.total = g_prefill.done + (int32_t)(ptok.size() - keep_v);
+    bool ok = true;
+    if (keep_v == keep_h && head_len > keep_v && head_len < ptok.size()) {
+        ok = prefill_tokens(ptok.data() + keep_v, (int32_t)(head_len - keep_v), cur_pos, false);
+        if (ok) {
+            g_prefix_cache.store(g_ctx, 0, ptok.data(), head_len);
+            keep_v = head_len;
+        }
+    }
+    if (ok) ok = prefill_tokens(ptok.data() + keep_v, (int32_t)(ptok.size() - keep_v), cur_pos, true);
+    publish_prefix_stats();
+    if (!ok) {
+        // 取消时已 prefill 的块与历史一致，保留给下次复用；真正失败才整段清掉
+        if (!g_prefill.cancelled) reset_session();
+        return false;
+    }
+    return true;
+}
+
+// 固定 prompt 头的 token 数；头部单独 tokenize 后与整段的前缀不一致时返回 0（不缓存）
+static size_t prompt_head_tokens(const std::string& prompt, const std::vector<llama_token>& ptok) {
+    size_t bytes = prompt_head_bytes(prompt);
+    if (bytes == 0) return 0;
+    std::vector<llama_token> head;
+    head.reserve(bytes / 2 + 16);
+    tokenize_into(prompt.data(), bytes, true, true, head);
+    if (head.empty() || head.size() >= ptok.size()) return 0;
+    if (!std::equal(head.begin(), head.end(), ptok.begin())) return 0;
+    return head.size();
+}
+
+// Java 字符串 -> 标准 UTF-8，追加到 out。不走 GetStringUTFChars（Modified UTF-8 会把
+// 补充平面字符拆成两个 3 字节代理，tokenize 出错）：短串 GetStringRegion 拷到栈上，
+// 长串（粘贴的整篇作文）GetStringCritical 直接读 Java 侧的 UTF-16，一遍转换到 out
+static void jstring_append_utf8(JNIEnv* env, jstring js, std::string& out) {
+    if (!js) return;
+    const jsize n = env->GetStringLength(js);
+    if (n <= 0) return;
+    out.reserve(out.size() + (size_t)n * 3);
+    constexpr jsize kStackUnits = 512;
+    if (n <= kStackUnits) {
+        jchar buf[kStackUnits];
+        env->GetStringRegion(js, 0, n, buf);
+        utf16_to_utf8_append(reinterpret_cast<const char16_t*>(buf), (size_t)n, out);
+        return;
+    }
+    // Critical 区内不能再调 JNI、不能阻塞：只做转换
+    const jchar* p = env->GetStringCritical(js, nullptr);
+    if (!p) return;
+    utf16_to_utf8_append(reinterpret_cast<const char16_t*>(p), (size_t)n, out);
+    env->ReleaseStringCritical(js, p);
+}
+static std::string jstring_to_string(JNIEnv* env, jstring js) {
+    std::string s;
+    jstring_append_utf8(env, js, s);
+    return s;
+}
+static std::vector<std::string> jstring_array_to_vec(JNIEnv* env, jobjectArray arr) {
+    std::vector<std::string> v;
+    if (!arr) return v;
+    jsize n = env->GetArrayLength(arr);
+    v.resize(std::max<jsize>(n, 0));
+    for (jsize i = 0; i < n; ++i) {
+        jstring s = (jstring)env->GetObjectArrayElement(arr, i);
+        jstring_append_utf8(env, s, v[i]);
+        if (s) env->DeleteLocalRef(s);
+    }
+    return v;
+}
+
+// ===== 会话持久化：seq 0 的 KV 状态 + token 历史落盘 =====
+// 文件 = 定长头 + token 区 + 负载（llama_state_seq_get_data 的原始字节，可选 zlib）。
+// 头里带模型 SHA-256、n_ctx、KV 类型，只读头就能拒绝过期文件；写临时文件后 rename，保证原子。
+static constexpr uint32_t kSessionMagic    = 0x534D4C4C;   // "LLMS"
+// 版本：v1 头 80 字节，到 stored_size 为止；v2 头 88 字节，末尾加 n_keep、n_discarded（滚动窗口状态），
+// 其余字段偏移不变；v3 布局同 v2，CRC 把头（crc32 字段置 0）也算进去。
+// 只认当前版本，旧版文件按过期处理（loadSession 返回 restored=false）
+static constexpr uint32_t kSessionVersion  = 3;
+static constexpr uint32_t kSessionFlagZlib = 1u << 0;
+
+struct SessionFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t  model_sha256[32];
+    uint32_t n_ctx;
+    int32_t  type_k;
+    int32_t  type_v;
+    uint32_t flags;
+    uint32_t n_tokens;
+    uint32_t crc32;         // 头 + token 区 + 负载（见 session_crc）
+    uint64_t raw_size;      // KV 状态原始字节数
+    uint64_t stored_size;   // 负载落盘字节数
+    uint32_t n_keep;        // v2 起：滚动窗口的固定段长度 / 已丢弃 token 数
+    uint32_t n_discarded;
+};
+static_assert(sizeof(SessionFileHeader) == 88, "session header layout (v2/v3)");
+// 解压后 KV 状态的上限：头里的 raw_size 不可信，先卡住再分配（zlib 的压缩比也不会超过 1032:1）
+static constexpr uint64_t kSessionMaxRawBytes = 1ull << 30;
+
+// 头（crc32 字段按 0 算）+ token 区 + 负载（落盘形态）
+static uint32_t session_crc(const SessionFileHeader& h, const llama_token* tokens, const uint8_t* payload, size_t n_payload) {
+    SessionFileHeader hc = h;
+    hc.crc32 = 0;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, (const Bytef*)&hc, (uInt)sizeof(hc));
+    crc = crc32(crc, (const Bytef*)tokens, (uInt)(h.n_tokens * sizeof(llama_token)));
+    crc = crc32(crc, payload, (uInt)n_payload);
+    return (uint32_t)crc;
+}
+
+static bool parse_sha256_hex(const std::string& hex, uint8_t out[32]) {
+    if (hex.size() != 64) return false;
+    auto nib = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+    for (int i = 0; i < 32; ++i) {
+        int hi = nib(hex[2 * i]), lo = nib(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) return false;
+        out[i] = (uint8_t)((hi << 4) | lo);
+    }
+    return true;
+}
+
+static void fill_session_header(SessionFileHeader& h, const uint8_t sha[32]) {
+    h = SessionFileHeader{};
+    h.magic   = kSessionMagic;
+    h.version = kSessionVersion;
+    std::copy(sha, sha + 32, h.model_sha256);
+    h.n_ctx   = llama_n_ctx(g_ctx);
+    h.type_k  = (int32_t)g_cparams.type_k;
+    h.type_v  = (int32_t)g_cparams.type_v;
+}
+
+static bool save_session_file(const std::string& path, const uint8_t sha[32], bool compress) {
+    const size_t n_raw = llama_state_seq_get_size(g_ctx, 0);
+    std::vector<uint8_t> raw(n_raw);
+    if (n_raw == 0 || llama_state_seq_get_data(g_ctx, raw.data(), n_raw, 0) == 0) {
+        LOGE("save session: empty state");
+        return false;
+    }
+
+    SessionFileHeader h;
+    fill_session_header(h, sha);
+    h.n_tokens    = (uint32_t)g_session_tokens.size();
+    h.raw_size    = n_raw;
+    h.n_keep      = (uint32_t)g_session_n_keep;
+    h.n_discarded = (uint32_t)g_session_n_discarded;
+
+    std::vector<uint8_t> packed;
+    const uint8_t* payload = raw.data();
+    size_t n_payload = n_raw;
+    if (compress) {
+        uLongf n_packed = compressBound((uLong)n_raw);
+        packed.resize(n_packed);
+        // KV 多为量化值，压缩率有限，用最快档；压不下来就存原始数据
+        if (compress2(packed.data(), &n_packed, raw.data(), (uLong)n_raw, 1) == Z_OK && n_packed < n_raw) {
+            payload   = packed.data();
+            n_payload = n_packed;
+            h.flags  |= kSessionFlagZlib;
+        }
+    }
+    h.stored_size = n_payload;
+    h.crc32 = session_crc(h, g_session_tokens.data(), payload, n_payload);
+
+    const std::string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f) { LOGE("save session: open %s failed", tmp.c_str()); return false; }
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1
+           && fwrite(g_session_tokens.data(), sizeof(llama_token), h.n_tokens, f) == h.n_tokens
+           && fwrite(payload, 1, n_payload, f) == n_payload
+           && fflush(f) == 0
+           && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        LOGE("save session: write %s failed", path.c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    g_perf.session_file_bytes = sizeof(h) + h.n_tokens * sizeof(llama_token) + n_payload;
+    return true;
+}
+
+// 文件整体读进临时缓冲并校验（头、大小、CRC、解压），通过后才替换 seq 0
+static bool read_session_file(const std::string& path, const uint8_t sha[32], SessionFileHeader& h,
+                              std::vector<llama_token>& tokens, std::vector<uint8_t>& raw) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    struct Closer { FILE* f; ~Closer() { fclose(f); } } closer{f};
+
+    SessionFileHeader want;
+    fill_session_header(want, sha);
+    if (fread(&h, sizeof(h), 1, f) != 1) return false;
+    if (h.magic != kSessionMagic || h.version != kSessionVersion
+        || !std::equal(h.model_sha256, h.model_sha256 + 32, want.model_sha256)
+        || h.n_ctx != want.n_ctx || h.type_k != want.type_k || h.type_v != want.type_v) {
+        LOGW("load session: stale header, ignored (%s)", path.c_str());
+        return false;
+    }
+    struct stat st{};
+    const uint64_t expect = sizeof(h) + (uint64_t)h.n_tokens * sizeof(llama_token) + h.stored_size;
+    if (h.n_tokens == 0 || h.n_tokens > h.n_ctx || h.n_keep > h.n_tokens || fstat(fileno(f), &st) != 0 || (uint64_t)st.st_size != expect) {
+        LOGW("load session: size mismatch, ignored (%s)", path.c_str());
+        return false;
+    }
+    const bool zipped = (h.flags & kSessionFlagZlib) != 0;
+    if (h.raw_size == 0 || h.raw_size > kSessionMaxRawBytes
+        || (zipped ? h.raw_size > h.stored_size * 1032 : h.raw_size != h.stored_size)) {
+        LOGW("load session: bad raw size %llu, ignored (%s)", (unsigned long long)h.raw_size, path.c_str());
+        return false;
+    }
+
+    tokens.resize(h.n_tokens);
+    std::vector<uint8_t> stored(h.stored_size);
+    if (fread(tokens.data(), sizeof(llama_token), h.n_tokens, f) != h.n_tokens
+        || fread(stored.data(), 1, stored.size(), f) != stored.size()) return false;
+    if (session_crc(h, tokens.data(), stored.data(), stored.size()) != h.crc32) {
+        LOGW("load session: crc mismatch (%s)", path.c_str());
+        return false;
+    }
+
+    if (zipped) {
+        raw.resize(h.raw_size);
+        uLongf n_raw = (uLongf)h.raw_size;
+        if (uncompress(raw.data(), &n_raw, stored.data(), (uLong)stored.size()) != Z_OK || n_raw != h.raw_size) return false;
+    } else {
+        raw.swap(stored);
+    }
+    return true;
+}
+
+// 成功返回恢复的 token 数；头不匹配/文件损坏/写入 KV 失败返回 -1，当前会话保持原样
+static int32_t load_session_file(const std::string& path, const uint8_t sha[32]) {
+    SessionFileHeader h{};
+    std::vector<llama_token> tokens;
+    std::vector<uint8_t> raw;
+    try {
+        if (!read_session_file(path, sha, h, tokens, raw)) return -1;
+    } catch (const std::bad_alloc&) {
+        LOGE("load session: out of memory (%s)", path.c_str());
+        return -1;
+    }
+
+    // llama_state_seq_set_data 会先清掉 seq 0：失败时要靠备份把当前会话放回去
+    std::vector<uint8_t> backup;
+    if (!g_session_tokens.empty()) {
+        try {
+            backup.resize(llama_state_seq_get_size(g_ctx, 0));
+        } catch (const std::bad_alloc&) {
+            backup.clear();
+        }
+        if (backup.empty() || llama_state_seq_get_data(g_ctx, backup.data(), backup.size(), 0) == 0) {
+            LOGE("load session: cannot back up current session");
+            return -1;
+        }
+    }
+    llama_memory_clear(llama_get_memory(g_ctx), false);
+    if (llama_state_seq_set_data(g_ctx, raw.data(), raw.size(), 0) == 0
+        || llama_memory_seq_pos_max(llama_get_memory(g_ctx), 0) + 1 != (llama_pos)h.n_tokens) {
+        LOGE("load session: set_data failed (%s)", path.c_str());
+        llama_memory_clear(llama_get_memory(g_ctx), false);
+        if (!backup.empty() && llama_state_seq_set_data(g_ctx, backup.data(), backup.size(), 0) == 0) {
+            LOGE("load session: restoring previous session failed");
+            reset_session();
+        }
+        return -1;
+    }
+    g_session_tokens.swap(tokens);
+    g_session_n_keep      = h.n_keep;
+    g_session_n_discarded = h.n_discarded;
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    g_perf.mem_clears++;
+    return (int32_t)h.n_tokens;
+}
+
+// ===== JNI: init =====
+static jboolean JNICALL
+Java_com_kingsun_plugins_llm_LlamaNative_nativeInit(JNIEnv* env, jclass, jstring modelPath_, jint nCtx,
+                                                    jint nBatch, jint nUbatch,
+                                                    jboolean keepStandby, jint prefixCacheMb, jint parallel) {
+    std::lock_guard<std::mutex> lk(g_mutex);
+
+    std::string path = jstring_to_string(env, modelPath_);
+
+    destroy_context(g_ctx);
+    destroy_context(g_ctx_standby);
+    if (g_model) { llama_model_free(g_model); g_model = nullptr; }
+    g_vocab = nullptr;
+    grammar_end(g_grammar);
+    grammar_cache_reset(nullptr);
+    g_pieces.clear();
+    g_arena.release();
+    g_session_tokens.clear();
+    g_ctx_broken = false;
+    g_prefix_cache.clear();
+    g_prefix_cache.set_budget((size_t)std::max(0, (int)prefixCacheMb) << 20);
+    publish_prefix_stats();
+
+    llama_backend_init();
+
+    llama_model_params mparams = llama_model_default_params();
+    mparams.use_mmap  = true;
+    mparams.use_mlock = false;
+
+    g_model = llama_model_load_from_file(path.c_str(), mparams);
+    if (!g_model) { LOGE("load model failed"); llama_backend_free(); return JNI_FALSE; }
+
+    g_vocab = llama_model_get_vocab(g_model);
+    if (!g_vocab) { LOGE("get vocab failed"); llama_model_free(g_model); g_model=nullptr; llama_backend_free(); return JNI_FALSE; }
+    build_piece_table();
+
+    g_cparams = llama_context_default_params();
+    g_cparams.n_ctx    = (nCtx > 0 ? nCtx : 2048);
+    // n_ubatch 决定计算缓冲区大小（init 时一次性分配），n_batch 是单次 decode 的逻辑上限 = prefill 块上限
+    if (nBatch > 0)  g_cparams.n_batch  = (uint32_t)nBatch;
+    if (nUbatch > 0) g_cparams.n_ubatch = (uint32_t)nUbatch;
+    g_cparams.n_batch  = std::min(g_cparams.n_batch, g_cparams.n_ctx);
+    g_cparams.n_ubatch = std::min(g_cparams.n_ubatch, g_cparams.n_batch);
+    g_cparams.type_k   = GGML_TYPE_Q8_0;
+    g_cparams.type_v   = GGML_TYPE_Q8_0;
+    // 并行作文：seq 0 留给 chat 会话，另开 parallel 条序列；KV 统一缓冲，各序列按需占用 n_ctx
+    g_parallel = std::clamp((int)parallel, 1, 16);
+    if (g_parallel > 1) {
+        g_cparams.n_seq_max  = (uint32_t)g_parallel + 1;
+        g_cparams.kv_unified = true;
+    }
+    int ncpu = std::max(2, (int)sysconf(_SC_NPROCESSORS_ONLN) - 1);
+    g_cparams.n_threads = ncpu;
+
+    g_ctx = create_context();
+    if (!g_ctx) {
+        LOGE("new context failed");
+        llama_model_free(g_model); g_model=nullptr; g_vocab=nullptr;
+        g_pieces.clear();
+        llama_backend_free();
+        return JNI_FALSE;
+    }
+    g_keep_standby = keepStandby == JNI_TRUE;
+    ensure_standby();
+    g_arena.reserve((int)llama_n_batch(g_ctx), vocab_size(g_vocab));
+    g_session_tokens.reserve(llama_n_ctx(g_ctx));   // 历史最多 n_ctx 个，push_back 不再扩容
+    grammar_cache_reset(g_vocab);
+
+    LOGI("nativeInit OK n_ctx=%d n_batch=%d n_ubatch=%d threads=%d standby=%d parallel=%d", g_cparams.n_ctx,
+         g_cparams.n_batch, g_cparams.n_ubatch, g_cparams.n_threads, g_ctx_standby ? 1 : 0, g_parallel);
+    return JNI_TRUE;
+}
+
+static void cancel_all_jobs();
+static void drain_jobs();
+static bool cancel_job(int64_t id);
+
+// ===== JNI: free =====
+// 先排空任务队列（排队中的与正在跑的都以取消收尾），再释放模型
+static void JNICALL
+Java_com_kingsun_plugins_llm_LlamaNative_nativeFree(JNIEnv*, jclass) {
+    drain_jobs();
+    std::lock_guard<std::mutex> lk(g_mutex);
+    destroy_context(g_ctx);
+    destroy_context(g_ctx_standby);
+    if (g_model) { llama_model_free(g_model); g_model = nullptr; }
+    g_vocab = nullptr;
+    g_pieces.clear();
+    g_arena.release();
+    g_session_tokens.clear();
+    g_prefix_cache.clear();
+    publish_prefix_stats();
+    g_sampler.reset();
+    g_sampler_cache.entries.clear();
+    grammar_end(g_grammar);
+    grammar_cache_reset(nullptr);
+    llama_backend_free();
+}
+
+// ===== JNI: stop / cancel =====
+// 不拿 g_mutex：abort 回调在图计算中途就能看到，当前 decode 立刻返回
+static void JNICALL
+Java_com_kingsun_plugins_llm_LlamaNative_nativeStop(JNIEnv*, jclass) {
+    cancel_all_jobs();
+}
+
+static jboolean JNICALL
+Java_com_kingsun_plugins_llm_LlamaNative_nativeCancel(JNIEnv*, jclass, jlong id) {
+    return cancel_job((int64_t)id) ? JNI_TRUE : JNI_FALSE;
+}
+
+// ===== JNI: set sampling =====
+static void JNICALL
+Java_com_kingsun_plugins_llm_LlamaNative_nativeSetSampling(JNIEnv*, jclass,
+                                                         jfloat temp, jfloat topP, jint topK, jfloat repeatPenalty, jint repeatLastN, jfloat minP) {
+    const int64_t t0 = now_us();
+    SamplerParams sp;
+    sp.temp           = std::max(0.f, (float)temp);
+    sp.top_p          = std::clamp((float)topP, 0.f, 1.f);
+    sp.top_k          = std::max(0, (int)topK);
+    sp.repeat_penalty = std::max(0.0f, (float)repeatPenalty);
+    sp.repeat_last_n  = std::max(0, (int)repeatLastN);
+    sp.min_p          = std::clamp((float)minP, 0.f, 1.f);
+    // min_keep 保持 1，避免采样坍缩
+    sp.min_keep       = 1;
+    publish_sampling(sp);
+
+    const double us = (double)(now_us() - t0);
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    g_perf.set_sampling_us_last = us;
+    g_perf.set_sampling_us_max  = std::max(g_perf.set_sampling_us_max, us);
+}
+
+// ===== 生成任务：由生成线程执行，回调到提交它的 LlamaNative 实例 =====
+enum class JobKind { Chat, Generate };
+struct Job {
+    int64_t                  id        = 0;
+    JobKind                  kind      = JobKind::Chat;
+    jobject                  target    = nullptr;   // 全局引用，任务结束后释放
+    std::vector<ChatMessage> msgs;                  // Chat
+    std::string              prompt;                // Generate
+    int32_t                  max_new   = 0;
+    int32_t                  priority  = 0;         // 0 = 交互（chat 默认），1 = 后台（作文默认）
+    int64_t                  submit_us = 0;
+    int64_t                  deadline_us = 0;       // 提交时 + timeoutMs（含排队时间），0 = 不限
+    bool                     stream    = false;     // Generate：边生成边走 token 流并切句/段
+    bool                     greedy    = false;     // Generate：确定性解码（不抽样，惩罚后取 argmax）
+    std::shared_ptr<GrammarEntry> grammar;          // 提交时编译好的 GBNF（root 规则），空 = 不约束；有约束的不进连续批处理
+    StopMatcher              stop;                  // 用户停止串（提交时构建）；被抢占时连同扣住的尾巴一起保存
+    int32_t                  think     = 0;         // Chat：ThinkMode（Qwen3 推理段的处理方式）
+    int32_t                  think_budget = 0;      // Chat：推理段 token 上限，0 = 不限
+    bool                     cancelled = false;     // 排队中被 stop/cancel 取消，不执行直接回调结束
+    // 被抢占的后台 Generate 续跑所需的状态
+    bool                     suspended = false;
+    int64_t                  t_first_us = 0;
+    std::vector<llama_token> gen;
+    std::string              partial;
+    Utf8Stream               utf8;
+    EssaySegmenter           seg;
+};
+
+// 排队中未取消的交互请求数；后台 Generate 每个 token 看一眼，> 0 就让位
+static std::atomic<int32_t> g_engine_interactive{0};
+
+// 多轮会话：整段对话（含 App 重发的历史）与 KV 里的历史 diff 后只 prefill 新的一轮
+static void run_chat(JNIEnv* env, const Job& job) {
+    std::lock_guard<std::mutex> lk(g_mutex);
+    if (!g_ctx || !g_model || !g_vocab) { LOGE("not initialized"); return; }
+    const int64_t t_start = now_us();
+    rebuild_context_if_needed();
+    if (!g_ctx) { LOGE("context unavailable"); return; }
+
+    jobject thiz = job.target;
+    if (!grammar_begin(g_grammar, job.grammar)) return;
+    // 带语法约束时回答必须从第一个 token 起就合语法：关掉思考
+    g_think_mode = !job.grammar ? job.think : kThinkOff;
+    g_think.begin(g_think_mode != kThinkOff);
+    std::string& prompt = g_arena.prompt;
+    build_chatml_prompt(job.msgs, prompt, g_think_mode == kThinkOff);
+
+    g_arena.utf8.reset();
+    g_streamer.begin(job.id);
+    begin_request(job.deadline_us);
+
+    std::vector<llama_token>& ptok = g_arena.ptok;
+    tokenize_prompt(prompt, ptok);
+
+    // 固定 system 段作为 attention sink；没有识别出来时至少留前 4 个 token
+    size_t head_len = prompt_head_tokens(prompt, ptok);
+    note_request_setup(t_start);
+    begin_prefill(0, [&](int32_t done, int32_t total) {
+        env->CallVoidMethod(thiz, g_jni.on_progress, (jlong)job.id, done, total);
+        jni_clear_exception(env);
+    });
+    int32_t cur_pos = 0;
+    if (!sync_session_to(ptok, head_len, head_len > 0 ? head_len : 4, cur_pos)) {
+        end_request(true);
+        return;
+    }
+
+    // 每轮用自己的采样器，重复惩罚不带上一轮的历史
+    g_sampler_greedy = false;
+    rebuild_sampler_chain(sampling_snapshot());
+    BatchBuf& step = g_arena.batch;
+    std::string& piece = g_arena.piece;
+    SteadyAllocMeter meter;
+    // max_new 只算回答的 token；推理段另有预算（未设时与 max_new 相同），两者合计有上限
+    const int32_t max_new = job.max_new;
+    g_stop_strings = job.stop;
+    FinishReason why = FinishReason::Limit;
+    int n_gen = 0;
+    // 推理预算：到了就把结束标签逐个当作生成的 token 喂进去（走同一条 decode 路径）
+    const int32_t think_budget = g_think_mode == kThinkOff ? 0 : (job.think_budget > 0 ? job.think_budget : max_new);
+    int32_t n_thought = 0, n_answer = 0;
+    std::vector<llama_token> forced;
+    size_t i_forced = 0;
+    const int64_t t_decode = now_us();
+
+    for (int i = 0; n_answer < max_new && !should_abort(); ++i, ++cur_pos) {
+        meter.tick();
+        sync_sampler(i);   // setSampling 在下一个 token 生效
+        llama_token next;
+        if (i_forced < forced.size()) {
+            next = forced[i_forced++];
+            llama_sampler_accept(g_sampler.get(), next);   // 重复惩罚照常记上
+        } else {
+            next = sample_next_token(g_ctx, g_sampler.get(), -1, &g_grammar);
+        }
+        if (next == LLAMA_TOKEN_NULL) {
+            LOGW("sampler returned NULL token, fallback to greedy or stop");
+            // 可选：fallback
             const float *logits = get_logits(g_ctx);
             if (logits) {
                 next = greedy_argmax(logits, vocab_size(g_vocab));
             }
             if (next == LLAMA_TOKEN_NULL) break;
         }
-        if (next == tok_eos(g_vocab)) break;
-        std::string piece = detok_piece(next);
-        if (!piece.empty()) emit_utf8_safely(env, thiz, cbCls, midOnToken, piece);
+        if (tok_is_eog(g_vocab, next)) { why = FinishReason::Eog; break; }
+        n_gen = i + 1;
+        if (emit_chat_token(env, thiz, next, piece)) { why = FinishReason::StopString; break; }
+        if (g_think.in_thought()) {
+            ++n_thought;
+            if (think_budget > 0 && n_thought >= think_budget && forced.empty()) {
+                forced = tokenize_text(kThinkClose, false, true);
+                i_forced = 0;
+                std::lock_guard<std::mutex> pk(g_perf_mutex);
+                g_perf.think_budget_hits++;
+            }
+        } else {
+            ++n_answer;
+        }
+        if (!ensure_room_for_next(cur_pos)) { LOGW("context full and cannot shift"); break; }
         step.token[0]  = next;
         step.pos[0]    = cur_pos;
         step.logits[0] = 1;
-        if (llama_decode(g_ctx, step.as_batch()) != 0) break;
+        int32_t rc = llama_decode(g_ctx, step.as_batch(1));
+        if (rc != 0) { rollback_aborted_decode(rc, cur_pos); note_decode_result(rc); break; }
+        g_session_tokens.push_back(next);
+    }
+    meter.finish();
+    finish_chat_stream(env, thiz, why == FinishReason::StopString);
+    note_finish(why, (size_t)n_answer, (size_t)max_new);
+    {
+        std::lock_guard<std::mutex> pk(g_perf_mutex);
+        g_perf.chat_tokens_last = (uint64_t)n_gen;
+        g_perf.chat_decode_ms_last = (now_us() - t_decode) / 1000.0;
+        g_perf.think_tokens_last = (uint64_t)n_thought;
+        g_perf.think_tokens_total += (uint64_t)n_thought;
     }
 
-    flush_pending(env, thiz, cbCls, midOnToken);
-    env->CallVoidMethod(thiz, midOnDone);
-    env->DeleteLocalRef(cbCls);
+    end_request(false);
+    flush_pending(env, thiz);
 }
 
-// ===== JNI: 一次性生成 =====
-extern "C" JNIEXPORT jstring JNICALL
-Java_com_kingsun_plugins_llm_LlamaNative_nativeGenerateOnce(JNIEnv* env, jobject,
-                                                          jstring prompt_, jint maxNew_) {
+// 一次性生成：返回整段 UTF-8（失败/未初始化返回空串）。
+// 后台请求在 token 边界让位给排队的交互请求：已生成的 token/正文/解码状态存回 job，
+// job.suspended = true，之后重新排队，续跑时把 prompt + 已生成部分一起与会话 diff
+static std::string run_generate(JNIEnv* env, Job& job) {
     std::lock_guard<std::mutex> lk(g_mutex);
-    if (!g_ctx || !g_model || !g_vocab) return env->NewStringUTF("");
-
-    const char* p = env->GetStringUTFChars(prompt_, nullptr);
-    std::string prompt = p ? p : "";
-    env->ReleaseStringUTFChars(prompt_, p);
-
-    reset_session();
-    g_pending_utf8.clear();
-    g_stop.store(false, std::memory_order_relaxed);
-
-    auto ptok = tokenize_text(prompt, true, true);
-    ptok = fit_to_context(ptok, llama_n_ctx(g_ctx));
-
+    const bool resumed = job.suspended;
+    job.suspended = false;
+    if (!g_ctx || !g_model || !g_vocab) return std::move(job.partial);
+    const int64_t t_start = now_us();
+    if (!resumed) job.t_first_us = t_start;
+    rebuild_context_if_needed();
+    if (!g_ctx) return std::move(job.partial);
+    if (!grammar_begin(g_grammar, job.grammar)) return std::move(job.partial);
+    if (resumed) for (llama_token t : job.gen) grammar_accept(g_grammar, t);
+
+    const std::string& prompt = job.prompt;
+    if (resumed) {
+        g_arena.utf8 = job.utf8;
+        if (job.stream) { g_streamer.begin(job.id); g_segmenter = std::move(job.seg); }
+    } else {
+        g_arena.utf8.reset();
+        if (job.stream) { g_streamer.begin(job.id); g_segmenter.begin(); }
+    }
+    begin_request(job.deadline_us);
+
+    // 与会话 diff：连续的作文请求可直接复用要求段，否则走前缀缓存
+    std::vector<llama_token>& ptok = g_arena.ptok;
+    tokenize_prompt(prompt, ptok);
+    size_t head_len = prompt_head_tokens(prompt, ptok);
+    const size_t n_prompt = ptok.size();
+    if (resumed) ptok.insert(ptok.end(), job.gen.begin(), job.gen.end());
+    note_request_setup(t_start);
+
+    begin_prefill(0, [&](int32_t done, int32_t total) {
+        env->CallVoidMethod(job.target, g_jni.on_progress, (jlong)job.id, done, total);
+        jni_clear_exception(env);
+    });
+    // 作文整段指令都固定住，窗口滑动只丢已生成的正文
     int32_t cur_pos = 0;
-    if (!prefill_tokens(ptok, cur_pos, true)) return env->NewStringUTF("");
-
-    rebuild_sampler_chain();
-    std::string out;
-    BatchBuf step; step.resize(1);
-    int32_t max_new = std::max(32, (int32_t)maxNew_);
+    if (!sync_session_to(ptok, head_len, n_prompt, cur_pos)) {
+        end_request(true);
+        return resumed ? std::move(job.partial) : std::string();
+    }
 
-    for (int i = 0; i < max_new && !g_stop.load(std::memory_order_relaxed); ++i, ++cur_pos) {
-        llama_token next = sample_next_token(g_ctx, g_sampler.get());
+    // 每篇作文用新链，不带上一次的重复惩罚历史；续跑时补回已生成部分
+    g_sampler_greedy = job.greedy;
+    const SamplerParams sp = sampling_for(job.greedy);
+    rebuild_sampler_chain(sp);
+    if (resumed && g_sampler) {
+        const size_t n = std::min(job.gen.size(), (size_t)std::max(0, sp.repeat_last_n));
+        for (size_t k = job.gen.size() - n; k < job.gen.size(); ++k) llama_sampler_accept(g_sampler.get(), job.gen[k]);
+    }
+    int32_t max_new = std::max(32, job.max_new);
+    std::string& out = g_arena.out;
+    out.clear();
+    out.reserve((size_t)max_new * 8);   // 平均每 token 远小于 8 字节，循环内不再扩容
+    if (resumed) out.append(job.partial);
+    job.gen.reserve((size_t)max_new);
+    BatchBuf& step = g_arena.batch;
+    std::string& piece = g_arena.piece;
+    SteadyAllocMeter meter;
+    const size_t gen_start = job.gen.size();
+    const int64_t t_decode = now_us();
+    std::swap(g_stop_strings, job.stop);   // 续跑时接着上次扣住的尾巴匹配
+    FinishReason why = FinishReason::Limit;
+
+    for (int i = (int)job.gen.size(); i < max_new && !should_abort(); ++i, ++cur_pos) {
+        if (job.priority > 0 && g_engine_interactive.load(std::memory_order_relaxed) > 0) {
+            job.suspended = true;
+            break;
+        }
+        meter.tick();
+        sync_sampler(i);   // setSampling 在下一个 token 生效
+        llama_token next = sample_next_token(g_ctx, g_sampler.get(), -1, &g_grammar);
         if (next == LLAMA_TOKEN_NULL) {
             LOGW("sampler returned NULL token, fallback to greedy or stop");
             // 可选：fallback
@@ -536,49 +2263,1113 @@ Java_com_kingsun_plugins_llm_LlamaNative_nativeGenerateOnce(JNIEnv* env, jobject
             }
             if (next == LLAMA_TOKEN_NULL) break;
         }
-        if (next == tok_eos(g_vocab)) break;
+        if (tok_is_eog(g_vocab, next)) { why = FinishReason::Eog; break; }
 
-        std::string piece = detok_piece(next);
-        if (!piece.empty()) out.append(piece);
+        // stream 时与 chat 同一条 token 流；out 仍按 UTF-8 累积，切句/段后作为整句事件送出
+        const bool hit = emit_checked(env, job.target, next, piece, job.stream, &out);
+        if (job.stream) segment_essay(env, job.target, out, false);
+        if (hit) { job.gen.push_back(next); why = FinishReason::StopString; break; }
 
+        if (!ensure_room_for_next(cur_pos)) { LOGW("context full and cannot shift"); break; }
         step.token[0]  = next;
         step.pos[0]    = cur_pos;
         step.logits[0] = 1;
-        if (llama_decode(g_ctx, step.as_batch()) != 0) break;
+        int32_t rc = llama_decode(g_ctx, step.as_batch(1));
+        if (rc != 0) { rollback_aborted_decode(rc, cur_pos); note_decode_result(rc); break; }
+        g_session_tokens.push_back(next);
+        job.gen.push_back(next);
     }
-    return env->NewStringUTF(out.c_str());
+    meter.finish();
+    if (!job.suspended) {
+        if (why != FinishReason::StopString) release_held(job.stream, &out);
+        note_finish(why, job.gen.size(), (size_t)max_new);
+    }
+    std::swap(g_stop_strings, job.stop);
+    end_request(false);
+    {
+        const double secs = (now_us() - t_decode) / 1e6;
+        std::lock_guard<std::mutex> pk(g_perf_mutex);
+        g_perf.generate_tps_last = secs > 0 ? (job.gen.size() - gen_start) / secs : 0;
+    }
+    if (job.suspended) {
+        // 合并缓冲先送出；不完整的 UTF-8 尾巴留在 job.utf8 里，续跑时接着解
+        if (job.stream) g_streamer.flush(env, job.target, now_us());
+        job.utf8    = g_arena.utf8;
+        job.partial = out;
+        if (job.stream) job.seg = std::move(g_segmenter);
+        return {};
+    }
+    if (job.stream) {
+        flush_pending(env, job.target);
+        segment_essay(env, job.target, out, true);
+        note_essay_stream(job.t_first_us);
+    }
+    return out;
+}
+
+
+
+// UTF-8 -> jstring（走 UTF-16，避免 NewStringUTF 的 Modified-UTF8 对 4 字节字符的限制）
+static jstring new_jstring_utf16(JNIEnv* env, const std::string& s) {
+    std::u16string u16;
+    Utf8Stream dec;
+    dec.feed(s.data(), s.size(), u16);
+    dec.finish(u16);   // 不完整尾巴补 U+FFFD
+    return env->NewString(reinterpret_cast<const jchar*>(u16.data()), static_cast<jsize>(u16.size()));
+}
+
+// ===== 生成线程与调度 =====
+// 常驻一个线程，JNI_OnLoad 时启动并 attach 一次；Java 侧提交后立即返回，
+// Chat 结束回调 onNativeDone(id)，Generate 结束回调 onNativeResult(id, text)。
+// 取任务顺序：已取消的先收尾，其余按 优先级 → 截止时间（早的先）→ 提交顺序；
+// 后台 Generate 在 token 边界让位给新来的交互请求，之后带着已生成部分重新排队
+struct Engine {
+    std::mutex              mu;
+    std::condition_variable cv;
+    std::deque<Job>         queue;
+    std::thread             th;
+    bool                    quit       = false;
+    int64_t                 next_id    = 1;
+    int64_t                 running_id = 0;   // 正在执行的请求，0 = 空闲
+    std::vector<int64_t>    batch_ids;        // 连续批处理中的请求
+    std::vector<int64_t>    batch_cancel;     // 待批处理循环收尾的 cancel(id)
+    bool                    busy       = false;   // 生成线程正在处理取出的任务（含已取消任务的收尾回调）
+    std::condition_variable idle_cv;          // busy 落下时通知（nativeFree 等队列排空）
+};
+static Engine g_engine;
+
+// 持 g_engine.mu 调用
+static void update_interactive_locked() {
+    int32_t n = 0;
+    for (const auto& j : g_engine.queue) if (!j.cancelled && j.priority == 0) ++n;
+    g_engine_interactive.store(n, std::memory_order_relaxed);
+}
+
+// 持 g_engine.mu 调用：stop 标志与 running_id 在同一把锁下切换，cancel(id) 不会打到下一个请求
+static void stop_running_locked() {
+    int64_t expected = 0;
+    g_stop_at_us.compare_exchange_strong(expected, now_us(), std::memory_order_relaxed);
+    g_stop.store(true, std::memory_order_relaxed);
+}
+
+// 持 g_engine.mu 调用；队列非空。顺带把排队期间过了截止时间的标记取消
+static std::deque<Job>::iterator best_job_locked() {
+    const int64_t now = now_us();
+    auto better = [](const Job& a, const Job& b) {
+        if (a.cancelled != b.cancelled) return a.cancelled;
+        if (a.priority != b.priority) return a.priority < b.priority;
+        const int64_t da = a.deadline_us > 0 ? a.deadline_us : INT64_MAX;
+        const int64_t db = b.deadline_us > 0 ? b.deadline_us : INT64_MAX;
+        if (da != db) return da < db;
+        return a.id < b.id;
+    };
+    uint64_t expired = 0;
+    for (auto& j : g_engine.queue) {
+        if (!j.cancelled && j.deadline_us > 0 && now > j.deadline_us) { j.cancelled = true; ++expired; }
+    }
+    auto it = g_engine.queue.begin();
+    for (auto jt = it + 1; jt != g_engine.queue.end(); ++jt) if (better(*jt, *it)) it = jt;
+    if (expired > 0) {
+        std::lock_guard<std::mutex> lk(g_perf_mutex);
+        g_perf.queue_expired += expired;
+        g_perf.deadline_hits += expired;
+    }
+    return it;
+}
+
+// 记一次首次开始执行的排队等待
+static void note_queue_wait(const Job& job) {
+    if (job.cancelled || job.t_first_us != 0 || job.suspended) return;
+    const double wait_ms = (now_us() - job.submit_us) / 1000.0;
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    g_perf.queue_started++;
+    g_perf.queue_wait_ms_last   = wait_ms;
+    g_perf.queue_wait_ms_total += wait_ms;
+    g_perf.queue_wait_ms_max    = std::max(g_perf.queue_wait_ms_max, wait_ms);
+}
+
+// 持 g_engine.mu 调用；队列非空
+static Job pick_job_locked() {
+    auto it = best_job_locked();
+    Job job = std::move(*it);
+    g_engine.queue.erase(it);
+    update_interactive_locked();
+    g_engine.running_id = job.cancelled ? 0 : job.id;
+    g_stop.store(false, std::memory_order_relaxed);
+    g_stop_at_us.store(0, std::memory_order_relaxed);
+    note_queue_wait(job);
+    return job;
+}
+
+static void finish_job(JNIEnv* env, const Job& job, const std::string* text) {
+    if (job.kind == JobKind::Generate) {
+        jstring jtext = new_jstring_utf16(env, text ? *text : std::string());
+        env->CallVoidMethod(job.target, g_jni.on_result, (jlong)job.id, jtext);
+        if (jtext) env->DeleteLocalRef(jtext);
+        jni_clear_exception(env);
+    }
+    // Chat 与流式作文：结束标记走同一个环，保证排在最后一段文本之后；
+    // 流式作文的全文先经 onNativeResult 交给 Java，收到结束标记再 resolve
+    if (job.kind == JobKind::Chat || job.stream) {
+        if (!ring_write(kRecEnd, nullptr, 0, job.id)) env->CallVoidMethod(job.target, g_jni.on_done, (jlong)job.id);
+    }
+    jni_clear_exception(env);
+}
+
+// ===== 连续批处理：多个 Generate 请求共用一次 decode =====
+// init 时 parallel > 1 才启用：上下文 n_seq_max = parallel + 1、KV 统一缓冲。seq 0 仍归 chat 会话
+// （diff/平移/落盘都只管 seq 0），作文占 seq 1..parallel。每一步把所有生成中序列的下一个 token
+// 和新接纳序列的 prefill 块拼成一个 batch，只调一次 llama_decode；
+// 权重每步只读一遍，内存带宽受限的手机 CPU 上吞吐随并发数近线性增长。
+// 结束的序列立即 llama_memory_seq_rm 释放，空出来的槽位在下一步接纳排队中的请求。
+// 交互请求到来时整批让位：各序列的进度存回 job 重新排队（同 run_generate 的续跑）
+// 同批 prompt 开头相同（generateEssays 的要求段）时，新序列不自己 prefill 这段，
+// 等先来的序列把它写进 KV 后用 llama_memory_seq_cp 分叉过来（统一 KV 下只是给 cell 加一个 seq 标记）
+
+struct BatchSlot {
+    Job                      job;
+    llama_seq_id             seq      = 0;
+    bool                     active   = false;
+    std::vector<llama_token> ptok;               // prompt（续跑时含已生成部分）
+    size_t                   head_len = 0;
+    size_t                   fed      = 0;       // ptok 中已写进 KV 的个数
+    int32_t                  pos      = 0;       // 本序列下一个位置
+    llama_token              pending  = LLAMA_TOKEN_NULL;   // 已采样、待 decode 的 token
+    int32_t                  i_batch  = -1;      // 本步 logits 在 batch 中的下标
+    int32_t                  n_fill   = 0;       // 本步放进 batch 的 prefill 数
+    int32_t                  fork_from = -1;     // 等着从哪个槽位分叉共享前缀（-1 = 不分叉）
+    int64_t                  fork_job  = 0;      // 分叉源当时的请求 id，槽位换了人就作废
+    size_t                   fork_len  = 0;
+    size_t                   kv_reserved = 0;    // 接纳时按 prompt + 剩余生成数预留的 KV
+    int32_t                  max_new  = 0;
+    SamplerPtr               smpl{nullptr, llama_sampler_free};
+    uint64_t                 smpl_version = 0;
+    std::string              out;
+    // 流式状态：处理本槽位时换进 g_streamer / g_arena.utf8 / g_segmenter
+    TokenStreamer            st;
+    Utf8Stream               utf8;
+    EssaySegmenter           seg;
+};
+
+// emit_checked / segment_essay / flush_pending 都用全局流式状态与停止串匹配器；处理某个槽位期间把它的换进来
+struct SlotStreamScope {
+    BatchSlot& s;
+    explicit SlotStreamScope(BatchSlot& slot) : s(slot) { swap(); }
+    ~SlotStreamScope() { swap(); }
+    void swap() {
+        std::swap(g_streamer, s.st);
+        std::swap(g_arena.utf8, s.utf8);
+        std::swap(g_segmenter, s.seg);
+        std::swap(g_stop_strings, s.job.stop);
+    }
+};
+
+static void slot_sync_sampler(BatchSlot& s, bool force) {
+    if (!force && s.smpl && sampling_version() == s.smpl_version) return;
+    const SamplerParams sp = sampling_for(s.job.greedy);
+    const int64_t t0 = now_us();
+    bool hit = false;
+    s.smpl.reset(new_request_sampler(sp, &hit));
+    s.smpl_version = sp.version;
+    if (force) note_sampler_setup(t0, hit);
+    const auto& gen = s.job.gen;
+    const size_t n = std::min(gen.size(), (size_t)std::max(0, sp.repeat_last_n));
+    for (size_t k = gen.size() - n; k < gen.size(); ++k) llama_sampler_accept(s.smpl.get(), gen[k]);
+    if (!force) {
+        std::lock_guard<std::mutex> lk(g_perf_mutex);
+        g_perf.sampling_swaps++;
+    }
+}
+
+// 与同批序列共同前缀不到这个长度就不分叉，走前缀缓存/自己 prefill
+static constexpr size_t kForkMinTokens = 16;
+
+// 接纳一个 Generate 请求到空槽位；KV 预算不够返回 false（job 原样留给调用方）。
+// 分叉共享的 cell 仍按整段 prompt 预留：源序列先结束时这些 cell 归本序列独占
+static bool slot_admit(BatchSlot& s, Job& job, size_t kv_free, std::vector<BatchSlot>& slots) {
+    std::vector<llama_token> ptok;
+    tokenize_prompt(job.prompt, ptok);
+    const size_t head_len = prompt_head_tokens(job.prompt, ptok);
+    const bool resumed = job.suspended;
+    if (resumed) ptok.insert(ptok.end(), job.gen.begin(), job.gen.end());
+    const int32_t max_new = std::max(32, job.max_new);
+    const size_t need = ptok.size() + (size_t)std::max(0, max_new - (int32_t)job.gen.size()) + 1;
+    if (ptok.empty() || need > kv_free) return false;
+
+    const int64_t t0 = now_us();
+    s.job      = std::move(job);
+    s.job.suspended = false;
+    if (!resumed) s.job.t_first_us = t0;
+    s.ptok     = std::move(ptok);
+    s.head_len = head_len;
+    s.max_new  = max_new;
+    s.kv_reserved = need;
+    s.pending  = LLAMA_TOKEN_NULL;
+    s.i_batch  = -1;
+    s.out.clear();
+    s.out.reserve((size_t)max_new * 8);
+    s.job.gen.reserve((size_t)max_new);
+    if (resumed) {
+        s.out.append(s.job.partial);
+        s.utf8 = s.job.utf8;
+        s.seg  = std::move(s.job.seg);
+    } else {
+        s.utf8.reset();
+        s.seg.begin();
+    }
+    s.st.begin(s.job.id);
+
+    // 同批已有序列的 prompt 开头相同：等它写进 KV 后分叉，最后一个 token 自己 decode 拿 logits
+    s.fork_from = -1;
+    size_t best = 0;
+    for (size_t k = 0; k < slots.size(); ++k) {
+        const BatchSlot& d = slots[k];
+        if (!d.active || &d == &s) continue;
+        const size_t lim = std::min(s.ptok.size() - 1, d.ptok.size());
+        size_t l = 0;
+        while (l < lim && d.ptok[l] == s.ptok[l]) ++l;
+        if (l > best) { best = l; s.fork_from = (int32_t)k; }
+    }
+    size_t cached = 0;
+    if (best >= kForkMinTokens) {
+        s.fork_job = slots[(size_t)s.fork_from].job.id;
+        s.fork_len = best;
+        llama_memory_seq_rm(llama_get_memory(g_ctx), s.seq, -1, -1);
+    } else {
+        // 固定的作文要求段优先从前缀缓存写回本序列
+        s.fork_from = -1;
+        bool wiped = false;
+        cached = g_prefix_cache.restore_longest(g_ctx, s.seq, s.ptok.data(), s.ptok.size() - 1, 0, &wiped);
+        if (cached == 0) llama_memory_seq_rm(llama_get_memory(g_ctx), s.seq, -1, -1);
+    }
+    s.fed = cached;
+    s.pos = (int32_t)cached;
+    slot_sync_sampler(s, true);
+    s.active = true;
+    note_request_setup(t0);
+    return true;
+}
+
+static void slot_release(JNIEnv* env, BatchSlot& s) {
+    llama_memory_seq_rm(llama_get_memory(g_ctx), s.seq, -1, -1);
+    s.active = false;
+    s.smpl.reset();
+    s.ptok.clear();
+    {
+        std::lock_guard<std::mutex> lk(g_engine.mu);
+        auto& ids = g_engine.batch_ids;
+        ids.erase(std::remove(ids.begin(), ids.end(), s.job.id), ids.end());
+    }
+    env->DeleteGlobalRef(s.job.target);
+    s.job = Job{};
+}
+
+static void slot_finish(JNIEnv* env, BatchSlot& s) {
+    {
+        SlotStreamScope scope(s);
+        release_held(s.job.stream, &s.out);
+        if (s.job.stream) {
+            flush_pending(env, s.job.target);
+            segment_essay(env, s.job.target, s.out, true);
+            note_essay_stream(s.job.t_first_us);
+        }
+    }
+    finish_job(env, s.job, &s.out);
+    slot_release(env, s);
+}
+
+// 让位：进度存回 job 重新排队（ptok 里已生成的部分续跑时重新 prefill）
+static void slot_suspend(JNIEnv* env, BatchSlot& s) {
+    if (s.job.stream) {
+        SlotStreamScope scope(s);
+        g_streamer.flush(env, s.job.target, now_us());
+    }
+    llama_memory_seq_rm(llama_get_memory(g_ctx), s.seq, -1, -1);
+    Job job = std::move(s.job);
+    job.suspended = true;
+    job.utf8    = s.utf8;
+    job.partial = s.out;
+    job.seg     = std::move(s.seg);
+    s.active = false;
+    s.smpl.reset();
+    s.ptok.clear();
+    s.job = Job{};
+    std::lock_guard<std::mutex> lk(g_engine.mu);
+    auto& ids = g_engine.batch_ids;
+    ids.erase(std::remove(ids.begin(), ids.end(), job.id), ids.end());
+    if (g_stop.load(std::memory_order_relaxed)) job.cancelled = true;
+    g_engine.queue.push_back(std::move(job));
+    update_interactive_locked();
+    std::lock_guard<std::mutex> pk(g_perf_mutex);
+    g_perf.preemptions++;
+}
+
+// 采样结果落到槽位：输出、判断结束；返回 false 表示本序列已结束
+static bool slot_accept_token(JNIEnv* env, BatchSlot& s, llama_token next) {
+    if (next == LLAMA_TOKEN_NULL) return false;
+    if (tok_is_eog(g_vocab, next)) {
+        note_finish(FinishReason::Eog, s.job.gen.size(), (size_t)s.max_new);
+        return false;
+    }
+    std::string& piece = g_arena.piece;
+    bool hit = false;
+    {
+        SlotStreamScope scope(s);
+        hit = emit_checked(env, s.job.target, next, piece, s.job.stream, &s.out);
+        if (s.job.stream) segment_essay(env, s.job.target, s.out, false);
+    }
+    s.job.gen.push_back(next);
+    s.pending = next;
+    if (hit) {
+        note_finish(FinishReason::StopString, s.job.gen.size(), (size_t)s.max_new);
+        return false;
+    }
+    if ((int32_t)s.job.gen.size() < s.max_new) return true;
+    note_finish(FinishReason::Limit, s.job.gen.size(), (size_t)s.max_new);
+    return false;
+}
+
+// first：引擎刚取出的 Generate 请求。单独都放不下 KV 时返回 false，由调用方走 run_generate（可平移上下文）。
+// 返回 true 时 first 及之后接纳的请求都已收尾/重新排队
+static bool run_batch(JNIEnv* env, Job& first) {
+    std::unique_lock<std::mutex> lk(g_mutex);
+    if (!g_ctx || !g_model || !g_vocab) return false;
+    rebuild_context_if_needed();
+    if (!g_ctx) return false;
+
+    const size_t n_ctx = llama_n_ctx(g_ctx);
+    const size_t kv_total = n_ctx > g_session_tokens.size() + (size_t)kGenReserve
+                          ? n_ctx - g_session_tokens.size() - (size_t)kGenReserve : 0;
+    std::vector<BatchSlot> slots((size_t)g_parallel);
+    for (size_t i = 0; i < slots.size(); ++i) slots[i].seq = (llama_seq_id)(i + 1);
+    size_t kv_used = 0;
+
+    begin_request(0);   // 截止时间按序列各自检查，abort 回调只看 stop
+    if (!slot_admit(slots[0], first, kv_total, slots)) return false;
+    kv_used += slots[0].kv_reserved;
+    {
+        std::lock_guard<std::mutex> ek(g_engine.mu);
+        g_engine.running_id = 0;
+        g_engine.batch_ids.push_back(slots[0].job.id);
+    }
+
+    int32_t chunk = (int32_t)llama_n_batch(g_ctx);
+    if (g_prefill_chunk > 0) chunk = std::min(chunk, g_prefill_chunk);
+    BatchBuf& b = g_arena.batch;
+    b.ensure((int32_t)llama_n_batch(g_ctx));
+    std::vector<int64_t> cancels;
+    std::vector<Job> admit, done_jobs;
+    cancels.reserve(8);
+    const int64_t t_run = now_us();
+    uint64_t steps = 0, gen_tokens = 0, slot_steps = 0, pre_tokens = 0, forks = 0, fork_tokens = 0;
+    int32_t active_max = 0;
+    bool admit_blocked = false;   // KV 预算不够接纳队首请求，等有序列结束再试
+
+    for (;;) {
+        // ---- 控制面：取消、让位、接纳（只在这里拿队列锁）----
+        bool preempt = false;
+        {
+            std::lock_guard<std::mutex> ek(g_engine.mu);
+            cancels.swap(g_engine.batch_cancel);
+            // 只为交互 chat 让位；交互优先级的作文直接接纳进本批
+            if (g_engine_interactive.load(std::memory_order_relaxed) > 0) {
+                for (const auto& j : g_engine.queue) {
+                    if (!j.cancelled && j.priority == 0 && j.kind == JobKind::Chat) { preempt = true; break; }
+                }
+            }
+            size_t free_slots = 0;
+            for (auto& s : slots) if (!s.active) ++free_slots;
+            while (!preempt && !g_stop.load(std::memory_order_relaxed) && !g_engine.queue.empty()) {
+                auto it = best_job_locked();
+                if (!it->cancelled && (admit_blocked || it->kind != JobKind::Generate || it->grammar ||
+                                       free_slots == admit.size())) break;
+                note_queue_wait(*it);
+                (it->cancelled ? done_jobs : admit).push_back(std::move(*it));
+                g_engine.queue.erase(it);
+            }
+            update_interactive_locked();
+        }
+        for (auto& j : done_jobs) { finish_job(env, j, &j.partial); env->DeleteGlobalRef(j.target); }
+        done_jobs.clear();
+        for (auto& j : admit) {
+            bool ok = false;
+            if (!admit_blocked) {
+                for (auto& s : slots) {
+                    if (s.active) continue;
+                    ok = slot_admit(s, j, kv_total > kv_used ? kv_total - kv_used : 0, slots);
+                    if (ok) {
+                        kv_used += s.kv_reserved;
+                        std::lock_guard<std::mutex> ek(g_engine.mu);
+                        g_engine.batch_ids.push_back(s.job.id);
+                    }
+                    break;
+                }
+            }
+            if (!ok) {
+                // KV 不够：放回队列，等有序列结束再接纳
+                admit_blocked = true;
+                std::lock_guard<std::mutex> ek(g_engine.mu);
+                g_engine.queue.push_back(std::move(j));
+            }
+        }
+        admit.clear();
+
+        const bool stopping = g_stop.load(std::memory_order_relaxed);
+        const int64_t now = now_us();
+        for (auto& s : slots) {
+            if (!s.active) continue;
+            const bool cancelled = std::find(cancels.begin(), cancels.end(), s.job.id) != cancels.end();
+            const bool expired   = s.job.deadline_us > 0 && now > s.job.deadline_us;
+            if (stopping || cancelled || expired) {
+                if (expired && !stopping && !cancelled) {
+                    std::lock_guard<std::mutex> pk(g_perf_mutex);
+                    g_perf.deadline_hits++;
+                }
+                kv_used -= std::min(kv_used, s.kv_reserved);
+                admit_blocked = false;
+                slot_finish(env, s);
+            } else if (preempt) {
+                kv_used -= std::min(kv_used, s.kv_reserved);
+                admit_blocked = false;
+                slot_suspend(env, s);
+            }
+        }
+        cancels.clear();
+
+        // ---- 分叉：源序列已把共同前缀写进 KV 的，直接复制过来 ----
+        for (auto& s : slots) {
+            if (!s.active || s.fork_from < 0) continue;
+            const BatchSlot& d = slots[(size_t)s.fork_from];
+            if (!d.active || d.job.id != s.fork_job) { s.fork_from = -1; continue; }   // 源已结束：自己 prefill
+            if (d.fed < s.fork_len) continue;
+            llama_memory_seq_cp(llama_get_memory(g_ctx), d.seq, s.seq, 0, (llama_pos)s.fork_len);
+            s.fed = s.fork_len;
+            s.pos = (int32_t)s.fork_len;
+            s.fork_from = -1;
+            ++forks;
+            fork_tokens += s.fork_len;
+        }
+
+        // ---- 拼 batch：先放生成中序列的下一个 token，剩余容量给 prefill ----
+        int32_t n = 0, n_gen = 0;
+        const int32_t cap = (int32_t)llama_n_batch(g_ctx);
+        for (auto& s : slots) {
+            s.i_batch = -1;
+            if (!s.active || s.pending == LLAMA_TOKEN_NULL) continue;
+            b.token[n] = s.pending; b.pos[n] = s.pos; b.seq_id_store[n] = s.seq; b.logits[n] = 1;
+            s.i_batch = n++;
+            ++n_gen;
+        }
+        for (auto& s : slots) {
+            s.n_fill = 0;
+            if (!s.active || s.fork_from >= 0 || s.fed >= s.ptok.size() || n >= cap) continue;
+            // 第一块截在要求段末尾，decode 后整段存进前缀缓存
+            size_t end = s.ptok.size();
+            if (s.fed < s.head_len) end = s.head_len;
+            int32_t m = (int32_t)std::min<size_t>(end - s.fed, (size_t)std::min(chunk, cap - n));
+            for (int32_t i = 0; i < m; ++i) {
+                b.token[n + i] = s.ptok[s.fed + i]; b.pos[n + i] = s.pos + i;
+                b.seq_id_store[n + i] = s.seq; b.logits[n + i] = 0;
+            }
+            if (s.fed + (size_t)m == s.ptok.size()) { b.logits[n + m - 1] = 1; s.i_batch = n + m - 1; }
+            s.n_fill = m;
+            n += m;
+        }
+        int32_t n_active = 0;
+        for (auto& s : slots) if (s.active) ++n_active;
+        if (n == 0) {
+            if (n_active == 0) break;
+            continue;
+        }
+
+        const int32_t rc = llama_decode(g_ctx, b.as_batch(n));
+        if (rc != 0) {
+            // abort（stop）或 KV 放不下：本批所有序列按已生成的内容收尾
+            if (rc == 2) { std::lock_guard<std::mutex> pk(g_perf_mutex); g_perf.aborts++; }
+            else { LOGW("batch decode failed rc=%d (%d tokens, %d seqs)", rc, n, n_active); note_decode_result(rc); }
+            for (auto& s : slots) if (s.active) slot_finish(env, s);
+            kv_used = 0;
+            break;
+        }
+        ++steps;
+        slot_steps += (uint64_t)n_active;
+        active_max = std::max(active_max, n_active);
+        pre_tokens += (uint64_t)(n - n_gen);
+
+        // ---- 推进各序列并采样 ----
+        for (auto& s : slots) {
+            if (!s.active) continue;
+            if (s.pending != LLAMA_TOKEN_NULL) { s.pos++; s.pending = LLAMA_TOKEN_NULL; }
+            if (s.n_fill > 0) {
+                const bool at_head = s.fed < s.head_len && s.fed + (size_t)s.n_fill == s.head_len;
+                s.fed += (size_t)s.n_fill;
+                s.pos += s.n_fill;
+                if (at_head) g_prefix_cache.store(g_ctx, s.seq, s.ptok.data(), s.head_len);
+                env->CallVoidMethod(s.job.target, g_jni.on_progress, (jlong)s.job.id,
+                                    (jint)s.fed, (jint)s.ptok.size());
+                jni_clear_exception(env);
+            }
+            if (s.i_batch < 0) continue;
+            slot_sync_sampler(s, false);
+            llama_token next = sample_next_token(g_ctx, s.smpl.get(), s.i_batch);
+            if (next == LLAMA_TOKEN_NULL) {
+                const float* logits = llama_get_logits_ith(g_ctx, s.i_batch);
+                if (logits) next = greedy_argmax(logits, vocab_size(g_vocab));
+            }
+            if (next != LLAMA_TOKEN_NULL) ++gen_tokens;
+            if (!slot_accept_token(env, s, next)) {
+                kv_used -= std::min(kv_used, s.kv_reserved);
+                admit_blocked = false;
+                slot_finish(env, s);
+            }
+        }
+    }
+
+    // 其他路径默认 seq 0
+    for (int32_t i = 0; i < (int32_t)b.seq_id_store.size(); ++i) b.seq_id_store[i] = 0;
+    end_request(false);
+    publish_prefix_stats();
+
+    const double secs = (now_us() - t_run) / 1e6;
+    std::lock_guard<std::mutex> pk(g_perf_mutex);
+    g_perf.batch_runs++;
+    g_perf.batch_steps      += steps;
+    g_perf.batch_slot_steps += slot_steps;
+    g_perf.batch_tokens     += gen_tokens;
+    g_perf.batch_prefill_tokens += pre_tokens;
+    g_perf.batch_active_max  = std::max(g_perf.batch_active_max, (uint64_t)active_max);
+    g_perf.batch_tps_last    = secs > 0 ? gen_tokens / secs : 0;
+    g_perf.batch_forks       += forks;
+    g_perf.batch_fork_tokens += fork_tokens;
+    return true;
+}
+
+static void engine_main() {
+    JNIEnv* env = nullptr;
+    JavaVMAttachArgs args{JNI_VERSION_1_6, "llm-engine", nullptr};
+    if (g_jni.vm->AttachCurrentThread(&env, &args) != JNI_OK) {
+        LOGE("engine: AttachCurrentThread failed");
+        std::lock_guard<std::mutex> lk(g_engine.mu);
+        g_engine.quit = true;   // 没有生成线程可等，drain_jobs 直接返回
+        g_engine.idle_cv.notify_all();
+        return;
+    }
+    for (;;) {
+        Job job;
+        sampling_quiesce();
+        {
+            std::unique_lock<std::mutex> lk(g_engine.mu);
+            g_engine.busy = false;
+            g_engine.idle_cv.notify_all();
+            g_engine.cv.wait(lk, [] { return g_engine.quit || !g_engine.queue.empty(); });
+            if (g_engine.quit) {
+                g_engine.idle_cv.notify_all();   // drain_jobs 的谓词含 quit，退出前叫醒等待者
+                break;
+            }
+            job = pick_job_locked();
+            g_engine.busy = true;
+        }
+        if (job.cancelled) {
+            finish_job(env, job, &job.partial);
+        } else if (job.kind == JobKind::Chat) {
+            run_chat(env, job);
+            finish_job(env, job, nullptr);
+        } else {
+            // 启用了并行时走连续批处理（接纳后续排队的作文，负责全部收尾）；单独放不下 KV 才走 run_generate
+            if (g_parallel > 1 && !job.grammar && run_batch(env, job)) continue;
+            // run_generate 返回的是 g_arena.out 的拷贝，回调期间不持有 g_mutex
+            std::string text = run_generate(env, job);
+            if (job.suspended) {
+                std::lock_guard<std::mutex> lk(g_engine.mu);
+                // 让位期间来的 stop/cancel 落在 g_stop 上，这里转成取消
+                if (g_stop.load(std::memory_order_relaxed)) job.cancelled = true;
+                g_engine.running_id = 0;
+                g_engine.queue.push_back(std::move(job));
+                update_interactive_locked();
+                std::lock_guard<std::mutex> pk(g_perf_mutex);
+                g_perf.preemptions++;
+                continue;
+            }
+            finish_job(env, job, &text);
+        }
+        {
+            std::lock_guard<std::mutex> lk(g_engine.mu);
+            g_engine.running_id = 0;
+        }
+        env->DeleteGlobalRef(job.target);
+    }
+    g_jni.vm->DetachCurrentThread();
+}
+
+static void note_ingest(int64_t t0_us, size_t bytes) {
+    std::lock_guard<std::mutex> lk(g_perf_mutex);
+    g_perf.ingest_us_last    = (double)(now_us() - t0_us);
+    g_perf.ingest_bytes_last = bytes;
+}
+
+static jlong submit_job(JNIEnv* env, jobject thiz, Job&& job, int32_t timeout_ms) {
+    job.target    = env->NewGlobalRef(thiz);
+    job.submit_us = now_us();
+    job.deadline_us = timeout_ms > 0 ? job.submit_us + (int64_t)timeout_ms * 1000 : 0;
+    std::lock_guard<std::mutex> lk(g_engine.mu);
+    job.id = g_engine.next_id++;
+    const jlong id = (jlong)job.id;
+    g_engine.queue.push_back(std::move(job));
+    update_interactive_locked();
+    g_engine.cv.notify_one();
+    return id;
+}
+
+// 语法在提交时编译：解析失败（或模型未加载）不入队，返回 kSubmitGrammarError 由 Java 侧拒绝请求
+static constexpr jlong kSubmitGrammarError = -1;
+static bool compile_job_grammar(JNIEnv* env, jstring grammar_, Job& job) {
+    const std::string gbnf = jstring_to_string(env, grammar_);
+    if (gbnf.empty()) return true;
+    job.grammar = grammar_compile(gbnf);
+    return job.grammar != nullptr;
+}
+
+// stop：排队中的任务全部标记取消，正在跑的由 g_stop 打断
+static void cancel_all_jobs() {
+    std::lock_guard<std::mutex> lk(g_engine.mu);
+    for (auto& j : g_engine.queue) j.cancelled = true;
+    update_interactive_locked();
+    stop_running_locked();
+    g_engine.cv.notify_one();
+}
+
+// free：取消全部任务并等生成线程把它们逐个收尾（onNativeDone / onNativeResult 带已生成部分），
+// Java 侧挂着的 PluginCall 都能结束；生成线程没起来（JNI_OnLoad 失败）时不等
+static void drain_jobs() {
+    cancel_all_jobs();
+    std::unique_lock<std::mutex> lk(g_engine.mu);
+    if (!g_engine.th.joinable()) return;
+    g_engine.idle_cv.wait(lk, [] { return g_engine.quit || (!g_engine.busy && g_engine.queue.empty()); });
+}
+
+// 按 id 取消：排队中的标记取消（下次取任务时优先收尾），正在跑的打断；不存在返回 false
+static bool cancel_job(int64_t id) {
+    std::lock_guard<std::mutex> lk(g_engine.mu);
+    bool found = false;
+    const auto& ids = g_engine.batch_ids;
+    if (std::find(ids.begin(), ids.end(), id) != ids.end()) {
+        // 批处理中的序列：下一步由批处理循环收尾，不打断同批其他请求
+        g_engine.batch_cancel.push_back(id);
+        found = true;
+    } else if (g_engine.running_id == id) {
+        stop_running_locked();
+        found = true;
+    } else {
+        for (auto& j : g_engine.queue) {
+            if (j.id == id && !j.cancelled) { j.cancelled = true; found = true; break; }
+        }
+        update_interactive_locked();
+        g_engine.cv.notify_one();
+    }
+    if (found) {
+        std::lock_guard<std::mutex> pk(g_perf_mutex);
+        g_perf.cancelled_by_id++;
+    }
+    return found;
+}
+
+static int32_t clamp_priority(jint p) { return p <= 0 ? 0 : 1; }
+
+// 用户停止串在提交线程上建好自动机，生成线程只管匹配
+static void build_stop_strings(JNIEnv* env, jobjectArray stop_, StopMatcher& m) {
+    if (!stop_) return;
+    const auto stops = jstring_array_to_vec(env, stop_);
+    const size_t n = m.build(stops);
+    if (n < stops.size()) LOGW("stop strings: %zu of %zu used (empty/too long/too many)", n, stops.size());
+}
+
+// ===== JNI: chat 流式（异步提交）=====
+static jlong JNICALL
+Java_com_kingsun_plugins_llm_LlamaNative_nativeSubmitChat(JNIEnv* env, jobject thiz,
+                                                         jobjectArray roles_, jobjectArray contents_, jint maxNew_,
+                                                         jint timeoutMs, jint priority, jstring grammar_,
+                                                         jobjectArray stop_, jint thinkMode, jint thinkBudget) {
+    const int64_t t0 = now_us();
+    auto roles    = jstring_array_to_vec(env, roles_);
+    auto contents = jstring_array_to_vec(env, contents_);
+    Job job;
+    job.kind = JobKind::Chat;
+    job.max_new = maxNew_ > 0 ? maxNew_ : 512;
+    job.msgs.reserve(roles.size());
+    size_t bytes = 0;
+    for (size_t i = 0; i < roles.size() && i < contents.size(); ++i) {
+        bytes += roles[i].size() + contents[i].size();
+        job.msgs.push_back({std::move(roles[i]), std::move(contents[i])});
+    }
+    note_ingest(t0, bytes);
+    job.priority = clamp_priority(priority);
+    if (!compile_job_grammar(env, grammar_, job)) return kSubmitGrammarError;
+    build_stop_strings(env, stop_, job.stop);
+    job.think        = (thinkMode >= kThinkInline && thinkMode <= kThinkHidden) ? thinkMode : kThinkInline;
+    job.think_budget = std::max<jint>(0, thinkBudget);
+    return submit_job(env, thiz, std::move(job), timeoutMs);
+}
+
+// ===== JNI: 一次性生成（异步提交）=====
+static jlong JNICALL
+Java_com_kingsun_plugins_llm_LlamaNative_nativeSubmitGenerate(JNIEnv* env, jobject thiz,
+                                                             jstring prompt_, jint maxNew_, jint timeoutMs,
+                                                             jboolean stream, jint priority, jboolean greedy,
+                                                             jstring grammar_, jobjectArray stop_) {
+    Job job;
+    job.kind       = JobKind::Generate;
+    const int64_t t0 = now_us();
+    job.prompt     = jstring_to_string(env, prompt_);
+    note_ingest(t0, job.prompt.size());
+    job.max_new    = maxNew_;
+    job.stream     = stream == JNI_TRUE;
+    job.greedy     = greedy == JNI_TRUE;
+    if (!compile_job_grammar(env, grammar_, job)) return kSubmitGrammarError;
+    build_stop_strings(env, stop_, job.stop);
+    job.priority   = clamp_priority(priority);
+    return submit_job(env, thiz, std::move(job), timeoutMs);
+}
+
+// ===== JNI: 批量作文（异步提交）=====
+// 一把锁内连续入队、优先级与截止时间相同，批处理循环同一步接纳，共同的要求段只 prefill 一次。
+// 各条照常回调 onNativeResult / 流式事件，返回各自的请求 id
+static jlongArray JNICALL
+Java_com_kingsun_plugins_llm_LlamaNative_nativeSubmitEssays(JNIEnv* env, jobject thiz,
+                                                           jobjectArray prompts_, jintArray maxNew_,
+                                                           jint timeoutMs, jboolean stream, jint priority,
+                                                           jobjectArray stop_) {
+    const int64_t t0 = now_us();
+    auto prompts = jstring_array_to_vec(env, prompts_);
+    StopMatcher stop;   // 各条共用同一组停止串，每条拷一份（各自的匹配状态）
+    build_stop_strings(env, stop_, stop);
+    std::vector<jint> max_new(prompts.size(), 0);
+    if (maxNew_) {
+        const jsize n = std::min<jsize>(env->GetArrayLength(maxNew_), (jsize)max_new.size());
+        env->GetIntArrayRegion(maxNew_, 0, n, max_new.data());
+    }
+    size_t bytes = 0;
+    for (const auto& p : prompts) bytes += p.size();
+    note_ingest(t0, bytes);
+
+    std::vector<jlong> ids(prompts.size(), 0);
+    const int64_t submit_us = now_us();
+    {
+        std::lock_guard<std::mutex> lk(g_engine.mu);
+        for (size_t i = 0; i < prompts.size(); ++i) {
+            Job job;
+            job.kind      = JobKind::Generate;
+            job.prompt    = std::move(prompts[i]);
+            job.max_new   = max_new[i];
+            job.stream    = stream == JNI_TRUE;
+            job.stop      = stop;
+            job.priority  = clamp_priority(priority);
+            job.target    = env->NewGlobalRef(thiz);
+            job.submit_us = submit_us;
+            job.deadline_us = timeoutMs > 0 ? submit_us + (int64_t)timeoutMs * 1000 : 0;
+            job.id = g_engine.next_id++;
+            ids[i] = (jlong)job.id;
+            g_engine.queue.push_back(std::move(job));
+        }
+        update_interactive_locked();
+        g_engine.cv.notify_one();
+    }
+    jlongArray out = env->NewLongArray((jsize)ids.size());
+    if (out) env->SetLongArrayRegion(out, 0, (jsize)ids.size(), ids.data());
+    return out;
 }
 
 // ===== （可选）构造作文 Prompt =====
-extern "C" JNIEXPORT jstring JNICALL
+static jstring JNICALL
 Java_com_kingsun_plugins_llm_LlamaNative_nativeBuildEssayPrompt(JNIEnv* env, jclass,
                                                               jstring jTitle, jint jWordLimit,
                                                               jstring jLang, jobjectArray jHiErr,
                                                               jobjectArray jHiFreq) {
-    const char* ctitle = env->GetStringUTFChars(jTitle, nullptr);
-    const char* clang  = env->GetStringUTFChars(jLang,  nullptr);
-    std::string title = ctitle ? ctitle : "";
-    std::string lang  = clang  ? clang  : "English";
-    env->ReleaseStringUTFChars(jTitle, ctitle);
-    env->ReleaseStringUTFChars(jLang,  clang);
-
-    auto to_vec = [&](jobjectArray arr)->std::vector<std::string>{
-        std::vector<std::string> v;
-        if (!arr) return v;
-        jsize n = env->GetArrayLength(arr);
-        v.reserve(std::max<jsize>(n, 0));
-        for (jsize i = 0; i < n; ++i) {
-            jstring s = (jstring)env->GetObjectArrayElement(arr, i);
-            const char* cs = env->GetStringUTFChars(s, nullptr);
-            v.emplace_back(cs ? cs : "");
-            env->ReleaseStringUTFChars(s, cs);
-            env->DeleteLocalRef(s);
-        }
-        return v;
-    };
-    auto hi_err  = to_vec(jHiErr);
-    auto hi_freq = to_vec(jHiFreq);
+    std::string title = jstring_to_string(env, jTitle);
+    std::string lang  = jLang ? jstring_to_string(env, jLang) : "English";
+
+    auto hi_err  = jstring_array_to_vec(env, jHiErr);
+    auto hi_freq = jstring_array_to_vec(env, jHiFreq);
 
     std::string prompt = build_essay_prompt(title, (int)jWordLimit, lang, hi_err, hi_freq);
-    return env->NewStringUTF(prompt.c_str());
+    return new_jstring_utf16(env, prompt);
+}
+
+// ===== JNI: prefill 块大小（0 = 跟随 n_batch）=====
+static void JNICALL
+Java_com_kingsun_plugins_llm_LlamaNative_nativeSetPrefillChunk(JNIEnv*, jclass, jint chunk) {
+    std::lock_guard<std::mutex> lk(g_mutex);
+    g_prefill_chunk = std::max(0, (int)chunk);
+}
+
+// ===== JNI: 会话落盘/恢复 =====
+static jboolean JNICALL
+Java_com_kingsun_plugins_llm_LlamaNative_nativeSaveSession(JNIEnv* env, jclass, jstring path_,
+                                                         jstring modelSha256_, jboolean compress) {
+    std::lock_guard<std::mutex> lk(g_mutex);
+    if (!g_ctx || g_session_tokens.empty()) return JNI_FALSE;
+    uint8_t sha[32];
+    if (!parse_sha256_hex(jstring_to_string(env, modelSha256_), sha)) { LOGE("save session: bad sha256"); return JNI_FALSE; }
+
+    const int64_t t0 = now_us();
+    bool ok = save_session_file(jstring_to_string(env, path_), sha, compress == JNI_TRUE);
+    std::lock_guard<std::mutex> plk(g_perf_mutex);
+    g_perf.session_save_ms = (now_us() - t0) / 1000.0;
+    LOGI("save session: tokens=%d ok=%d %.1fms", (int)g_session_tokens.size(), ok ? 1 : 0, g_perf.session_save_ms);
+    return ok ? JNI_TRUE : JNI_FALSE;
+}
+
+static jint JNICALL
+Java_com_kingsun_plugins_llm_LlamaNative_nativeLoadSession(JNIEnv* env, jclass, jstring path_,
+                                                         jstring modelSha256_) {
+    std::lock_guard<std::mutex> lk(g_mutex);
+    if (!g_ctx) return -1;
+    rebuild_context_if_needed();
+    if (!g_ctx) return -1;
+    uint8_t sha[32];
+    if (!parse_sha256_hex(jstring_to_string(env, modelSha256_), sha)) { LOGE("load session: bad sha256"); return -1; }
+
+    const int64_t t0 = now_us();
+    int32_t n = load_session_file(jstring_to_string(env, path_), sha);
+    std::lock_guard<std::mutex> plk(g_perf_mutex);
+    g_perf.session_load_ms = (now_us() - t0) / 1000.0;
+    LOGI("load session: tokens=%d %.1fms", n, g_perf.session_load_ms);
+    return n;
+}
+
+// ===== JNI: 性能统计 =====
+static jstring JNICALL
+Java_com_kingsun_plugins_llm_LlamaNative_nativeGetPerfStats(JNIEnv* env, jclass) {
+    PerfStats p;
+    {
+        std::lock_guard<std::mutex> lk(g_perf_mutex);
+        p = g_perf;
+    }
+    size_t queue_depth = 0;
+    {
+        std::lock_guard<std::mutex> lk(g_engine.mu);
+        queue_depth = g_engine.queue.size();
+    }
+    std::string out = "{";
+    auto put = [&](const char* k, double v) {
+        char buf[96];
+        snprintf(buf, sizeof(buf), "%s\"%s\":%.3f", out.size() > 1 ? "," : "", k, v);
+        out += buf;
+    };
+    put("requests",           (double)p.requests);
+    put("ctxAllocs",          (double)p.ctx_allocs);
+    put("ctxFrees",           (double)p.ctx_frees);
+    put("memClears",          (double)p.mem_clears);
+    put("standbySwaps",       (double)p.standby_swaps);
+    put("ctxAllocMs",         p.ctx_alloc_ms);
+    put("setupMsLast",        p.setup_ms_last);
+    put("setupMsAvg",         p.requests ? p.setup_ms_total / (double)p.requests : 0.0);
+    put("prefixHits",         (double)p.prefix.hits);
+    put("prefixMisses",       (double)p.prefix.misses);
+    put("prefixTokensReused", (double)p.prefix.tokens_reused);
+    put("prefixEvictions",    (double)p.prefix.evictions);
+    put("prefixBytes",        (double)p.prefix.bytes);
+    put("prefixEntries",      (double)p.prefix.entries);
+    put("prefillTokens",      (double)p.prefill_tokens);
+    put("prefillMs",          p.prefill_ms);
+    put("prefillTpsLast",     p.prefill_tps_last);
+    put("prefillTpsAvg",      p.prefill_ms > 0 ? p.prefill_tokens * 1000.0 / p.prefill_ms : 0.0);
+    put("prefillChunkLast",   (double)p.prefill_chunk_last);
+    put("peakRssKb",          (double)p.peak_rss_kb);
+    put("ingestUsLast",       p.ingest_us_last);
+    put("ingestBytesLast",    (double)p.ingest_bytes_last);
+    put("tokenizeMsLast",     p.tokenize_ms_last);
+    put("promptTokensLast",   (double)p.prompt_tokens_last);
+    put("pieceTableMs",       p.piece_table_ms);
+    put("pieceTableKb",       p.piece_table_kb);
+    put("detokNsLegacy",      p.detok_ns_legacy);
+    put("detokNsTable",       p.detok_ns_table);
+    put("stopLatencyMsLast",    p.stop_latency_ms_last);
+    put("stopLatencyMsPrefill", p.stop_latency_ms_prefill);
+    put("stopLatencyMsDecode",  p.stop_latency_ms_decode);
+    put("steadyTokens",       (double)p.steady_tokens);
+    put("steadyAllocsPerToken", p.steady_tokens ? (double)p.steady_allocs / (double)p.steady_tokens : 0.0);
+#ifdef LLM_ALLOC_AUDIT
+    put("allocAudit",         1);
+#endif
+    put("streamFlushes",      (double)p.stream_flushes);
+    put("streamTokens",       (double)p.stream_tokens);
+    put("streamTokensPerFlush", p.stream_flushes ? (double)p.stream_tokens / (double)p.stream_flushes : 0.0);
+    put("streamHoldMsAvg",    p.stream_tokens ? p.stream_hold_ms_total / (double)p.stream_tokens : 0.0);
+    put("streamHoldMsMaxLast", p.stream_hold_ms_max_last);
+    put("streamFlushPerSecLast", p.stream_flush_per_sec_last);
+    put("ringRecords",        (double)p.ring_records);
+    put("ringStalls",         (double)p.ring_stalls);
+    put("ringStallMs",        p.ring_stall_ms);
+    put("ringHighWater",      (double)p.ring_high_water);
+    put("essayFirstSentenceMsLast", p.essay_first_sentence_ms_last);
+    put("essayTotalMsLast",   p.essay_total_ms_last);
+    put("essaySentencesLast", (double)p.essay_sentences_last);
+    put("queueDepth",         (double)queue_depth);
+    put("queueWaitMsLast",    p.queue_wait_ms_last);
+    put("queueWaitMsAvg",     p.queue_started ? p.queue_wait_ms_total / (double)p.queue_started : 0.0);
+    put("queueWaitMsMax",     p.queue_wait_ms_max);
+    put("queueExpired",       (double)p.queue_expired);
+    put("preemptions",        (double)p.preemptions);
+    put("cancelledById",      (double)p.cancelled_by_id);
+    put("parallel",           (double)g_parallel);
+    put("batchRuns",          (double)p.batch_runs);
+    put("batchSteps",         (double)p.batch_steps);
+    put("batchSeqsPerStep",   p.batch_steps ? (double)p.batch_slot_steps / (double)p.batch_steps : 0.0);
+    put("batchSeqsMax",       (double)p.batch_active_max);
+    put("batchTokens",        (double)p.batch_tokens);
+    put("batchPrefillTokens", (double)p.batch_prefill_tokens);
+    put("batchTokPerSecLast", p.batch_tps_last);
+    put("batchForks",         (double)p.batch_forks);
+    put("batchForkTokens",    (double)p.batch_fork_tokens);
+    put("generateTokPerSecLast", p.generate_tps_last);
+    put("setSamplingUsLast",  p.set_sampling_us_last);
+    put("setSamplingUsMax",   p.set_sampling_us_max);
+    put("samplingSwaps",      (double)p.sampling_swaps);
+    put("sampleUsPerToken",   p.sample_calls ? p.sample_us_total / p.sample_calls : 0);
+    put("grammarCompiles",    (double)p.grammar_compiles);
+    put("grammarCompileHits", (double)p.grammar_compile_hits);
+    put("grammarErrors",      (double)p.grammar_errors);
+    put("grammarTokens",      (double)p.grammar_tokens);
+    put("grammarFastAccepts", (double)p.grammar_fast);
+    put("grammarScans",       (double)p.grammar_scans);
+    put("grammarFastUsAvg",   p.grammar_fast ? p.grammar_fast_us / p.grammar_fast : 0);
+    put("grammarScanUsAvg",   p.grammar_scans ? p.grammar_scan_us / p.grammar_scans : 0);
+    put("grammarUsPerToken",  p.grammar_tokens ? p.grammar_us_total / p.grammar_tokens : 0);
+    put("finishByEog",        (double)p.finish_eog);
+    put("finishByStopString", (double)p.finish_stop_string);
+    put("finishByLimit",      (double)p.finish_limit);
+    const uint64_t n_finished = p.finish_eog + p.finish_stop_string + p.finish_limit;
+    put("tokensPerReplyAvg",  n_finished ? (double)p.finish_tokens / n_finished : 0);
+    put("stopHeldBytesMax",   (double)p.stop_held_max);
+    put("chatTokensLast",     (double)p.chat_tokens_last);
+    put("chatDecodeMsLast",   p.chat_decode_ms_last);
+    put("thinkTokensLast",    (double)p.think_tokens_last);
+    put("thinkTokensTotal",   (double)p.think_tokens_total);
+    put("thinkBudgetHits",    (double)p.think_budget_hits);
+    put("samplerSetupUsLast", p.sampler_setup_us_last);
+    put("samplerSetupUsAvg",  p.sampler_setups ? p.sampler_setup_us_total / p.sampler_setups : 0);
+    put("samplerCacheHits",   (double)p.sampler_cache_hits);
+    put("samplerCacheMisses", (double)p.sampler_cache_misses);
+    put("aborts",             (double)p.aborts);
+    put("deadlineHits",       (double)p.deadline_hits);
+    put("sessionSaveMs",      p.session_save_ms);
+    put("sessionLoadMs",      p.session_load_ms);
+    put("sessionFileBytes",   (double)p.session_file_bytes);
+    out += "}";
+    return env->NewStringUTF(out.c_str());
+}
+
+// ===== JNI: 流式合并策略 =====
+static void JNICALL
+Java_com_kingsun_plugins_llm_LlamaNative_nativeSetStreamPolicy(JNIEnv*, jclass, jint flushMs, jint flushChars, jint boundary) {
+    g_stream_flush_ms.store(std::max(0, (int)flushMs), std::memory_order_relaxed);
+    g_stream_flush_chars.store(std::max(0, (int)flushChars), std::memory_order_relaxed);
+    g_stream_boundary.store(std::clamp((int)boundary, (int)kBoundaryNone, (int)kBoundarySentence), std::memory_order_relaxed);
+}
+
+// ===== JNI: 零拷贝 token 环 =====
+// buffer：direct ByteBuffer，容量 = 128 + 2 的幂（>= 4KB）；传 null 断开（之后退回 onNativeToken 回调）
+static jboolean JNICALL
+Java_com_kingsun_plugins_llm_LlamaNative_nativeRingAttach(JNIEnv* env, jclass, jobject buffer) {
+    std::lock_guard<std::mutex> lk(g_ring.mu);
+    if (g_ring.ref) env->DeleteGlobalRef(g_ring.ref);
+    g_ring.ref = nullptr; g_ring.base = nullptr; g_ring.cap = 0;
+    g_ring.cv.notify_all();
+    if (!buffer) return JNI_TRUE;
+
+    auto* base = static_cast<uint8_t*>(env->GetDirectBufferAddress(buffer));
+    const jlong size = env->GetDirectBufferCapacity(buffer);
+    const uint64_t cap = size > (jlong)kRingHeader ? (uint64_t)(size - kRingHeader) : 0;
+    if (!base || cap < 4096 || (cap & (cap - 1)) != 0 || ((uintptr_t)base & 7) != 0) {
+        LOGE("ring attach: need direct buffer of 128 + 2^n (>= 4096) bytes");
+        return JNI_FALSE;
+    }
+    memset(base, 0, kRingHeader);
+    g_ring.ref  = env->NewGlobalRef(buffer);
+    g_ring.base = base;
+    g_ring.cap  = cap;
+    return JNI_TRUE;
+}
+
+// 消费者：回写已读位置（腾出空间），再等新数据最多 timeoutMs，返回当前发布位置
+static jlong JNICALL
+Java_com_kingsun_plugins_llm_LlamaNative_nativeRingAwait(JNIEnv*, jclass, jlong consumed, jint timeoutMs) {
+    std::unique_lock<std::mutex> lk(g_ring.mu);
+    if (!g_ring.attached()) return consumed;
+    const uint64_t tail = (uint64_t)consumed;
+    if (tail <= g_ring.head() && tail >= g_ring.tail()) {
+        g_ring.set_tail(tail);
+        g_ring.cv.notify_all();
+    }
+    g_ring.cv.wait_for(lk, std::chrono::milliseconds(std::max(0, (int)timeoutMs)),
+                       [&] { return !g_ring.attached() || g_ring.head() != tail; });
+    return g_ring.attached() ? (jlong)g_ring.head() : consumed;
+}
+
+// ===== JNI_OnLoad：注册 native、缓存回调句柄、启动生成线程 =====
+#define LLM_NATIVE(name, sig) { #name, sig, reinterpret_cast<void*>(Java_com_kingsun_plugins_llm_LlamaNative_##name) }
+static const JNINativeMethod kNativeMethods[] = {
+    LLM_NATIVE(nativeInit,             "(Ljava/lang/String;IIIZII)Z"),
+    LLM_NATIVE(nativeSetPrefillChunk,  "(I)V"),
+    LLM_NATIVE(nativeFree,             "()V"),
+    LLM_NATIVE(nativeStop,             "()V"),
+    LLM_NATIVE(nativeCancel,           "(J)Z"),
+    LLM_NATIVE(nativeSaveSession,      "(Ljava/lang/String;Ljava/lang/String;Z)Z"),
+    LLM_NATIVE(nativeLoadSession,      "(Ljava/lang/String;Ljava/lang/String;)I"),
+    LLM_NATIVE(nativeGetPerfStats,     "()Ljava/lang/String;"),
+    LLM_NATIVE(nativeSetSampling,      "(FFIFIF)V"),
+    LLM_NATIVE(nativeSetStreamPolicy,  "(III)V"),
+    LLM_NATIVE(nativeRingAttach,       "(Ljava/nio/ByteBuffer;)Z"),
+    LLM_NATIVE(nativeRingAwait,        "(JI)J"),
+    LLM_NATIVE(nativeBuildEssayPrompt, "(Ljava/lang/String;ILjava/lang/String;[Ljava/lang/String;[Ljava/lang/String;)Ljava/lang/String;"),
+    LLM_NATIVE(nativeSubmitChat,       "([Ljava/lang/String;[Ljava/lang/String;IIILjava/lang/String;[Ljava/lang/String;II)J"),
+    LLM_NATIVE(nativeSubmitGenerate,   "(Ljava/lang/String;IIZIZLjava/lang/String;[Ljava/lang/String;)J"),
+    LLM_NATIVE(nativeSubmitEssays,     "([Ljava/lang/String;[IIZI[Ljava/lang/String;)[J"),
+};
+#undef LLM_NATIVE
+
+extern "C" JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void*) {
+    JNIEnv* env = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK) return JNI_ERR;
+
+    jclass cls = env->FindClass("com/kingsun/plugins/llm/LlamaNative");
+    if (!cls) return JNI_ERR;
+    if (env->RegisterNatives(cls, kNativeMethods, (jint)(sizeof(kNativeMethods) / sizeof(kNativeMethods[0]))) != JNI_OK) {
+        LOGE("RegisterNatives failed");
+        return JNI_ERR;
+    }
+    g_jni.vm          = vm;
+    g_jni.cls         = static_cast<jclass>(env->NewGlobalRef(cls));
+    g_jni.on_token    = env->GetMethodID(cls, "onNativeToken",    "(Ljava/lang/String;I)V");
+    g_jni.on_progress = env->GetMethodID(cls, "onNativeProgress", "(JII)V");
+    g_jni.on_done     = env->GetMethodID(cls, "onNativeDone",     "(J)V");
+    g_jni.on_result   = env->GetMethodID(cls, "onNativeResult",   "(JLjava/lang/String;)V");
+    g_jni.on_segment  = env->GetMethodID(cls, "onNativeSegment",  "(IILjava/lang/String;)V");
+    g_jni.on_begin    = env->GetMethodID(cls, "onNativeBegin",    "(J)V");
+    g_jni.on_thought  = env->GetMethodID(cls, "onNativeThought",  "(Ljava/lang/String;I)V");
+    env->DeleteLocalRef(cls);
+    if (!g_jni.on_token || !g_jni.on_progress || !g_jni.on_done || !g_jni.on_result || !g_jni.on_segment || !g_jni.on_begin
+        || !g_jni.on_thought) {
+        LOGE("callback methods not found");
+        return JNI_ERR;
+    }
+
+    g_engine.th = std::thread(engine_main);
+    return JNI_VERSION_1_6;
+}
+
+extern "C" JNIEXPORT void JNICALL JNI_OnUnload(JavaVM* vm, void*) {
+    {
+        std::lock_guard<std::mutex> lk(g_engine.mu);
+        g_engine.quit = true;
+    }
+    g_engine.cv.notify_one();
+    g_engine.idle_cv.notify_all();   // 卡在 drain_jobs 里的 free 也要醒
+    if (g_engine.th.joinable()) g_engine.th.join();
+
+    JNIEnv* env = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) == JNI_OK && g_jni.cls) {
+        env->DeleteGlobalRef(g_jni.cls);
+    }
+    g_jni = JniCache{};
 }
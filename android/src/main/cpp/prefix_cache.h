@@ -0,0 +1,144 @@
+// android/src/main/cpp/prefix_cache.h
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "llama.h"
+
+// ===== 前缀 KV 缓存 =====
+// 以 token 为键的前缀树；挂快照的节点保存 “KV 恰好只含该前缀” 时的 seq 状态
+// （llama_state_seq_get_data）。命中后用 llama_state_seq_set_data 写回，只 prefill 剩余部分。
+// 按字节预算做 LRU 淘汰。非线程安全，调用方持有 g_mutex。
+class PrefixCache {
+public:
+    struct Stats {
+        uint64_t hits          = 0;
+        uint64_t misses        = 0;
+        uint64_t tokens_reused = 0;
+        uint64_t evictions     = 0;
+        size_t   bytes         = 0;
+        size_t   entries       = 0;
+    };
+
+    explicit PrefixCache(size_t budget_bytes = 0) : budget_(budget_bytes) {}
+
+    void set_budget(size_t bytes) { budget_ = bytes; evict_to_budget(); }
+    size_t budget() const { return budget_; }
+    const Stats& stats() const { return stats_; }
+
+    void clear() {
+        root_.next.clear();
+        lru_.clear();
+        stats_.bytes = 0;
+        stats_.entries = 0;
+    }
+
+    // 在 toks[0..n) 内找最长的已缓存前缀；比 min_len 长才清空 seq 并写回快照，返回前缀长度，否则返回 0。
+    // 写回失败时 seq 已被清空，通过 *wiped 告知调用方
+    size_t restore_longest(llama_context* ctx, llama_seq_id seq, const llama_token* toks, size_t n,
+                           size_t min_len, bool* wiped) {
+        *wiped = false;
+        if (budget_ == 0) return 0;
+        Node* best = nullptr;
+        Node* cur  = &root_;
+        for (size_t i = 0; i < n; ++i) {
+            auto it = cur->next.find(toks[i]);
+            if (it == cur->next.end()) break;
+            cur = it->second.get();
+            if (!cur->snapshot.empty()) best = cur;
+        }
+        if (!best || best->depth <= min_len) { stats_.misses++; return 0; }
+
+        llama_memory_seq_rm(llama_get_memory(ctx), seq, -1, -1);
+        if (llama_state_seq_set_data(ctx, best->snapshot.data(), best->snapshot.size(), seq) == 0) {
+            llama_memory_seq_rm(llama_get_memory(ctx), seq, -1, -1);
+            *wiped = true;
+            drop_snapshot(best);
+            stats_.misses++;
+            return 0;
+        }
+        touch(best);
+        stats_.hits++;
+        stats_.tokens_reused += best->depth;
+        return best->depth;
+    }
+
+    // 调用时 seq 中必须恰好只有 toks[0..n)
+    void store(llama_context* ctx, llama_seq_id seq, const llama_token* toks, size_t n) {
+        if (budget_ == 0 || n == 0) return;
+        Node* cur = &root_;
+        for (size_t i = 0; i < n; ++i) {
+            auto& child = cur->next[toks[i]];
+            if (!child) {
+                child = std::make_unique<Node>();
+                child->parent = cur;
+                child->token  = toks[i];
+                child->depth  = i + 1;
+            }
+            cur = child.get();
+        }
+        if (!cur->snapshot.empty()) { touch(cur); return; }
+
+        size_t need = llama_state_seq_get_size(ctx, seq);
+        if (need == 0 || need > budget_) { prune(cur); return; }
+        cur->snapshot.resize(need);
+        size_t got = llama_state_seq_get_data(ctx, cur->snapshot.data(), need, seq);
+        if (got == 0) { cur->snapshot.clear(); prune(cur); return; }
+        cur->snapshot.resize(got);
+        cur->snapshot.shrink_to_fit();
+
+        lru_.push_front(cur);
+        cur->lru_it = lru_.begin();
+        stats_.bytes += cur->snapshot.size();
+        stats_.entries++;
+        evict_to_budget(cur);
+    }
+
+private:
+    struct Node {
+        std::unordered_map<llama_token, std::unique_ptr<Node>> next;
+        Node*                          parent = nullptr;
+        llama_token                    token  = 0;
+        size_t                         depth  = 0;
+        std::vector<uint8_t>           snapshot;
+        std::list<Node*>::iterator     lru_it;
+    };
+
+    void touch(Node* n) { lru_.splice(lru_.begin(), lru_, n->lru_it); }
+
+    void drop_snapshot(Node* n) {
+        stats_.bytes -= n->snapshot.size();
+        stats_.entries--;
+        lru_.erase(n->lru_it);
+        std::vector<uint8_t>().swap(n->snapshot);
+        prune(n);
+    }
+
+    // 自底向上删掉既无快照也无子节点的节点
+    void prune(Node* n) {
+        while (n != &root_ && n->snapshot.empty() && n->next.empty()) {
+            Node* parent = n->parent;
+            parent->next.erase(n->token);   // 释放 n
+            n = parent;
+        }
+    }
+
+    void evict_to_budget(Node* keep = nullptr) {
+        while (stats_.bytes > budget_ && !lru_.empty()) {
+            Node* victim = lru_.back();
+            if (victim == keep && lru_.size() == 1) break;
+            if (victim == keep) { touch(victim); continue; }
+            drop_snapshot(victim);
+            stats_.evictions++;
+        }
+    }
+
+    Node             root_;
+    std::list<Node*> lru_;      // 头部最近使用
+    size_t           budget_;
+    Stats            stats_;
+};
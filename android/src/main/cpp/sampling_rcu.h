@@ -0,0 +1,78 @@
+// android/src/main/cpp/sampling_rcu.h
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// ===== 参数快照发布（RCU）=====
+// 写者发布一份不可变快照（指针原子交换），只在写者之间串行，不碰生成线程持有的任何锁；
+// 读者（只有生成线程）每个 token 比一次版本号，变了才拷贝快照。
+// 读者读完某版本后记到 seen，写者只回收比 seen 旧的快照；读者空闲（请求之间）时调 quiesce，
+// 之后的发布把旧快照全部回收，不会因为没人读而越积越多。T 需要有 uint64_t version 字段
+template <class T>
+class SnapshotRcu {
+public:
+    SnapshotRcu() = default;
+    SnapshotRcu(const SnapshotRcu&) = delete;
+    SnapshotRcu& operator=(const SnapshotRcu&) = delete;
+    ~SnapshotRcu() {
+        delete cur_.load(std::memory_order_relaxed);
+        for (const T* q : retired_) delete q;
+    }
+
+    // 读者：当前发布的版本号（0 = 从未发布，用默认值）；不碰快照本身，空闲时也能调
+    uint64_t version() const {
+        return cur_version_.load(std::memory_order_acquire);
+    }
+
+    // 读者：拷贝当前快照，并声明更旧的快照已不再被读。
+    // 读之前先把 seen 置 0（什么都不回收）：写者要么看到 0，要么读者拿到的已是它刚发布的那份（都是 seq_cst）
+    T snapshot() {
+        seen_.store(0, std::memory_order_seq_cst);
+        const T* p = cur_.load(std::memory_order_seq_cst);
+        T v = p ? *p : T{};
+        seen_.store(v.version, std::memory_order_release);
+        return v;
+    }
+
+    // 读者：不再持有任何快照（请求结束、生成线程空闲），之后发布时旧快照全部回收
+    void quiesce() {
+        seen_.store(kQuiescent, std::memory_order_release);
+    }
+
+    // 写者：发布新快照（version 由这里分配），顺带回收读者已越过的旧快照
+    void publish(const T& np) {
+        std::lock_guard<std::mutex> lk(pub_mu_);
+        T* p = new T(np);
+        p->version = ++last_version_;
+        const T* old = cur_.exchange(p, std::memory_order_seq_cst);
+        cur_version_.store(p->version, std::memory_order_release);
+        if (old) retired_.push_back(old);
+        const uint64_t seen = seen_.load(std::memory_order_seq_cst);
+        retired_.erase(std::remove_if(retired_.begin(), retired_.end(), [seen](const T* q) {
+            if (q->version >= seen) return false;
+            delete q;
+            return true;
+        }), retired_.end());
+    }
+
+    // 尚未回收的旧快照个数
+    size_t retired() {
+        std::lock_guard<std::mutex> lk(pub_mu_);
+        return retired_.size();
+    }
+
+private:
+    static constexpr uint64_t kQuiescent = UINT64_MAX;
+
+    std::atomic<const T*>  cur_{nullptr};   // nullptr = 默认参数
+    std::atomic<uint64_t>  cur_version_{0};
+    std::atomic<uint64_t>  seen_{kQuiescent};   // 还没有读者读过时同空闲
+    std::mutex             pub_mu_;         // 只串行写者，读者从不拿
+    uint64_t               last_version_ = 0;
+    std::vector<const T*>  retired_;
+};
@@ -0,0 +1,119 @@
+// android/src/main/cpp/stop_matcher.h
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// ===== 停止串：字节流上的 Aho-Corasick 自动机 =====
+// 生成的文本按 token 一段段喂进来，停止串可能跨 token（甚至跨 UTF-8 码点中间）出现。
+// 自动机每字节一次查表，不回看已输出的文本；当前状态的深度就是“可能是某个停止串开头”的尾巴长度，
+// 这部分先扣住，确定不会命中再放出，命中时停止串本身及其后的字节都不输出。
+// 转移表按字母表压缩：只出现在停止串里的字节各占一列，其余字节共用第 0 列（都回到根）
+class StopMatcher {
+public:
+    static constexpr size_t kMaxStops = 16;
+    static constexpr size_t kMaxBytes = 128;   // 单个停止串上限
+
+    // 空串忽略，超出数量/长度的丢弃；返回实际生效的个数
+    size_t build(const std::vector<std::string>& stops) {
+        *this = StopMatcher{};
+        std::vector<std::string_view> pats;
+        for (const auto& s : stops) {
+            if (s.empty() || s.size() > kMaxBytes) continue;
+            if (pats.size() >= kMaxStops) break;
+            pats.emplace_back(s);
+        }
+        if (pats.empty()) return 0;
+        held_.reserve(2 * kMaxBytes);   // 扣住的尾巴 < kMaxBytes，加上一个 piece
+
+        std::fill(cls_, cls_ + 256, (uint8_t)0);
+        width_ = 1;
+        for (auto p : pats) for (unsigned char c : p) if (cls_[c] == 0) cls_[c] = (uint8_t)width_++;
+
+        // trie：-1 表示还没有边
+        depth_.assign(1, 0);
+        out_.assign(1, 0);
+        next_.assign(width_, -1);
+        for (auto p : pats) {
+            int32_t s = 0;
+            for (unsigned char c : p) {
+                int32_t& e = next_[(size_t)s * width_ + cls_[c]];
+                if (e < 0) {
+                    e = (int32_t)depth_.size();
+                    depth_.push_back(depth_[(size_t)s] + 1);
+                    out_.push_back(0);
+                    next_.resize(next_.size() + width_, -1);
+                }
+                s = next_[(size_t)s * width_ + cls_[c]];
+            }
+            out_[(size_t)s] = (uint16_t)p.size();
+        }
+
+        // BFS 补全失败转移，得到完整的 DFA；out_ 沿失败链取最长（命中时起点最早）
+        std::vector<int32_t> fail(depth_.size(), 0), queue;
+        queue.reserve(depth_.size());
+        for (size_t a = 0; a < width_; ++a) {
+            int32_t& e = next_[a];
+            if (e < 0) e = 0; else queue.push_back(e);
+        }
+        for (size_t qi = 0; qi < queue.size(); ++qi) {
+            const int32_t s = queue[qi];
+            for (size_t a = 0; a < width_; ++a) {
+                int32_t& e = next_[(size_t)s * width_ + a];
+                const int32_t f = next_[(size_t)fail[(size_t)s] * width_ + a];
+                if (e < 0) { e = f; continue; }
+                fail[(size_t)e] = f;
+                out_[(size_t)e] = std::max(out_[(size_t)e], out_[(size_t)f]);
+                queue.push_back(e);
+            }
+        }
+        return pats.size();
+    }
+
+    bool empty() const { return next_.empty(); }
+
+    // 新请求：回到根，清掉扣住的尾巴（保留自动机）
+    void reset() { state_ = 0; held_.clear(); }
+
+    // 喂一段输出；确定安全的字节追加到 release。命中返回 true，命中的停止串与之后的字节丢弃
+    bool feed(std::string_view piece, std::string& release) {
+        int32_t s = state_;
+        for (size_t i = 0; i < piece.size(); ++i) {
+            s = next_[(size_t)s * width_ + cls_[(unsigned char)piece[i]]];
+            const size_t hit = out_[(size_t)s];
+            if (hit == 0) continue;
+            held_.append(piece.data(), i + 1);
+            release.append(held_.data(), held_.size() - hit);
+            held_.clear();
+            state_ = 0;
+            return true;
+        }
+        state_ = s;
+        held_.append(piece.data(), piece.size());
+        const size_t keep = (size_t)depth_[(size_t)s];
+        release.append(held_.data(), held_.size() - keep);
+        held_.erase(0, held_.size() - keep);
+        return false;
+    }
+
+    // 生成结束：扣住的尾巴不会再命中，全部放出
+    void finish(std::string& release) {
+        release.append(held_);
+        reset();
+    }
+
+    size_t held() const { return held_.size(); }
+
+private:
+    uint8_t              cls_[256] = {};
+    size_t               width_ = 0;    // 压缩后的字母表大小（含第 0 列）
+    std::vector<int32_t> next_;         // 状态 * width_ + 列 -> 状态
+    std::vector<uint16_t> depth_;       // 状态对应的前缀长度 = 需要扣住的字节数
+    std::vector<uint16_t> out_;         // 在此结束的最长停止串长度，0 = 无
+    int32_t              state_ = 0;
+    std::string          held_;
+};
@@ -0,0 +1,118 @@
+// android/src/main/cpp/think_filter.h
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// ===== Qwen3 推理段的流式切分：<think>…</think> 与正式回答分开 =====
+// 回复开头（允许前导空白）出现 <think> 才算有推理段，之后直到 </think> 都是推理，其余都是回答；
+// 标签本身与紧随其后的空白不输出。按 token 一段段喂，标签跨 token 时先扣住疑似标签的字节。
+// 两个标签都没有“既是前缀又是后缀”的真子串，失配时直接放出扣住的字节、从当前字节重新匹配即可
+class ThinkFilter {
+public:
+    enum Part : uint8_t { kAnswer = 0, kThought = 1 };
+
+    // expect：模板没关掉思考，回复可能以推理段开头；false 时全部按回答透传
+    void begin(bool expect) {
+        state_   = expect ? kStart : kBody;
+        matched_ = 0;
+        skip_ws_ = false;
+        held_.clear();
+        run_.clear();
+        held_.reserve(16);     // 最长的标签 + 前导空白；之后 begin 不再分配
+        run_.reserve(256);
+    }
+
+    bool in_thought() const { return state_ == kThink; }
+
+    // sink(Part, std::string_view)：连续同类的字节合成一段回调
+    template <class Sink>
+    void feed(std::string_view p, Sink&& sink) {
+        for (char c : p) step(c, sink);
+        flush_run(sink);
+    }
+
+    // 生成结束：扣住的字节不是标签，按当前所在部分放出
+    template <class Sink>
+    void finish(Sink&& sink) {
+        if (!held_.empty()) {
+            put(state_ == kThink ? kThought : kAnswer, held_.data(), held_.size(), sink);
+            held_.clear();
+        }
+        matched_ = 0;
+        flush_run(sink);
+    }
+
+private:
+    enum State : uint8_t { kStart, kThink, kBody };
+    static constexpr std::string_view kOpen  = "<think>";
+    static constexpr std::string_view kClose = "</think>";
+
+    static bool is_ws(char c) { return c == ' ' || c == '\n' || c == '\r' || c == '\t'; }
+
+    template <class Sink>
+    void step(char c, Sink& sink) {
+        switch (state_) {
+            case kStart:
+                if (matched_ == 0 && is_ws(c)) { held_.push_back(c); return; }
+                if (c == kOpen[matched_]) {
+                    held_.push_back(c);
+                    if (++matched_ == kOpen.size()) { enter(kThink); }
+                    return;
+                }
+                // 开头不是推理段：扣住的原样算回答，之后不再找 <think>
+                state_ = kBody;
+                matched_ = 0;
+                if (!held_.empty()) { put(kAnswer, held_.data(), held_.size(), sink); held_.clear(); }
+                put(kAnswer, &c, 1, sink);
+                return;
+            case kThink:
+                if (skip_ws_ && is_ws(c)) return;
+                skip_ws_ = false;
+                if (c == kClose[matched_]) {
+                    held_.push_back(c);
+                    if (++matched_ == kClose.size()) enter(kBody);
+                    return;
+                }
+                if (matched_ > 0) { put(kThought, held_.data(), held_.size(), sink); held_.clear(); matched_ = 0; }
+                if (c == kClose[0]) { held_.push_back(c); matched_ = 1; return; }
+                put(kThought, &c, 1, sink);
+                return;
+            case kBody:
+                if (skip_ws_ && is_ws(c)) return;
+                skip_ws_ = false;
+                put(kAnswer, &c, 1, sink);
+                return;
+        }
+    }
+
+    void enter(State s) {
+        state_   = s;
+        matched_ = 0;
+        skip_ws_ = true;
+        held_.clear();
+    }
+
+    template <class Sink>
+    void put(Part part, const char* p, size_t n, Sink& sink) {
+        if (!run_.empty() && part != run_part_) flush_run(sink);
+        run_part_ = part;
+        run_.append(p, n);
+    }
+
+    template <class Sink>
+    void flush_run(Sink& sink) {
+        if (run_.empty()) return;
+        sink(run_part_, std::string_view(run_));
+        run_.clear();
+    }
+
+    State       state_    = kBody;
+    size_t      matched_  = 0;
+    bool        skip_ws_  = false;
+    Part        run_part_ = kAnswer;
+    std::string held_;   // 疑似标签（及 <think> 前的空白）的字节
+    std::string run_;    // 本次 feed 里待回调的同类字节
+};
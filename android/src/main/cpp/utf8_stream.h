@@ -0,0 +1,194 @@
+// android/src/main/cpp/utf8_stream.h
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// ===== 流式 UTF-8 -> UTF-16 解码 =====
+// 与原 utf8_decode_to_utf16_partial 语义一致：非法字节/过短编码/越界码点替换为 U+FFFD，
+// 末尾不完整的序列留到下一次。不完整尾巴最多 3 字节，放在固定的 carry 里，不再拼接/移动字符串。
+// ASCII 连续段走 SSE2/NEON 16 字节一组的快路径。
+class Utf8Stream {
+public:
+    // 解码 p[0..n)（接在上次的尾巴后面），结果追加到 out；返回追加的 UTF-16 单元数
+    size_t feed(const char* p, size_t n, std::u16string& out) {
+        const size_t base = out.size();
+        out.resize(base + n + n_carry_);          // UTF-16 单元数不超过字节数
+        char16_t* dst = &out[base];
+        char16_t* d   = dst;
+        const uint8_t* s   = reinterpret_cast<const uint8_t*>(p);
+        const uint8_t* end = s + n;
+
+        if (n_carry_ > 0) {
+            // 尾巴 + 新数据开头凑一个小窗口，解到越过尾巴为止
+            uint8_t win[7];
+            const size_t take = n < 4 ? n : 4;
+            memcpy(win, carry_, n_carry_);
+            memcpy(win + n_carry_, s, take);
+            const size_t wn = n_carry_ + take;
+            size_t i = 0;
+            while (i < n_carry_) {
+                const size_t c = step(win + i, wn - i, d);
+                if (c == 0) break;
+                i += c;
+            }
+            if (i < n_carry_) {
+                // 窗口仍不完整（说明新数据不足 4 字节且全被吃进窗口）：整体留作新尾巴
+                n_carry_ = (uint8_t)(wn - i);
+                memmove(carry_, win + i, n_carry_);
+                out.resize(base + (size_t)(d - dst));
+                return (size_t)(d - dst);
+            }
+            s += i - n_carry_;
+            n_carry_ = 0;
+        }
+
+        while (s < end) {
+            if (*s < 0x80) {
+                const size_t m = ascii_run(s, (size_t)(end - s), d);
+                s += m; d += m;
+                continue;
+            }
+            // 常见的合法 3 字节序列（CJK）直接解，不走通用分支
+            if ((*s & 0xF0) == 0xE0 && end - s >= 3 && (s[1] & 0xC0) == 0x80 && (s[2] & 0xC0) == 0x80) {
+                const uint32_t cp = ((s[0] & 0x0Fu) << 12) | ((s[1] & 0x3Fu) << 6) | (s[2] & 0x3Fu);
+                *d++ = (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF)) ? (char16_t)0xFFFD : (char16_t)cp;
+                s += 3;
+                continue;
+            }
+            const size_t c = step(s, (size_t)(end - s), d);
+            if (c == 0) {
+                n_carry_ = (uint8_t)(end - s);
+                memcpy(carry_, s, n_carry_);
+                break;
+            }
+            s += c;
+        }
+        out.resize(base + (size_t)(d - dst));
+        return (size_t)(d - dst);
+    }
+
+    // 流结束：残留的不完整尾巴输出一个 U+FFFD
+    size_t finish(std::u16string& out) {
+        if (n_carry_ == 0) return 0;
+        n_carry_ = 0;
+        out.push_back((char16_t)0xFFFD);
+        return 1;
+    }
+
+    size_t pending() const { return n_carry_; }
+    void reset() { n_carry_ = 0; }
+
+private:
+    static inline void put(char16_t*& d, uint32_t cp) {
+        if (cp <= 0xFFFF) {
+            // 避免直接落入代理区
+            if (cp >= 0xD800 && cp <= 0xDFFF) cp = 0xFFFD;
+            *d++ = (char16_t)cp;
+        } else if (cp <= 0x10FFFF) {
+            cp -= 0x10000;
+            *d++ = (char16_t)(0xD800 + (cp >> 10));
+            *d++ = (char16_t)(0xDC00 + (cp & 0x3FF));
+        } else {
+            *d++ = (char16_t)0xFFFD;
+        }
+    }
+
+    // 解一个码点；返回消费的字节数，0 表示序列不完整
+    static inline size_t step(const uint8_t* p, size_t n, char16_t*& d) {
+        const uint8_t b0 = p[0];
+        if (b0 < 0x80) { *d++ = b0; return 1; }
+        if ((b0 & 0xE0) == 0xC0) {
+            if (n < 2) return 0;
+            if ((p[1] & 0xC0) != 0x80) { *d++ = 0xFFFD; return 1; }
+            uint32_t cp = ((b0 & 0x1Fu) << 6) | (p[1] & 0x3Fu);
+            put(d, cp < 0x80 ? 0xFFFD : cp);
+            return 2;
+        }
+        if ((b0 & 0xF0) == 0xE0) {
+            if (n < 3) return 0;
+            if ((p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80) { *d++ = 0xFFFD; return 1; }
+            uint32_t cp = ((b0 & 0x0Fu) << 12) | ((p[1] & 0x3Fu) << 6) | (p[2] & 0x3Fu);
+            put(d, cp < 0x800 ? 0xFFFD : cp);
+            return 3;
+        }
+        if ((b0 & 0xF8) == 0xF0) {
+            if (n < 4) return 0;
+            if ((p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80 || (p[3] & 0xC0) != 0x80) { *d++ = 0xFFFD; return 1; }
+            uint32_t cp = ((b0 & 0x07u) << 18) | ((p[1] & 0x3Fu) << 12) | ((p[2] & 0x3Fu) << 6) | (p[3] & 0x3Fu);
+            put(d, (cp < 0x10000 || cp > 0x10FFFF) ? 0xFFFD : cp);
+            return 4;
+        }
+        // 非法起始字节，跳过 1
+        *d++ = 0xFFFD;
+        return 1;
+    }
+
+    // 从 s 起的 ASCII 连续段直接展宽；返回处理的字节数（>= 1，调用方保证 s[0] 是 ASCII）
+    static inline size_t ascii_run(const uint8_t* s, size_t n, char16_t* d) {
+        size_t i = 0;
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            if (_mm_movemask_epi8(v) != 0) break;
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i),     _mm_unpacklo_epi8(v, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i + 8), _mm_unpackhi_epi8(v, zero));
+        }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+        for (; i + 16 <= n; i += 16) {
+            const uint8x16_t v = vld1q_u8(s + i);
+            if (vmaxvq_u8(v) >= 0x80) break;
+            vst1q_u16(reinterpret_cast<uint16_t*>(d + i),     vmovl_u8(vget_low_u8(v)));
+            vst1q_u16(reinterpret_cast<uint16_t*>(d + i + 8), vmovl_high_u8(v));
+        }
+#endif
+        for (; i < n && s[i] < 0x80; ++i) d[i] = s[i];
+        return i;
+    }
+
+    uint8_t carry_[4] = {0, 0, 0, 0};
+    uint8_t n_carry_  = 0;
+};
+
+// ===== UTF-16 -> UTF-8（Java 字符串入口）=====
+// 标准 UTF-8（不是 JNI 的 Modified UTF-8）：代理对合成 4 字节序列，落单的代理替换为 U+FFFD。
+// 追加到 out；调用方可预留 n * 3 字节避免扩容
+inline void utf16_to_utf8_append(const char16_t* p, size_t n, std::string& out) {
+    const size_t base = out.size();
+    out.resize(base + n * 3);
+    char* d = &out[base];
+    size_t i = 0;
+    while (i < n) {
+        // ASCII 连续段
+        while (i < n && p[i] < 0x80) *d++ = (char)p[i++];
+        if (i >= n) break;
+        uint32_t c = p[i++];
+        if (c < 0x800) {
+            *d++ = (char)(0xC0 | (c >> 6));
+            *d++ = (char)(0x80 | (c & 0x3F));
+            continue;
+        }
+        if (c >= 0xD800 && c <= 0xDBFF && i < n && p[i] >= 0xDC00 && p[i] <= 0xDFFF) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (p[i++] - 0xDC00);
+            *d++ = (char)(0xF0 | (c >> 18));
+            *d++ = (char)(0x80 | ((c >> 12) & 0x3F));
+            *d++ = (char)(0x80 | ((c >> 6) & 0x3F));
+            *d++ = (char)(0x80 | (c & 0x3F));
+            continue;
+        }
+        if (c >= 0xD800 && c <= 0xDFFF) c = 0xFFFD;
+        *d++ = (char)(0xE0 | (c >> 12));
+        *d++ = (char)(0x80 | ((c >> 6) & 0x3F));
+        *d++ = (char)(0x80 | (c & 0x3F));
+    }
+    out.resize((size_t)(d - out.data()));
+}
@@ -22,25 +22,117 @@ public class LLMPlugin extends Plugin {
     private static final String TAG = "LLMPlugin";
 
     private final ExecutorService worker = Executors.newSingleThreadExecutor();
-    private volatile PluginCall streamingCall;
+    /** 正在生成 token 流的请求（native onBegin 标记，后台作文被抢占后会与 chat 交错） */
+    private volatile long currentRequestId;
+    /** 各请求已送出的 token 数（llmToken.totalTokens）；只在回调线程上读写 */
+    private final java.util.Map<Long, Integer> streamedTokens = new java.util.HashMap<>();
+    /** 已提交、等待结束的 chat（按 native 请求 id）；与 pendingGenerate 同锁 */
+    private final java.util.Map<Long, PluginCall> pendingChat = new java.util.HashMap<>();
+    /** 已提交、等待 onResult 的一次性生成（按 native 请求 id） */
+    private final java.util.Map<Long, PluginCall> pendingGenerate = new java.util.HashMap<>();
+    /** 流式作文：全文先到，等 onDone（排在最后一段 token 之后）再 resolve；与 pendingGenerate 同锁 */
+    private final java.util.Map<Long, String> streamedResults = new java.util.HashMap<>();
+    /** 批量作文的各条请求 id -> 所属批次；与 pendingGenerate 同锁 */
+    private final java.util.Map<Long, EssayBatch> pendingBatchItems = new java.util.HashMap<>();
+    private volatile String modelPath;
+    private volatile String modelSha256;
 
-    /** 新：JNI 壳实例（用于接收 Native token 回调） */
-    private LlamaNative core = new LlamaNative(
+    /** JNI 壳（进程内唯一，用于接收 Native token 回调；后创建的插件实例接管回调） */
+    private final LlamaNative core = LlamaNative.attach(
         new LlamaNative.Listener() {
             @Override
-            public void onToken(String token) {
-                JSObject ev = new JSObject().put("token", token);
+            public void onBegin(long requestId) {
+                currentRequestId = requestId;
+            }
+
+            @Override
+            public void onToken(String text, int nTokens) {
+                long id = currentRequestId;
+                Integer prev = streamedTokens.get(id);
+                int total = (prev != null ? prev : 0) + nTokens;
+                streamedTokens.put(id, total);
+                JSObject ev = new JSObject().put("token", text).put("tokens", nTokens);
+                ev.put("totalTokens", total).put("requestId", id);
                 notifyListeners("llmToken", ev);
             }
 
             @Override
-            public void onDone() {
-                notifyListeners("llmDone", new JSObject());
-                finishStreamingOk();
+            public void onThinking(String text, int nTokens) {
+                notifyListeners("llmThinking", new JSObject().put("text", text).put("tokens", nTokens).put("requestId", currentRequestId));
+            }
+
+            @Override
+            public void onDone(long requestId) {
+                if (finishBatchItem(requestId, null, true)) {
+                    streamedTokens.remove(requestId);
+                    notifyListeners("llmDone", new JSObject().put("requestId", requestId));
+                    return;
+                }
+                PluginCall essay;
+                PluginCall chat;
+                String text;
+                synchronized (pendingGenerate) {
+                    essay = pendingGenerate.remove(requestId);
+                    text = streamedResults.remove(requestId);
+                    chat = pendingChat.remove(requestId);
+                }
+                streamedTokens.remove(requestId);
+                notifyListeners("llmDone", new JSObject().put("requestId", requestId));
+                if (essay != null) {
+                    essay.resolve(new JSObject().put("text", text != null ? text : "").put("requestId", requestId));
+                } else if (chat != null) {
+                    chat.resolve(new JSObject().put("requestId", requestId));
+                }
+            }
+
+            @Override
+            public void onResult(long requestId, String text) {
+                if (finishBatchItem(requestId, text, false)) return;
+                PluginCall call;
+                synchronized (pendingGenerate) {
+                    call = pendingGenerate.get(requestId);
+                    if (call != null && call.getBoolean("stream", false)) {
+                        streamedResults.put(requestId, text);
+                        return;
+                    }
+                    pendingGenerate.remove(requestId);
+                }
+                if (call != null) call.resolve(new JSObject().put("text", text).put("requestId", requestId));
+            }
+
+            @Override
+            public void onSegment(int kind, int index, String text) {
+                JSObject ev = new JSObject().put("index", index).put("text", text).put("requestId", currentRequestId);
+                notifyListeners(kind == LlamaNative.SEGMENT_PARAGRAPH ? "llmParagraph" : "llmSentence", ev);
+            }
+
+            @Override
+            public void onPrefillProgress(long requestId, int done, int total) {
+                JSObject ev = new JSObject().put("done", done).put("total", total).put("requestId", requestId);
+                ev.put("percent", total > 0 ? Math.min(100, done * 100 / total) : 100);
+                notifyListeners("llmPrefill", ev);
             }
         }
     );
 
+    /** priority 选项：interactive（0）/ background（1），缺省按请求类型 */
+    private static int parsePriority(PluginCall call, int dflt) {
+        String p = call.getString("priority");
+        if (p == null) return dflt;
+        return "background".equals(p) ? LlamaNative.PRIORITY_BACKGROUND : LlamaNative.PRIORITY_INTERACTIVE;
+    }
+
+    private static int parseThinking(PluginCall call) {
+        String t = call.getString("thinking");
+        if (t == null || t.equals("inline")) return LlamaNative.THINK_INLINE;
+        switch (t) {
+            case "off": return LlamaNative.THINK_OFF;
+            case "separate": return LlamaNative.THINK_SEPARATE;
+            case "hidden": return LlamaNative.THINK_HIDDEN;
+            default: throw new IllegalArgumentException("unknown thinking: " + t);
+        }
+    }
+
     // ---------- @PluginMethod: init ----------
     @PluginMethod
     public void init(PluginCall call) {
@@ -51,6 +143,12 @@ public class LLMPlugin extends Plugin {
             final String explicitPath = call.getString("modelPath");
             final String remoteUrl = call.getString("remoteUrl");
             final int nCtx = call.getInt("nCtx", 1024);
+            final int nBatch = call.getInt("nBatch", 0);
+            final int nUbatch = call.getInt("nUbatch", 0);
+            final int prefillChunk = call.getInt("prefillChunk", 0);
+            final boolean keepStandby = call.getBoolean("keepStandbyContext", false);
+            final int prefixCacheMb = call.getInt("prefixCacheMb", 32);
+            final int parallel = call.getInt("parallel", 1);
 
             String modelPath = null;
             if (assetPath != null && !assetPath.isEmpty()) {
@@ -79,7 +177,13 @@ public class LLMPlugin extends Plugin {
                 return;
             }
 
-            boolean ok = LlamaNative.nativeInit(modelPath, nCtx);
+            boolean ok = LlamaNative.nativeInit(modelPath, nCtx, nBatch, nUbatch, keepStandby, prefixCacheMb, parallel);
+            if (ok) {
+                LlamaNative.nativeSetPrefillChunk(prefillChunk);
+                core.startStreamRing();
+            }
+            this.modelPath = modelPath;
+            this.modelSha256 = (expectedSha != null && expectedSha.length() == 64) ? expectedSha.toLowerCase(Locale.ROOT) : null;
             if (ok) call.resolve();
             else call.reject("nativeInit failed");
         } catch (Exception e) {
@@ -104,31 +208,138 @@ public class LLMPlugin extends Plugin {
         }
     }
 
-    // ---------- @PluginMethod: chat ----------
+    // ---------- @PluginMethod: setPrefillChunk ----------
     @PluginMethod
-    public synchronized void chat(PluginCall call) {
-        String prompt = call.getString("prompt", "");
-        if (prompt.trim().isEmpty()) {
-            call.reject("prompt required");
-            return;
+    public void setPrefillChunk(PluginCall call) {
+        try {
+            LlamaNative.nativeSetPrefillChunk(call.getInt("chunk", 0));
+            call.resolve();
+        } catch (Throwable t) {
+            call.reject("setPrefillChunk error: " + t.getMessage());
         }
-        if (streamingCall != null) {
-            call.reject("another chat is running");
-            return;
+    }
+
+    // ---------- @PluginMethod: setStreamPolicy ----------
+    @PluginMethod
+    public void setStreamPolicy(PluginCall call) {
+        try {
+            String b = call.getString("boundary", "none");
+            int boundary = "sentence".equals(b) ? 2 : "word".equals(b) ? 1 : 0;
+            LlamaNative.nativeSetStreamPolicy(call.getInt("flushMs", 0), call.getInt("flushChars", 0), boundary);
+            call.resolve();
+        } catch (Throwable t) {
+            call.reject("setStreamPolicy error: " + t.getMessage());
         }
+    }
+
+    // ---------- @PluginMethod: saveSession / loadSession ----------
+    @PluginMethod
+    public void saveSession(PluginCall call) {
+        final String name = call.getString("name", "default");
+        final boolean compress = call.getBoolean("compress", false);
+        worker.execute(() -> {
+            try {
+                File f = sessionFile(getContext(), name);
+                boolean ok = LlamaNative.nativeSaveSession(f.getAbsolutePath(), currentModelSha256(), compress);
+                if (ok) call.resolve();
+                else call.reject("saveSession failed");
+            } catch (Throwable t) {
+                call.reject("saveSession error: " + t.getMessage());
+            }
+        });
+    }
 
-        streamingCall = call;
+    @PluginMethod
+    public void loadSession(PluginCall call) {
+        final String name = call.getString("name", "default");
         worker.execute(() -> {
             try {
-                core.nativeChatStream(prompt);
+                File f = sessionFile(getContext(), name);
+                int n = f.exists() ? LlamaNative.nativeLoadSession(f.getAbsolutePath(), currentModelSha256()) : -1;
+                call.resolve(new JSObject().put("restored", n > 0).put("tokens", Math.max(0, n)));
             } catch (Throwable t) {
-                JSObject ev = new JSObject().put("message", "nativeChatStream error: " + t.getMessage());
-                notifyListeners("llmError", ev);
-                finishStreamingErr("native error: " + t.getMessage());
+                call.reject("loadSession error: " + t.getMessage());
             }
         });
     }
 
+    // ---------- @PluginMethod: getPerfStats ----------
+    @PluginMethod
+    public void getPerfStats(PluginCall call) {
+        try {
+            JSObject stats = new JSObject(LlamaNative.nativeGetPerfStats());
+            stats.put("streamDispatchErrors", core.streamDispatchErrors());
+            call.resolve(stats);
+        } catch (Throwable t) {
+            call.reject("getPerfStats error: " + t.getMessage());
+        }
+    }
+
+    // ---------- @PluginMethod: chat ----------
+    @PluginMethod
+    public synchronized void chat(PluginCall call) {
+        String prompt = call.getString("prompt", "");
+        JSArray messages = call.getArray("messages");
+        final int timeoutMs = call.getInt("timeoutMs", 0);
+
+        // messages 优先（整段对话）；否则把 prompt 当作单条 user 消息
+        java.util.List<String> roles = new java.util.ArrayList<>();
+        java.util.List<String> contents = new java.util.ArrayList<>();
+        try {
+            if (messages != null && messages.length() > 0) {
+                for (int i = 0; i < messages.length(); i++) {
+                    org.json.JSONObject m = messages.getJSONObject(i);
+                    roles.add(m.optString("role", "user"));
+                    contents.add(m.optString("content", ""));
+                }
+            } else if (!prompt.trim().isEmpty()) {
+                roles.add("user");
+                contents.add(prompt);
+            }
+        } catch (Exception e) {
+            call.reject("invalid messages: " + e.getMessage());
+            return;
+        }
+        if (roles.isEmpty()) {
+            call.reject("prompt or messages required");
+            return;
+        }
+        // 提交到 native 调度器后立即返回请求 id（llmQueued）；token/结束通过 Listener 回调，
+        // 多个 chat 排队执行，不再拒绝
+        int priority = parsePriority(call, LlamaNative.PRIORITY_INTERACTIVE);
+        String grammar;
+        String[] stop;
+        int thinkMode;
+        int maxNew = call.getInt("maxNewTokens", 512);
+        int thinkBudget = call.getInt("maxThinkingTokens", 0);
+        try {
+            grammar = resolveGrammar(call);
+            stop = stopsFrom(call);
+            thinkMode = parseThinking(call);
+        } catch (Exception e) {
+            call.reject(e.getMessage());
+            return;
+        }
+        try {
+            long id;
+            // 持锁提交并登记，保证 onDone 一定能找到对应的 call
+            synchronized (pendingGenerate) {
+                id = core.nativeSubmitChat(roles.toArray(new String[0]), contents.toArray(new String[0]), maxNew, timeoutMs, priority,
+                    grammar, stop, thinkMode, thinkBudget);
+                if (id >= 0) pendingChat.put(id, call);
+            }
+            if (id < 0) {
+                call.reject("grammar parse failed");
+                return;
+            }
+            notifyListeners("llmQueued", new JSObject().put("requestId", id).put("kind", "chat"));
+        } catch (Throwable t) {
+            JSObject ev = new JSObject().put("message", "nativeSubmitChat error: " + t.getMessage());
+            notifyListeners("llmError", ev);
+            call.reject("native error: " + t.getMessage());
+        }
+    }
+
     // ---------- @PluginMethod: stop/free ----------
     @PluginMethod
     public void stop(PluginCall call) {
@@ -140,67 +351,189 @@ public class LLMPlugin extends Plugin {
         }
     }
 
+    @PluginMethod
+    public void cancel(PluginCall call) {
+        Long id = call.getLong("requestId");
+        if (id == null) {
+            call.reject("requestId required");
+            return;
+        }
+        try {
+            boolean found = LlamaNative.nativeCancel(id);
+            call.resolve(new JSObject().put("cancelled", found));
+        } catch (Throwable t) {
+            call.reject("cancel error: " + t.getMessage());
+        }
+    }
+
     @PluginMethod
     public void free(PluginCall call) {
         try {
+            // nativeFree 先把排队中与正在跑的请求以取消收尾（结束回调带已生成部分），停环时把环里的结束标记送完
             LlamaNative.nativeFree();
+            core.stopStreamRing();
+            rejectPending("model freed");
             call.resolve();
         } catch (Throwable t) {
             call.reject("free error: " + t.getMessage());
         }
     }
 
+    /** 兜底：收尾后仍挂着的请求（生成线程没起来等）一律 reject，不让 PluginCall 永远悬着 */
+    private void rejectPending(String reason) {
+        java.util.List<PluginCall> calls = new java.util.ArrayList<>();
+        synchronized (pendingGenerate) {
+            calls.addAll(pendingChat.values());
+            calls.addAll(pendingGenerate.values());
+            for (EssayBatch batch : pendingBatchItems.values()) if (!calls.contains(batch.call)) calls.add(batch.call);
+            pendingChat.clear();
+            pendingGenerate.clear();
+            streamedResults.clear();
+            pendingBatchItems.clear();
+        }
+        for (PluginCall c : calls) c.reject(reason);
+    }
+
     // ---------- @PluginMethod: generateEssay ----------
     @PluginMethod
     public void generateEssay(PluginCall call) {
         try {
-            String title = call.getString("title", "An Essay");
-            int wordLimit = call.getInt("word_limit", 200);
-            String lang = call.getString("lang", "en");
-            JSObject cons = call.getObject("constraints");
-
-            java.util.List<String> hiErr = new java.util.ArrayList<>();
-            java.util.List<String> hiFreq = new java.util.ArrayList<>();
-            if (cons != null) {
-                JSONArray a = cons.getJSONArray("high_error_words");
-                if (a != null) for (int i = 0; i < a.length(); i++) hiErr.add(a.getString(i));
-                a = cons.getJSONArray("high_freq_words");
-                if (a != null) for (int i = 0; i < a.length(); i++) hiFreq.add(a.getString(i));
-            }
+            JSObject opts = call.getData();
+            String prompt = essayPromptFrom(opts);
+            int maxNew = essayMaxNewFrom(opts);
+            int timeoutMs = call.getInt("timeoutMs", 0);
+            // stream：token 走 llmToken，另发 llmSentence/llmParagraph，llmDone 后 resolve 全文
+            boolean stream = call.getBoolean("stream", false);
+            boolean greedy = call.getBoolean("greedy", false);
+            String grammar = resolveGrammar(call);
+            String[] stop = stopsFrom(call);
+            int priority = parsePriority(call, LlamaNative.PRIORITY_BACKGROUND);
 
-            String prompt = buildEssayPrompt(title, wordLimit, lang, hiErr, hiFreq);
-            int maxNew = call.getInt("max_new_tokens", Math.max(256, wordLimit * 3));
-
-            worker.execute(() -> {
-                try {
-                    String text = core.nativeGenerateOnce(prompt, maxNew);
-                    JSObject ret = new JSObject().put("text", text);
-                    call.resolve(ret);
-                } catch (Throwable t) {
-                    call.reject("generateEssay error: " + t.getMessage());
-                }
-            });
+            // 持锁提交并登记，保证 onResult 一定能找到对应的 call
+            long id;
+            synchronized (pendingGenerate) {
+                id = core.nativeSubmitGenerate(prompt, maxNew, timeoutMs, stream, priority, greedy, grammar, stop);
+                if (id >= 0) pendingGenerate.put(id, call);
+            }
+            if (id < 0) {
+                call.reject("grammar parse failed");
+                return;
+            }
+            notifyListeners("llmQueued", new JSObject().put("requestId", id).put("kind", "essay"));
         } catch (Exception e) {
             call.reject("generateEssay error: " + e.getMessage());
         }
     }
 
-    // ---------- 生成中统一收尾 ----------
-    private synchronized void finishStreamingOk() {
-        if (streamingCall != null) {
-            streamingCall.resolve();
-            streamingCall = null;
+    // ---------- @PluginMethod: generateEssays（整班批量）----------
+    /** 一次 generateEssays 的进度；字段都在 pendingGenerate 锁下读写 */
+    private static final class EssayBatch {
+        final PluginCall call;
+        final long[] ids;
+        final String[] texts;
+        final boolean stream;
+        int remaining;
+
+        EssayBatch(PluginCall call, long[] ids, boolean stream) {
+            this.call = call;
+            this.ids = ids;
+            this.texts = new String[ids.length];
+            this.stream = stream;
+            this.remaining = ids.length;
         }
     }
 
-    private synchronized void finishStreamingErr(String msg) {
-        if (streamingCall != null) {
-            streamingCall.reject(msg);
-            streamingCall = null;
+    @PluginMethod
+    public void generateEssays(PluginCall call) {
+        try {
+            JSONArray items = call.getArray("items");
+            if (items == null || items.length() == 0) {
+                call.reject("items required");
+                return;
+            }
+            String[] prompts = new String[items.length()];
+            int[] maxNew = new int[items.length()];
+            for (int i = 0; i < items.length(); i++) {
+                JSObject item = JSObject.fromJSONObject(items.getJSONObject(i));
+                prompts[i] = essayPromptFrom(item);
+                maxNew[i] = essayMaxNewFrom(item);
+            }
+            int timeoutMs = call.getInt("timeoutMs", 0);
+            boolean stream = call.getBoolean("stream", false);
+            int priority = parsePriority(call, LlamaNative.PRIORITY_BACKGROUND);
+            String[] stop = stopsFrom(call);
+
+            // 一次提交、连续排队：native 侧同批接纳，共享的要求段只 prefill 一次再分叉到各序列
+            long[] ids;
+            synchronized (pendingGenerate) {
+                ids = core.nativeSubmitEssays(prompts, maxNew, timeoutMs, stream, priority, stop);
+                EssayBatch batch = new EssayBatch(call, ids, stream);
+                for (long id : ids) pendingBatchItems.put(id, batch);
+            }
+            for (int i = 0; i < ids.length; i++) {
+                notifyListeners("llmQueued", new JSObject().put("requestId", ids[i]).put("kind", "essay").put("index", i));
+            }
+        } catch (Exception e) {
+            call.reject("generateEssays error: " + e.getMessage());
         }
     }
 
+    /** 批量作文的一条完成：发 llmEssayResult，全部完成后 resolve；不是批量条目返回 false */
+    private boolean finishBatchItem(long requestId, String text, boolean fromDone) {
+        EssayBatch batch;
+        int index = -1;
+        boolean last = false;
+        synchronized (pendingGenerate) {
+            batch = pendingBatchItems.get(requestId);
+            if (batch == null) return false;
+            for (int i = 0; i < batch.ids.length; i++) if (batch.ids[i] == requestId) index = i;
+            if (text != null) batch.texts[index] = text;
+            // 流式批次等 onDone（排在该条最后一段 token 之后）再算完成
+            if (batch.stream != fromDone) return true;
+            pendingBatchItems.remove(requestId);
+            last = --batch.remaining == 0;
+        }
+        String result = batch.texts[index] != null ? batch.texts[index] : "";
+        notifyListeners("llmEssayResult", new JSObject().put("index", index).put("requestId", requestId).put("text", result));
+        if (last) {
+            JSArray results = new JSArray();
+            for (int i = 0; i < batch.ids.length; i++) {
+                results.put(new JSObject().put("requestId", batch.ids[i]).put("text", batch.texts[i] != null ? batch.texts[i] : ""));
+            }
+            batch.call.resolve(new JSObject().put("results", results));
+        }
+        return true;
+    }
+
     // ---------- 工具：作文 prompt ----------
+    private static String essayPromptFrom(JSObject o) throws org.json.JSONException {
+        String title = o.getString("title", "An Essay");
+        int wordLimit = o.getInteger("word_limit", 200);
+        String lang = o.getString("lang", "en");
+        org.json.JSONObject cons = o.optJSONObject("constraints");
+
+        java.util.List<String> hiErr = new java.util.ArrayList<>();
+        java.util.List<String> hiFreq = new java.util.ArrayList<>();
+        if (cons != null) {
+            JSONArray a = cons.optJSONArray("high_error_words");
+            if (a != null) for (int i = 0; i < a.length(); i++) hiErr.add(a.getString(i));
+            a = cons.optJSONArray("high_freq_words");
+            if (a != null) for (int i = 0; i < a.length(); i++) hiFreq.add(a.getString(i));
+        }
+        return buildEssayPrompt(title, wordLimit, lang, hiErr, hiFreq);
+    }
+
+    private static int essayMaxNewFrom(JSObject o) {
+        int wordLimit = o.getInteger("word_limit", 200);
+        return o.getInteger("max_new_tokens", Math.max(256, wordLimit * 3));
+    }
+
+    private static final String ESSAY_PROMPT_HEAD =
+        "Write an essay that follows these requirements:\n" +
+        "- Clear structure with introduction, body, and conclusion.\n" +
+        "- Use simple sentences suitable for ESL learners.\n" +
+        "- Avoid overly complex grammar. Keep the vocabulary practical.\n";
+
     private static String buildEssayPrompt(
         String title,
         int limit,
@@ -208,13 +541,8 @@ public class LLMPlugin extends Plugin {
         java.util.List<String> hiErr,
         java.util.List<String> hiFreq
     ) {
-        StringBuilder sb = new StringBuilder();
-        sb.append("Write a ").append(lang).append(" essay.\n");
-        sb.append("Title: ").append(title).append("\n");
-        sb.append("Length: ~").append(Math.max(50, limit)).append(" words.\n");
-        sb.append("Requirements:\n");
-        sb.append("- Clear structure with introduction, body, and conclusion.\n");
-        sb.append("- Use simple sentences suitable for ESL learners.\n");
+        // 固定要求段放最前（与 native kEssayPromptHead 逐字一致），作为共享前缀命中 KV 缓存
+        StringBuilder sb = new StringBuilder(ESSAY_PROMPT_HEAD);
         if (hiErr != null && !hiErr.isEmpty()) {
             sb.append("- Pay attention to commonly mistaken words: ");
             for (int i = 0; i < hiErr.size(); i++) sb.append(hiErr.get(i)).append(i + 1 == hiErr.size() ? ".\n" : ", ");
@@ -223,11 +551,52 @@ public class LLMPlugin extends Plugin {
             sb.append("- Try to include high-frequency vocabulary: ");
             for (int i = 0; i < hiFreq.size(); i++) sb.append(hiFreq.get(i)).append(i + 1 == hiFreq.size() ? ".\n" : ", ");
         }
-        sb.append("- Avoid overly complex grammar. Keep the vocabulary practical.\n");
+        sb.append("Language: ").append(lang).append("\n");
+        sb.append("Title: ").append(title).append("\n");
+        sb.append("Length: ~").append(Math.max(50, limit)).append(" words.\n");
         sb.append("Now produce only the final essay content.\n");
         return sb.toString();
     }
 
+    // ---------- 工具：语法约束（GBNF，与 llama.cpp grammars/ 的写法一致，根规则为 root）----------
+    /** format: "json" —— 任意合法 JSON 对象 */
+    private static final String JSON_GBNF =
+        "root   ::= object\n" +
+        "value  ::= object | array | string | number | (\"true\" | \"false\" | \"null\") ws\n" +
+        "object ::= \"{\" ws ( string \":\" ws value ( \",\" ws string \":\" ws value )* )? \"}\" ws\n" +
+        "array  ::= \"[\" ws ( value ( \",\" ws value )* )? \"]\" ws\n" +
+        "string ::= \"\\\"\" ( [^\"\\\\\\x7F\\x00-\\x1F] | \"\\\\\" ( [\"\\\\/bfnrt] | \"u\" [0-9a-fA-F]{4} ) )* \"\\\"\" ws\n" +
+        "number ::= \"-\"? ( [0-9] | [1-9] [0-9]{0,15} ) ( \".\" [0-9]+ )? ( [eE] [-+]? [0-9] [1-9]? )? ws\n" +
+        "ws     ::= [ \\t\\n]{0,20}\n";
+
+    /** format: "feedback" —— 作文批改：错误片段（字符区间）+ 类型 + 修改建议，外加总评 */
+    private static final String FEEDBACK_GBNF =
+        "root   ::= \"{\" ws \"\\\"errors\\\":\" ws \"[\" ws ( error ( \",\" ws error )* )? \"]\" ws \",\" ws \"\\\"comment\\\":\" ws string \"}\" ws\n" +
+        "error  ::= \"{\" ws \"\\\"start\\\":\" ws int \",\" ws \"\\\"end\\\":\" ws int \",\" ws \"\\\"type\\\":\" ws string \",\" ws \"\\\"suggestion\\\":\" ws string \"}\" ws\n" +
+        "int    ::= [0-9]{1,6} ws\n" +
+        "string ::= \"\\\"\" ( [^\"\\\\\\x7F\\x00-\\x1F] | \"\\\\\" ( [\"\\\\/bfnrt] | \"u\" [0-9a-fA-F]{4} ) )* \"\\\"\" ws\n" +
+        "ws     ::= [ \\t\\n]{0,20}\n";
+
+    /** grammar（自定义 GBNF）优先，其次 format；都没有返回 null（不约束） */
+    private static String resolveGrammar(PluginCall call) {
+        String grammar = call.getString("grammar");
+        if (grammar != null && !grammar.trim().isEmpty()) return grammar;
+        String format = call.getString("format");
+        if (format == null || format.isEmpty() || format.equals("text")) return null;
+        if (format.equals("json")) return JSON_GBNF;
+        if (format.equals("feedback")) return FEEDBACK_GBNF;
+        throw new IllegalArgumentException("unknown format: " + format);
+    }
+
+    /** stop：停止串数组；没传或为空返回 null */
+    private static String[] stopsFrom(PluginCall call) throws org.json.JSONException {
+        JSONArray a = call.getArray("stop");
+        if (a == null || a.length() == 0) return null;
+        String[] out = new String[a.length()];
+        for (int i = 0; i < a.length(); i++) out[i] = a.getString(i);
+        return out;
+    }
+
     // ---------- 资源/下载/校验（与你现有一致） ----------
     private static String ensureBundledModel(Context ctx, String assetRelativePath, String destFileName, String expectedSha256)
         throws Exception {
@@ -268,6 +637,39 @@ public class LLMPlugin extends Plugin {
         return dst.getAbsolutePath();
     }
 
+    private static File sessionFile(Context ctx, String name) throws IOException {
+        if (name == null || name.isEmpty() || !name.matches("[A-Za-z0-9._-]+")) throw new IOException("invalid session name");
+        File d = new File(ctx.getFilesDir(), "sessions");
+        if (!d.exists()) d.mkdirs();
+        return new File(d, name + ".kvs");
+    }
+
+    /** 会话文件按模型 SHA-256 校验；未传 expectedSha256 时计算一次并缓存到旁路文件（按大小+修改时间失效） */
+    private String currentModelSha256() throws Exception {
+        String sha = modelSha256;
+        if (sha != null) return sha;
+        if (modelPath == null) throw new IOException("model not initialized");
+        File model = new File(modelPath);
+        File side = new File(model.getAbsolutePath() + ".sha256");
+        String key = model.length() + ":" + model.lastModified() + ":";
+        if (side.exists()) {
+            try (BufferedReader r = new BufferedReader(new FileReader(side))) {
+                String line = r.readLine();
+                if (line != null && line.startsWith(key) && line.length() == key.length() + 64) sha = line.substring(key.length());
+            }
+        }
+        if (sha == null) {
+            sha = sha256File(model);
+            try (Writer w = new FileWriter(side)) {
+                w.write(key + sha);
+            } catch (IOException ignore) {
+                /* 缓存失败不影响结果 */
+            }
+        }
+        modelSha256 = sha;
+        return sha;
+    }
+
     private static File getModelsDir(Context ctx) {
         File d = new File(ctx.getFilesDir(), "models");
         if (!d.exists()) d.mkdirs();
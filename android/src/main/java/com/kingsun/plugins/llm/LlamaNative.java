@@ -1,47 +1,251 @@
 // android/src/main/java/com/kingsun/plugins/llm/LlamaNative.java
 package com.kingsun.plugins.llm;
 
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+
 public class LlamaNative {
 
+    // JNI_OnLoad 里用 RegisterNatives 注册下面的 native 方法，并启动生成线程
     static {
         System.loadLibrary("llama_jni");
     }
 
     // ---- 静态 native（与上下文/模型相关） ----
-    public static native boolean nativeInit(String modelPath, int nCtx);
+    // nBatch/nUbatch：单次 decode 的逻辑/物理上限（<=0 用默认），nUbatch 决定计算缓冲区大小
+    // keepStandby：额外预热一份备用上下文，上下文损坏时直接换上（多占一份 KV 内存）
+    // prefixCacheMb：固定 prompt 头（system 段/作文要求段）的 KV 快照缓存预算，0 关闭
+    // parallel：同批生成的作文数（>1 时多序列连续批处理，共享 nCtx），1 = 逐个生成
+    public static native boolean nativeInit(
+        String modelPath,
+        int nCtx,
+        int nBatch,
+        int nUbatch,
+        boolean keepStandby,
+        int prefixCacheMb,
+        int parallel
+    );
+
+    // prefill 每块 token 数（不超过 n_batch），0 = 跟随 n_batch
+    public static native void nativeSetPrefillChunk(int chunk);
 
     public static native void nativeFree();
 
+    // 停掉正在跑的请求并取消所有排队请求
     public static native void nativeStop();
 
+    // 按请求 id 取消：排队中的直接收尾，正在跑的在计算图中途打断；id 不存在或已结束返回 false
+    public static native boolean nativeCancel(long requestId);
+
+    // 会话落盘/恢复：seq 0 的 KV + token 历史；文件头带模型 SHA-256/n_ctx/KV 类型，不匹配则拒绝
+    public static native boolean nativeSaveSession(String path, String modelSha256, boolean compress);
+
+    // 返回恢复的 token 数，失败 -1
+    public static native int nativeLoadSession(String path, String modelSha256);
+
+    // 性能统计（JSON 字符串）
+    public static native String nativeGetPerfStats();
+
+    // 流式合并策略：flushMs / flushChars 任一到达即回调，boundary 0=无 1=词 2=句；全 0 每 token 回调一次
+    public static native void nativeSetStreamPolicy(int flushMs, int flushChars, int boundary);
+
+    // 零拷贝 token 流：native 把合并后的 UTF-16 文本直接写进这块 direct ByteBuffer（环形，128 字节头 + 2^n 数据），
+    // 传 null 断开后退回 onNativeToken 回调
+    public static native boolean nativeRingAttach(ByteBuffer ring);
+
+    // 回写已消费位置并等待新数据（最多 timeoutMs），返回 native 已发布的位置
+    public static native long nativeRingAwait(long consumed, int timeoutMs);
+
+    // 发布新的采样参数快照，不等正在进行的生成；生成线程在下一个 token 换上
     public static native void nativeSetSampling(float temp, float topP, int topK, float repeatPenalty, int repeatLastN, float minP);
 
     // 可选：构作文 prompt 的 native 辅助（若在 C++ 里实现了）
     public static native String nativeBuildEssayPrompt(String title, int wordLimit, String lang, String[] hiErr, String[] hiFreq);
 
-    // ---- 实例 native（需要回调到该实例的 onNativeToken/onNativeDone） ----
-    public native void nativeChatStream(String prompt);
+    // ---- 实例 native（异步提交：立即返回请求 id，生成在 native 常驻线程上执行） ----
+    // 多轮会话：传整段对话（roles[i] 对应 contents[i]），native 侧与 KV 历史 diff 后只 prefill 新增部分
+    // timeoutMs：请求截止时间（从提交算起，含排队；<=0 不限），到期与 nativeStop 一样会在计算图中途打断
+    // token 按 nativeSetStreamPolicy 合并后写进 token 环（未挂环时经 onNativeToken 回调），结束时 onDone(id)
+    // grammar：GBNF 文本（根规则 root），输出保证符合该语法；null = 不约束；
+    // 语法在提交时编译，解析失败（或模型未加载）时不入队、返回 -1
+    // stop：停止串（可跨 token），命中即结束，停止串本身不输出；null = 只在结束符（EOG）处停
+    // maxNewTokens：回答 token 上限（推理段不计），<=0 用默认 512
+    // thinkMode：Qwen3 推理段（<think>…</think>）的处理，THINK_*；thinkBudget：推理 token 上限，0 = 与 maxNewTokens 相同
+    public native long nativeSubmitChat(String[] roles, String[] contents, int maxNewTokens, int timeoutMs, int priority,
+                                        String grammar, String[] stop, int thinkMode, int thinkBudget);
+
+    // 结束时 onNativeResult(id, text)；stream=true 时 token 与 chat 走同一条流，
+    // 另按整句/整段回调 onSegment，全文回调之后再 onDone(id)
+    // greedy=true：确定性解码（惩罚后直接取 argmax，不走抽样），用于批改/纠错
+    // grammar/stop 同 nativeSubmitChat；带语法的请求不进连续批处理
+    public native long nativeSubmitGenerate(String prompt, int maxNewTokens, int timeoutMs, boolean stream, int priority, boolean greedy, String grammar, String[] stop);
+
+    // 批量作文：一次连续入队，parallel > 1 时同批 decode，共同的要求段只 prefill 一次再分叉到各序列；
+    // 每条的回调与 nativeSubmitGenerate 相同，返回各条的请求 id（与 prompts 一一对应）；stop 对每条生效
+    public native long[] nativeSubmitEssays(String[] prompts, int[] maxNewTokens, int timeoutMs, boolean stream, int priority, String[] stop);
+
+    // 调度优先级：交互请求排在后台请求前面，后台 Generate 会在 token 边界让位给新来的交互请求
+    public static final int PRIORITY_INTERACTIVE = 0;
+    public static final int PRIORITY_BACKGROUND = 1;
 
-    public native String nativeGenerateOnce(String prompt, int maxNewTokens);
+    // 思考模式：INLINE 推理段原样混在 token 流里；OFF 模板预填空推理段、直接回答；
+    // SEPARATE 推理段走 onThinking；HIDDEN 推理段丢弃
+    public static final int THINK_INLINE = 0;
+    public static final int THINK_OFF = 1;
+    public static final int THINK_SEPARATE = 2;
+    public static final int THINK_HIDDEN = 3;
 
-    // ---- 回调桥 ----
+    // ---- 回调桥（native 生成线程或 token 环消费线程上调用） ----
     public interface Listener {
-        void onToken(String token);
-        void onDone();
+        // text 为合并后的文本，nTokens 为其中的 token 数
+        void onToken(String text, int nTokens);
+        void onDone(long requestId);
+
+        // 一次性生成的结果
+        default void onResult(long requestId, String text) {}
+
+        // 之后的 onToken/onSegment 属于 requestId（请求开始或被抢占后续跑时）
+        default void onBegin(long requestId) {}
+
+        // prefill 进度（每块一次）
+        default void onPrefillProgress(long requestId, int done, int total) {}
+
+        // 流式作文的整句（kind = SEGMENT_SENTENCE）/整段（SEGMENT_PARAGRAPH），index 从 0 计
+        default void onSegment(int kind, int index, String text) {}
+
+        // THINK_SEPARATE 时的推理段文本（合并策略同 onToken，标签已去掉）
+        default void onThinking(String text, int nTokens) {}
+    }
+
+    public static final int SEGMENT_SENTENCE = 3;
+    public static final int SEGMENT_PARAGRAPH = 4;
+
+    // native 侧只有一个生成线程和一个 token 环，进程内只用一个实例（见 attach）
+    private static LlamaNative instance;
+
+    private volatile Listener listener;
+
+    private LlamaNative() {}
+
+    // 取进程内唯一的实例并设置回调；再次调用时新的 Listener 替换旧的（之后的事件都发给它）
+    public static synchronized LlamaNative attach(Listener l) {
+        if (instance == null) instance = new LlamaNative();
+        instance.listener = l;
+        instance.startStreamRing();
+        return instance;
     }
 
-    private Listener listener;
+    // ---- 零拷贝 token 环的消费端（StreamRingReader，在 llm-stream 线程上分发） ----
+    private static final int RING_CAPACITY = 64 * 1024;
+
+    private static final StreamRingReader.Source NATIVE_RING = new StreamRingReader.Source() {
+        @Override
+        public long await(long consumed, int timeoutMs) {
+            return nativeRingAwait(consumed, timeoutMs);
+        }
+
+        @Override
+        public void detach() {
+            nativeRingAttach(null);
+        }
+    };
+
+    // 环记录与 JNI 回调走同一组 onNative* 入口，分发给当前 Listener
+    private final Listener forward = new Listener() {
+        @Override
+        public void onToken(String text, int nTokens) {
+            onNativeToken(text, nTokens);
+        }
+
+        @Override
+        public void onDone(long requestId) {
+            onNativeDone(requestId);
+        }
+
+        @Override
+        public void onBegin(long requestId) {
+            onNativeBegin(requestId);
+        }
+
+        @Override
+        public void onSegment(int kind, int index, String text) {
+            onNativeSegment(kind, index, text);
+        }
+
+        @Override
+        public void onThinking(String text, int nTokens) {
+            onNativeThought(text, nTokens);
+        }
+    };
+
+    private ByteBuffer ringBuffer;
+    private StreamRingReader ringReader;
+    private Thread ringThread;
+    private long ringDispatchErrors;   // 已结束的消费线程累计的 Listener 异常数
+
+    // 挂上环并启动消费线程；已在运行时什么也不做。挂载失败则继续走 onNativeToken 回调
+    public synchronized void startStreamRing() {
+        if (ringThread != null) return;
+        if (ringBuffer == null) {
+            ringBuffer = ByteBuffer.allocateDirect(StreamRingReader.HEADER + RING_CAPACITY).order(ByteOrder.nativeOrder());
+        }
+        if (!nativeRingAttach(ringBuffer)) return;
+        ringReader = new StreamRingReader(ringBuffer, RING_CAPACITY, NATIVE_RING, forward);
+        ringThread = new Thread(ringReader, "llm-stream");
+        ringThread.setDaemon(true);
+        ringThread.start();
+    }
+
+    // 读完环里已有的记录后断开（nativeRingAttach(null)）并结束消费线程，之后 native 改走回调；
+    // 应在生成线程空闲后调用（nativeFree 之后），否则断开瞬间正在写的文本会经回调先于环里剩下的记录到达
+    public synchronized void stopStreamRing() {
+        if (ringThread == null) return;
+        ringReader.stop();
+        boolean interrupted = false;
+        while (ringThread.isAlive()) {
+            try {
+                ringThread.join();
+            } catch (InterruptedException e) {
+                interrupted = true;
+            }
+        }
+        if (interrupted) Thread.currentThread().interrupt();
+        ringDispatchErrors += ringReader.dispatchErrors();
+        ringThread = null;
+        ringReader = null;
+    }
+
+    // token 环分发时 Listener 抛出的异常累计数（含当前消费线程），供 getPerfStats
+    public synchronized long streamDispatchErrors() {
+        return ringDispatchErrors + (ringReader != null ? ringReader.dispatchErrors() : 0);
+    }
+
+    // 供 JNI 回调（名字与签名必须与 C++ JNI_OnLoad 里缓存的 GetMethodID 一致）
+    public void onNativeToken(String text, int nTokens) {
+        if (listener != null) listener.onToken(text, nTokens);
+    }
+
+    public void onNativeThought(String text, int nTokens) {
+        if (listener != null) listener.onThinking(text, nTokens);
+    }
+
+    public void onNativeBegin(long requestId) {
+        if (listener != null) listener.onBegin(requestId);
+    }
+
+    public void onNativeProgress(long requestId, int done, int total) {
+        if (listener != null) listener.onPrefillProgress(requestId, done, total);
+    }
 
-    public LlamaNative(Listener l) {
-        this.listener = l;
+    public void onNativeDone(long requestId) {
+        if (listener != null) listener.onDone(requestId);
     }
 
-    // 供 JNI 回调（名字与签名必须与 C++ 里的 GetMethodID 一致）
-    public void onNativeToken(String token) {
-        if (listener != null) listener.onToken(token);
+    public void onNativeResult(long requestId, String text) {
+        if (listener != null) listener.onResult(requestId, text);
     }
 
-    public void onNativeDone() {
-        if (listener != null) listener.onDone();
+    public void onNativeSegment(int kind, int index, String text) {
+        if (listener != null) listener.onSegment(kind, index, text);
     }
 }
@@ -0,0 +1,117 @@
+// android/src/main/java/com/kingsun/plugins/llm/StreamRingReader.java
+package com.kingsun.plugins.llm;
+
+import android.util.Log;
+import java.nio.ByteBuffer;
+
+/**
+ * 零拷贝 token 环的消费端：在自己的线程上读 native 写进 direct ByteBuffer 的记录并分发给 Listener。
+ * 记录布局与 llama_jni.cpp 一致：128 字节头（[0,8) head），之后 2^n 字节数据；
+ * 每条 {int kind, int units, long value} + UTF-16，16 字节对齐，kind 0 = 填充到环尾。
+ */
+final class StreamRingReader implements Runnable {
+
+    /** 生产者一侧：native 实现为 nativeRingAwait / nativeRingAttach(null)，单测里换成假的生产者 */
+    interface Source {
+        /** 回写已消费位置并等待新数据（最多 timeoutMs），返回已发布的位置 */
+        long await(long consumed, int timeoutMs);
+
+        /** 断开：之后生产者不再写环（改走回调） */
+        void detach();
+    }
+
+    static final int HEADER = 128;
+    static final int REC_PAD = 0;
+    static final int REC_TEXT = 1;
+    static final int REC_END = 2;
+    static final int REC_SENTENCE = LlamaNative.SEGMENT_SENTENCE;
+    static final int REC_PARAGRAPH = LlamaNative.SEGMENT_PARAGRAPH;
+    static final int REC_BEGIN = 5;
+    static final int REC_THOUGHT = 6;
+
+    private static final int AWAIT_MS = 200;
+    private static final String TAG = "LLMStream";
+
+    private final ByteBuffer ring;
+    private final int capacity;
+    private final Source source;
+    private final LlamaNative.Listener listener;
+    private volatile boolean stopping;
+    private char[] chars = new char[512];
+    private long tail;
+    private volatile long dispatchErrors;
+
+    StreamRingReader(ByteBuffer ring, int capacity, Source source, LlamaNative.Listener listener) {
+        this.ring = ring;
+        this.capacity = capacity;
+        this.source = source;
+        this.listener = listener;
+    }
+
+    /** 请求退出：读完已发布的记录、断开，再读完断开前最后写入的部分后 run() 返回 */
+    void stop() {
+        stopping = true;
+    }
+
+    /** 已消费的位置（单测用） */
+    long consumed() {
+        return tail;
+    }
+
+    /** 文本暂存的容量，不超过单条记录的最大长度（单测用） */
+    int scratchChars() {
+        return chars.length;
+    }
+
+    /** Listener 抛出的异常个数；异常不会终止消费线程，否则生产者会一直等空间（可从其他线程读） */
+    long dispatchErrors() {
+        return dispatchErrors;
+    }
+
+    @Override
+    public void run() {
+        while (!stopping) {
+            drainTo(source.await(tail, AWAIT_MS));
+        }
+        drainTo(source.await(tail, 0));
+        source.detach();
+        // 断开后生产者不再写，head 不再变化；把断开前刚写进的记录读完
+        drainTo(ring.getLong(0));
+    }
+
+    private void drainTo(long head) {
+        while (tail < head) {
+            int off = HEADER + (int) (tail & (capacity - 1));
+            int kind = ring.getInt(off);
+            if (kind == REC_PAD) {
+                tail += capacity - (tail & (capacity - 1));
+                continue;
+            }
+            int units = ring.getInt(off + 4);
+            long value = ring.getLong(off + 8);
+            try {
+                dispatch(kind, off, units, value);
+            } catch (RuntimeException e) {
+                long n = ++dispatchErrors;
+                // 第 1、2、4、8… 次才打日志：首个异常带堆栈，Listener 每个 token 都抛时也不刷屏
+                if ((n & (n - 1)) == 0) Log.w(TAG, "listener threw on record kind " + kind + " (" + n + " so far)", e);
+            }
+            tail += (16 + 2L * units + 15) & ~15L;
+        }
+    }
+
+    private void dispatch(int kind, int off, int units, long value) {
+        if (kind == REC_TEXT || kind == REC_SENTENCE || kind == REC_PARAGRAPH || kind == REC_THOUGHT) {
+            if (chars.length < units) chars = new char[units];
+            for (int i = 0; i < units; i++) chars[i] = ring.getChar(off + 16 + 2 * i);
+            String text = new String(chars, 0, units);
+            if (kind == REC_TEXT) listener.onToken(text, (int) value);
+            else if (kind == REC_THOUGHT) listener.onThinking(text, (int) value);
+            else listener.onSegment(kind, (int) value, text);
+        } else if (kind == REC_END) {
+            listener.onDone(value);
+        } else if (kind == REC_BEGIN) {
+            listener.onBegin(value);
+        }
+    }
+}
@@ -0,0 +1,72 @@
+// android/src/test/cpp/bench_utf8_stream.cpp
+// 流式 UTF-8 -> UTF-16：旧的 pending 重解 vs Utf8Stream。
+// 语料为中英混排（模型输出的典型形态），按 token 大小（1~6 字节）切块喂入
+#include <random>
+#include <string>
+#include <vector>
+
+#include "test_util.h"
+#include "utf8_reference.h"
+#include "utf8_stream.h"
+
+namespace {
+
+std::string make_corpus(size_t bytes, int ascii_pct) {
+    static const char* const kCjk[] = {"我", "们", "今", "天", "学", "习", "了", "新", "的", "知", "识", "，", "。"};
+    static const char* const kWords[] = {"the ", "student ", "wrote ", "an ", "essay ", "about ", "school, ", "life. "};
+    std::mt19937 rng(7);
+    std::string s;
+    while (s.size() < bytes) {
+        if ((int)(rng() % 100) < ascii_pct) s += kWords[rng() % 8];
+        else s += kCjk[rng() % 13];
+    }
+    return s;
+}
+
+std::vector<size_t> token_cuts(const std::string& s) {
+    std::mt19937 rng(11);
+    std::vector<size_t> cuts;
+    for (size_t p = 1 + rng() % 6; p < s.size(); p += 1 + rng() % 6) cuts.push_back(p);
+    cuts.push_back(s.size());
+    return cuts;
+}
+
+template <class Dec>
+double run(const std::string& s, const std::vector<size_t>& cuts, int reps) {
+    std::u16string out;
+    out.reserve(s.size() + 16);
+    double best = 1e30;
+    for (int r = 0; r < reps; ++r) {
+        Dec dec;
+        out.clear();
+        const long long t0 = now_ns();
+        size_t prev = 0;
+        for (size_t c : cuts) {
+            dec.feed(s.data() + prev, c - prev, out);
+            prev = c;
+        }
+        const long long t1 = now_ns();
+        keep(out);
+        best = std::min(best, (double)(t1 - t0) / (double)s.size());
+    }
+    return best;
+}
+
+}  // namespace
+
+int main() {
+    const int reps = 20;
+    for (int ascii_pct : {0, 50, 100}) {
+        const std::string s = make_corpus(1 << 20, ascii_pct);
+        const std::vector<size_t> tok = token_cuts(s);
+        const std::vector<size_t> whole = {s.size()};
+        const double ref_tok = run<Utf8Reference>(s, tok, reps);
+        const double new_tok = run<Utf8Stream>(s, tok, reps);
+        const double ref_all = run<Utf8Reference>(s, whole, reps);
+        const double new_all = run<Utf8Stream>(s, whole, reps);
+        printf("ascii %3d%%  token chunks: ref %.2f ns/B  stream %.2f ns/B (%.1fx)   "
+               "one chunk: ref %.2f ns/B  stream %.2f ns/B (%.1fx)\n",
+               ascii_pct, ref_tok, new_tok, ref_tok / new_tok, ref_all, new_all, ref_all / new_all);
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+// android/src/test/cpp/sampler_reference.h
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "fused_sampler.h"
+
+// ===== 参考实现：按 llama.cpp 采样链的语义逐级处理整表 =====
+// penalties → top_k → min_p → top_p → temp → dist（与 make_sampler_chain 的 LLM_SAMPLER_CHAIN 分支同序）。
+// 不抽样，直接给出最后一级之前的精确分布，FusedSampler 的经验分布与它比较
+class ChainReference {
+public:
+    explicit ChainReference(const FusedSamplerParams& p) : p_(p) {}
+
+    void accept(llama_token t) {
+        if (p_.penalty_last_n <= 0) return;
+        hist_.push_back(t);
+        ++counts_[t];
+        if ((int32_t)hist_.size() > p_.penalty_last_n) {
+            const llama_token old = hist_.front();
+            hist_.pop_front();
+            if (--counts_[old] == 0) counts_.erase(old);
+        }
+    }
+
+    // (token, 概率)，按 logit 降序；temp <= 0 时只有惩罚后的 argmax 一项
+    std::vector<std::pair<llama_token, double>> distribution(const float* logits, int32_t n) const {
+        std::vector<llama_token_data> cur((size_t)n);
+        for (int32_t i = 0; i < n; ++i) cur[(size_t)i] = {i, logits[i], 0.0f};
+        // penalties
+        if (p_.penalty_repeat != 1.0f) {
+            for (auto& c : cur) {
+                if (!counts_.count(c.id)) continue;
+                c.logit = c.logit <= 0 ? c.logit * p_.penalty_repeat : c.logit / p_.penalty_repeat;
+            }
+        }
+        auto desc = [](const llama_token_data& a, const llama_token_data& b) {
+            return a.logit > b.logit || (a.logit == b.logit && a.id < b.id);
+        };
+        if (!(p_.temp > 0.0f)) return {{std::min_element(cur.begin(), cur.end(), desc)->id, 1.0}};
+        // top_k（llama.cpp 同样只做部分排序）
+        if (p_.top_k > 0 && (size_t)p_.top_k < cur.size()) {
+            std::partial_sort(cur.begin(), cur.begin() + p_.top_k, cur.end(), desc);
+            cur.resize((size_t)p_.top_k);
+        } else {
+            std::sort(cur.begin(), cur.end(), desc);
+        }
+        // min_p
+        if (p_.min_p > 0.0f && p_.min_p <= 1.0f) {
+            const float thr = cur[0].logit + logf(p_.min_p);
+            size_t i = 1;
+            for (; i < cur.size(); ++i) if (cur[i].logit < thr && i >= p_.min_keep) break;
+            cur.resize(i);
+        }
+        // top_p
+        if (p_.top_p > 0.0f && p_.top_p < 1.0f) {
+            double sum = 0;
+            for (const auto& c : cur) sum += exp((double)c.logit - cur[0].logit);
+            double cum = 0;
+            for (size_t i = 0; i < cur.size(); ++i) {
+                cum += exp((double)cur[i].logit - cur[0].logit) / sum;
+                if (cum >= p_.top_p && i + 1 >= p_.min_keep) { cur.resize(i + 1); break; }
+            }
+        }
+        // temp + softmax
+        std::vector<std::pair<llama_token, double>> out;
+        double sum = 0;
+        for (const auto& c : cur) sum += exp(((double)c.logit - cur[0].logit) / p_.temp);
+        for (const auto& c : cur) out.push_back({c.id, exp(((double)c.logit - cur[0].logit) / p_.temp) / sum});
+        return out;
+    }
+
+    // 按分布抽一个（基准里当作“逐级链”的代价参照）
+    template <class Rng>
+    llama_token sample(const float* logits, int32_t n, Rng& rng) const {
+        const auto d = distribution(logits, n);
+        double r = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        for (const auto& e : d) {
+            r -= e.second;
+            if (r < 0) return e.first;
+        }
+        return d.back().first;
+    }
+
+private:
+    FusedSamplerParams           p_;
+    std::deque<llama_token>      hist_;
+    std::map<llama_token, int>   counts_;
+};
@@ -0,0 +1,201 @@
+// android/src/test/cpp/test_fused_sampler.cpp
+// FusedSampler 与逐级采样链的等价性：
+// - 确定性模式（temp = 0）逐 token 完全一致，顺带把惩罚计数表的增删跑上几千轮；
+// - 随机模式下抽样的经验分布与链的精确分布比较（全变差距离），且不出现链里概率为 0 的 token。
+// 链默认用 sampler_reference.h；配置了 LLAMA_HOST_LIB 时再与真正的 llama_sampler_chain 比一遍
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "sampler_reference.h"
+#include "test_util.h"
+
+namespace {
+
+using Dist = std::vector<std::pair<llama_token, double>>;
+
+std::vector<float> make_logits(int32_t n, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> nd(0.0f, 2.5f);
+    std::vector<float> lg((size_t)n);
+    for (auto& x : lg) x = nd(rng);
+    // 少数尖峰，接近真实模型输出
+    for (int i = 0; i < 30; ++i) lg[rng() % (uint32_t)n] += 9.0f - (float)i * 0.2f;
+    return lg;
+}
+
+// 经验分布与精确分布的全变差距离；support_ok = 抽到的 token 都在精确分布里
+double tv_distance(const std::unordered_map<llama_token, int>& hits, int samples, const Dist& exact, bool& support_ok) {
+    std::unordered_map<llama_token, double> p;
+    for (const auto& e : exact) p[e.first] = e.second;
+    support_ok = true;
+    double tv = 0;
+    for (const auto& h : hits) {
+        auto it = p.find(h.first);
+        if (it == p.end() || it->second < 1e-9) support_ok = false;
+        tv += fabs((double)h.second / samples - (it == p.end() ? 0.0 : it->second));
+    }
+    for (const auto& e : exact) if (!hits.count(e.first)) tv += e.second;
+    return tv / 2;
+}
+
+template <class ExactFn>
+void check_distribution(const char* name, const FusedSamplerParams& p, int32_t n_vocab, ExactFn&& exact_of) {
+    const std::vector<float> lg = make_logits(n_vocab, 7);
+    FusedSampler fs(p);
+    ChainReference ref(p);
+    std::mt19937 rng(99);
+    // 窗口里放一半“最高分的 token”，让惩罚真正改变排名
+    const llama_token top = simd_argmax(lg.data(), n_vocab);
+    for (int i = 0; i < 300; ++i) {
+        const llama_token t = (i % 2 == 0) ? (llama_token)((top + i / 2 % 7) % n_vocab) : (llama_token)(rng() % (uint32_t)n_vocab);
+        fs.accept(t);
+        ref.accept(t);
+        exact_of.accept(t);
+    }
+    const Dist exact = exact_of.distribution(lg.data(), n_vocab);
+    const int samples = 20000;
+    std::unordered_map<llama_token, int> hits;
+    for (int i = 0; i < samples; ++i) ++hits[fs.sample(lg.data(), n_vocab)];
+    bool support_ok = false;
+    const double tv = tv_distance(hits, samples, exact, support_ok);
+    if (!support_ok || tv > 0.04) {
+        fprintf(stderr, "%s: support %zu vs %zu, TV %.4f\n", name, hits.size(), exact.size(), tv);
+    }
+    EXPECT_TRUE(support_ok);
+    EXPECT_TRUE(tv <= 0.04);
+}
+
+struct ReferenceChain {
+    ChainReference r;
+    explicit ReferenceChain(const FusedSamplerParams& p) : r(p) {}
+    void accept(llama_token t) { r.accept(t); }
+    Dist distribution(const float* lg, int32_t n) const { return r.distribution(lg, n); }
+};
+
+#ifdef LLM_TEST_LLAMA_CHAIN
+// 与 llama_jni.cpp make_sampler_chain 的 LLM_SAMPLER_CHAIN 分支相同，只是不挂最后的 dist/greedy
+struct LlamaChain {
+    llama_sampler* chain = nullptr;
+    bool greedy = false;
+
+    explicit LlamaChain(const FusedSamplerParams& p) : greedy(!(p.temp > 0.0f)) {
+        chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+        llama_sampler_chain_add(chain, llama_sampler_init_penalties(p.penalty_last_n, p.penalty_repeat, 0.0f, 0.0f));
+        if (p.top_k > 0) llama_sampler_chain_add(chain, llama_sampler_init_top_k(p.top_k));
+        if (p.min_p > 0.0f) llama_sampler_chain_add(chain, llama_sampler_init_min_p(p.min_p, p.min_keep));
+        if (p.top_p > 0.0f && p.top_p < 1.0f) llama_sampler_chain_add(chain, llama_sampler_init_top_p(p.top_p, p.min_keep));
+        if (p.temp > 0.0f) llama_sampler_chain_add(chain, llama_sampler_init_temp(p.temp));
+    }
+    ~LlamaChain() { llama_sampler_free(chain); }
+    LlamaChain(const LlamaChain&) = delete;
+    LlamaChain& operator=(const LlamaChain&) = delete;
+
+    void accept(llama_token t) { llama_sampler_accept(chain, t); }
+
+    Dist distribution(const float* lg, int32_t n) const {
+        std::vector<llama_token_data> cur((size_t)n);
+        for (int32_t i = 0; i < n; ++i) cur[(size_t)i] = {i, lg[i], 0.0f};
+        llama_token_data_array arr = {cur.data(), (size_t)n, -1, false};
+        llama_sampler_apply(chain, &arr);
+        float mx = -INFINITY;
+        size_t best = 0;
+        for (size_t i = 0; i < arr.size; ++i) if (arr.data[i].logit > mx) { mx = arr.data[i].logit; best = i; }
+        if (greedy) return {{arr.data[best].id, 1.0}};
+        double sum = 0;
+        for (size_t i = 0; i < arr.size; ++i) sum += exp((double)arr.data[i].logit - mx);
+        Dist out;
+        for (size_t i = 0; i < arr.size; ++i) out.push_back({arr.data[i].id, exp((double)arr.data[i].logit - mx) / sum});
+        return out;
+    }
+};
+#endif
+
+void test_greedy_exact() {
+    // 小词表、短窗口、重惩罚：每步的 argmax 都取决于计数表是否准确
+    for (int32_t n_vocab : {64, 1000, 151936}) {
+        FusedSamplerParams p;
+        p.temp = 0.0f;
+        p.penalty_last_n = n_vocab == 64 ? 16 : 64;
+        p.penalty_repeat = 3.0f;
+        FusedSampler fs(p);
+        ChainReference ref(p);
+        std::mt19937 rng(5);
+        std::normal_distribution<float> nd(0.0f, 1.0f);
+        std::vector<float> lg((size_t)n_vocab);
+        const int steps = n_vocab > 10000 ? 300 : 3000;
+        for (int step = 0; step < steps; ++step) {
+            for (auto& x : lg) x = nd(rng);
+            const llama_token a = fs.sample(lg.data(), n_vocab);
+            const llama_token b = ref.distribution(lg.data(), n_vocab)[0].first;
+            if (a != b) {
+                fprintf(stderr, "greedy n_vocab=%d step=%d: fused %d, chain %d\n", n_vocab, step, a, b);
+                EXPECT_EQ(a, b);
+                break;
+            }
+            // 一半接受采到的，一半随机，窗口里不断有 token 进出
+            const llama_token t = step % 2 ? a : (llama_token)(rng() % (uint32_t)n_vocab);
+            fs.accept(t);
+            ref.accept(t);
+        }
+    }
+}
+
+void test_reset_clears_window() {
+    FusedSamplerParams p;
+    p.temp = 0.0f;
+    p.penalty_repeat = 100.0f;
+    FusedSampler fs(p);
+    std::vector<float> lg(100, 0.0f);
+    lg[42] = 5.0f;
+    lg[7] = 4.0f;
+    fs.accept(42);
+    EXPECT_EQ(fs.sample(lg.data(), 100), 7);
+    fs.reset();
+    EXPECT_EQ(fs.sample(lg.data(), 100), 42);
+}
+
+template <class Chain>
+void test_distributions(const char* chain_name) {
+    struct Case {
+        const char* name;
+        int32_t n_vocab;
+        FusedSamplerParams p;
+    };
+    std::vector<Case> cases;
+    auto add = [&](const char* name, int32_t n, auto&& edit) {
+        Case c{name, n, FusedSamplerParams{}};
+        c.p.seed = 42;
+        edit(c.p);
+        cases.push_back(c);
+    };
+    add("default", 151936, [](FusedSamplerParams&) {});
+    add("default-small", 5000, [](FusedSamplerParams&) {});
+    add("no-top-k", 5000, [](FusedSamplerParams& p) { p.top_k = 0; });
+    add("no-top-k-no-min-p", 2000, [](FusedSamplerParams& p) { p.top_k = 0; p.min_p = 0.0f; });
+    add("top-p-off", 5000, [](FusedSamplerParams& p) { p.top_p = 1.0f; });
+    add("min-p-off", 5000, [](FusedSamplerParams& p) { p.min_p = 0.0f; });
+    add("hot", 5000, [](FusedSamplerParams& p) { p.temp = 1.5f; p.top_k = 100; });
+    add("cold", 5000, [](FusedSamplerParams& p) { p.temp = 0.3f; });
+    add("no-penalty", 5000, [](FusedSamplerParams& p) { p.penalty_repeat = 1.0f; });
+    add("no-window", 5000, [](FusedSamplerParams& p) { p.penalty_last_n = 0; });
+    add("short-window", 5000, [](FusedSamplerParams& p) { p.penalty_last_n = 8; p.penalty_repeat = 2.0f; });
+    add("min-keep", 5000, [](FusedSamplerParams& p) { p.min_keep = 5; p.top_p = 0.3f; });
+    add("k-1", 5000, [](FusedSamplerParams& p) { p.top_k = 1; });
+    for (const Case& c : cases) {
+        Chain chain{c.p};
+        check_distribution((std::string(chain_name) + "/" + c.name).c_str(), c.p, c.n_vocab, chain);
+    }
+}
+
+}  // namespace
+
+int main() {
+    test_greedy_exact();
+    test_reset_clears_window();
+    test_distributions<ReferenceChain>("reference");
+#ifdef LLM_TEST_LLAMA_CHAIN
+    test_distributions<LlamaChain>("llama");
+#endif
+    return test_result();
+}
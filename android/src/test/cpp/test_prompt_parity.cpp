@@ -0,0 +1,100 @@
+// android/src/test/cpp/test_prompt_parity.cpp
+// 作文 prompt 在 Java（LLMPlugin.buildEssayPrompt，逐条生成）与 native（build_essay_prompt，批量作文）各拼一份，
+// 共享前缀缓存要求两边逐字节一致：直接从两份源码里取出字符串字面量对比
+#include "test_util.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef LLM_JNI_SOURCE
+#error "LLM_JNI_SOURCE must point to llama_jni.cpp"
+#endif
+#ifndef LLM_PLUGIN_SOURCE
+#error "LLM_PLUGIN_SOURCE must point to LLMPlugin.java"
+#endif
+
+static std::string read_file(const char* path) {
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+// 从 i（指向开引号）读一个 "..." 字面量，返回解转义后的内容，i 移到闭引号之后
+static std::string read_literal(const std::string& src, size_t& i) {
+    std::string out;
+    for (++i; i < src.size() && src[i] != '"'; ++i) {
+        if (src[i] != '\\') { out += src[i]; continue; }
+        switch (src[++i]) {
+            case 'n':  out += '\n'; break;
+            case 't':  out += '\t'; break;
+            case '"':  out += '"';  break;
+            case '\\': out += '\\'; break;
+            default:   out += '\\'; out += src[i]; break;
+        }
+    }
+    ++i;
+    return out;
+}
+
+// [from, to) 内按出现顺序的所有字符串字面量（跳过字符字面量与 // 注释）
+static std::vector<std::string> literals(const std::string& src, size_t from, size_t to) {
+    std::vector<std::string> out;
+    for (size_t i = from; i < to;) {
+        if (src.compare(i, 2, "//") == 0) { i = src.find('\n', i); continue; }
+        if (src[i] == '\'') { i = src.find('\'', i + (src[i + 1] == '\\' ? 3 : 2)) + 1; continue; }
+        if (src[i] == '"') { out.push_back(read_literal(src, i)); continue; }
+        ++i;
+    }
+    return out;
+}
+
+// 常量定义：name 之后到 ';' 之间的字面量拼起来（C++ 相邻字面量与 Java 的 + 都是拼接）
+static std::string constant(const std::string& src, const std::string& name) {
+    size_t at = src.find(name + " =");
+    if (at == std::string::npos) return "<" + name + " not found>";
+    size_t end = src.find(';', at);
+    std::string s;
+    for (auto& l : literals(src, at, end)) s += l;
+    return s;
+}
+
+// 函数体：signature 之后第一个 '{' 到与之配对的 '}'（按字面量跳过其中的括号）
+static std::vector<std::string> body_literals(const std::string& src, const std::string& signature) {
+    size_t at = src.find(signature);
+    if (at == std::string::npos) return {"<" + signature + " not found>"};
+    size_t open = src.find('{', at), i = open + 1;
+    for (int depth = 1; i < src.size() && depth > 0; ++i) {
+        if (src[i] == '"') { read_literal(src, i); --i; continue; }
+        if (src[i] == '{') ++depth;
+        if (src[i] == '}') --depth;
+    }
+    return literals(src, open, i);
+}
+
+int main() {
+    const std::string jni = read_file(LLM_JNI_SOURCE);
+    const std::string java = read_file(LLM_PLUGIN_SOURCE);
+    ASSERT_TRUE(!jni.empty() && !java.empty());
+
+    const std::string head_cpp = constant(jni, "kEssayPromptHead");
+    const std::string head_java = constant(java, "ESSAY_PROMPT_HEAD");
+    EXPECT_TRUE(head_cpp.size() > 64);
+    EXPECT_EQ(head_cpp, head_java);
+
+    // 要求段之后逐项拼接的文字（各约束、Language/Title/Length 行）也要一致
+    const auto tail_cpp = body_literals(jni, "static std::string build_essay_prompt(");
+    const auto tail_java = body_literals(java, "private static String buildEssayPrompt(");
+    EXPECT_TRUE(tail_cpp.size() >= 8);
+    EXPECT_TRUE(tail_cpp == tail_java);
+    if (tail_cpp != tail_java) {
+        for (size_t i = 0; i < std::max(tail_cpp.size(), tail_java.size()); ++i) {
+            printf("  [%zu] cpp=\"%s\" java=\"%s\"\n", i, i < tail_cpp.size() ? tail_cpp[i].c_str() : "",
+                   i < tail_java.size() ? tail_java[i].c_str() : "");
+        }
+    }
+    return test_result();
+}
@@ -0,0 +1,153 @@
+// android/src/test/cpp/test_sampling_rcu.cpp
+// setSampling 的发布路径（SnapshotRcu）：
+// - 生成线程整段持有“g_mutex”逐 token 解码时，发布不等它，且新参数在下一个 token 生效；
+// - 多个写者与读者并发时读不到撕裂的快照、版本单调，旧快照能被回收；
+// - 没有读者（生成线程空闲）时反复发布，旧快照不会越积越多
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "sampling_rcu.h"
+#include "test_util.h"
+
+namespace {
+
+struct Params {
+    float    temp  = 0.8f;
+    int      top_k = 40;
+    uint64_t check = 0;   // 写者填 temp/top_k 的函数值，读者据此判断是否撕裂
+    uint64_t version = 0;
+};
+
+void test_defaults() {
+    SnapshotRcu<Params> rcu;
+    EXPECT_EQ(rcu.version(), 0u);
+    EXPECT_EQ(rcu.snapshot().top_k, 40);
+    Params p;
+    p.top_k = 7;
+    rcu.publish(p);
+    EXPECT_EQ(rcu.version(), 1u);
+    const Params v = rcu.snapshot();
+    EXPECT_EQ(v.top_k, 7);
+    EXPECT_EQ(v.version, 1u);
+}
+
+// 生成线程持锁跑 kTokens 个 token（每个 kTokenMs），期间另一线程发布若干次
+void test_publish_does_not_wait_for_generation() {
+    constexpr int kTokens  = 120;
+    constexpr int kTokenMs = 3;
+    SnapshotRcu<Params> rcu;
+    std::mutex gen_mutex;                      // 相当于 g_mutex：生成期间一直被持有
+    std::atomic<int> token{-1};
+    std::vector<int> seen_at(64, -1);          // 版本 v 第一次被生成线程用上时的 token 序号
+
+    std::thread gen([&] {
+        std::lock_guard<std::mutex> lk(gen_mutex);
+        uint64_t cur = 0;
+        for (int i = 0; i < kTokens; ++i) {
+            token.store(i, std::memory_order_release);
+            if (rcu.version() != cur) {        // 与 sync_sampler 相同：每 token 比一次版本
+                cur = rcu.snapshot().version;
+                if (cur < seen_at.size() && seen_at[cur] < 0) seen_at[cur] = i;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(kTokenMs));
+        }
+    });
+
+    while (token.load(std::memory_order_acquire) < 5) std::this_thread::yield();
+    double max_us = 0;
+    std::vector<int> published_at;
+    for (int k = 0; k < 20; ++k) {
+        Params p;
+        p.top_k = k;
+        const int at = token.load(std::memory_order_acquire);
+        const long long t0 = now_ns();
+        rcu.publish(p);
+        max_us = std::max(max_us, (double)(now_ns() - t0) / 1000.0);
+        published_at.push_back(at);
+        EXPECT_TRUE(token.load(std::memory_order_acquire) < kTokens - 1);   // 生成仍在进行
+        std::this_thread::sleep_for(std::chrono::milliseconds(4 * kTokenMs));
+    }
+    gen.join();
+
+    // 发布耗时与一个 token 的时长无关（持锁等待的话会是整段生成，数百毫秒）
+    printf("publish max %.1f us while generation holds the lock\n", max_us);
+    EXPECT_TRUE(max_us < 1000.0 * kTokenMs);
+    // 每个版本在发布时所在 token 的下一两个 token 内生效
+    for (size_t k = 0; k < published_at.size(); ++k) {
+        const int used = seen_at[k + 1];
+        EXPECT_TRUE(used >= 0 && used <= published_at[k] + 2);
+    }
+}
+
+void test_concurrent_writers() {
+    SnapshotRcu<Params> rcu;
+    std::atomic<bool> done{false};
+    std::atomic<int> torn{0}, regress{0};
+    std::atomic<long> reads{0};
+    std::thread reader([&] {
+        uint64_t last = 0;
+        while (!done.load(std::memory_order_acquire)) {
+            if (rcu.version() == last) continue;
+            const Params v = rcu.snapshot();
+            if (v.version < last) ++regress;
+            if (v.check != (uint64_t)v.top_k * 31u + (uint64_t)v.temp) ++torn;
+            last = v.version;
+            ++reads;
+        }
+    });
+    std::vector<std::thread> writers;
+    for (int w = 0; w < 4; ++w) {
+        writers.emplace_back([&, w] {
+            for (int i = 0; i < 20000; ++i) {
+                Params p;
+                p.top_k = i;
+                p.temp  = (float)w;
+                p.check = (uint64_t)p.top_k * 31u + (uint64_t)p.temp;
+                rcu.publish(p);
+            }
+        });
+    }
+    for (auto& t : writers) t.join();
+    // 读者至少再读一次最新版本，之后的发布就能回收全部旧快照
+    while (reads == 0 || rcu.version() != 80000u) std::this_thread::yield();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    done.store(true, std::memory_order_release);
+    reader.join();
+    rcu.publish(Params{});
+    EXPECT_EQ(torn.load(), 0);
+    EXPECT_EQ(regress.load(), 0);
+    EXPECT_TRUE(rcu.retired() <= 2u);
+}
+
+// 从未有读者，以及读者读过之后 quiesce（请求结束）：之后的发布都把旧快照回收干净
+void test_idle_publish_reclaims() {
+    SnapshotRcu<Params> rcu;
+    for (int i = 0; i < 10000; ++i) {
+        Params p;
+        p.top_k = i;
+        rcu.publish(p);
+    }
+    EXPECT_EQ(rcu.retired(), 0u);
+    EXPECT_EQ(rcu.snapshot().top_k, 9999);
+
+    // 读者持有快照期间旧快照保留，quiesce 之后下一次发布全部回收
+    for (int i = 0; i < 100; ++i) rcu.publish(Params{});
+    EXPECT_TRUE(rcu.retired() >= 100u);
+    rcu.quiesce();
+    for (int i = 0; i < 10000; ++i) rcu.publish(Params{});
+    EXPECT_EQ(rcu.retired(), 0u);
+    EXPECT_EQ(rcu.version(), 20100u);
+    EXPECT_EQ(rcu.snapshot().version, 20100u);
+}
+
+}  // namespace
+
+int main() {
+    test_defaults();
+    test_publish_does_not_wait_for_generation();
+    test_concurrent_writers();
+    test_idle_publish_reclaims();
+    return test_result();
+}
@@ -0,0 +1,142 @@
+// android/src/test/cpp/test_steady_alloc.cpp
+// 稳态解码零分配：以 LLM_ALLOC_AUDIT 编译（计数版 operator new），按 run_chat 的顺序
+// 逐 token 走一遍宿主机可跑的部分——采样 + accept、查 piece、推理段切分、停止串匹配、
+// UTF-8 -> UTF-16 合并缓冲——预热 SteadyAllocMeter::kWarmTokens 个 token 后每 token 必须 0 次分配
+#include <random>
+#include <string>
+#include <vector>
+
+#include "alloc_audit.h"
+#include "fused_sampler.h"
+#include "stop_matcher.h"
+#include "think_filter.h"
+#include "test_util.h"
+#include "utf8_stream.h"
+
+#ifndef LLM_ALLOC_AUDIT
+#error "test_steady_alloc must be built with LLM_ALLOC_AUDIT"
+#endif
+
+namespace {
+
+constexpr int     kWarmTokens = 4;      // 与 llama_jni.cpp 的 SteadyAllocMeter 一致
+constexpr int32_t kVocab      = 151936;
+
+// 假词表：ASCII 词、CJK 字、半个码点（字节级 BPE 会切开 emoji）、换行，以及推理标签与停止串的碎片
+std::vector<std::string> make_pieces() {
+    std::vector<std::string> v((size_t)kVocab);
+    static const char* const kFixed[] = {"<think>", "</think>", "<", "/", "think", ">", "\n", "\n\n",
+                                         "User", ":", "\xF0\x9F", "\x98\x80", "\xE4\xB8", "\xAD", "###", " the"};
+    std::mt19937 rng(3);
+    for (int32_t t = 0; t < kVocab; ++t) {
+        std::string& s = v[(size_t)t];
+        if ((size_t)t < sizeof(kFixed) / sizeof(kFixed[0])) { s = kFixed[t]; continue; }
+        switch (rng() % 3) {
+            case 0: for (uint32_t i = 0, n = 1 + rng() % 10; i < n; ++i) s += (char)('a' + rng() % 26); break;
+            case 1: s = "\xE5\xAD\xA6"; break;
+            default: s = " word"; break;
+        }
+    }
+    return v;
+}
+
+// 把若干“特殊” token 的 logit 抬高，让流里经常出现标签/停止串碎片与被切开的码点
+std::vector<std::vector<float>> make_logits() {
+    std::mt19937 rng(7);
+    std::normal_distribution<float> nd(0.0f, 2.5f);
+    std::vector<std::vector<float>> steps(16, std::vector<float>((size_t)kVocab));
+    for (auto& v : steps) {
+        for (auto& x : v) x = nd(rng);
+        for (int t = 0; t < 16; ++t) v[(size_t)t] += 8.0f + nd(rng);
+    }
+    return steps;
+}
+
+struct Pipeline {
+    FusedSampler             sampler;
+    StopMatcher              stop;
+    ThinkFilter              think;
+    Utf8Stream               utf8;
+    std::string              released;
+    std::u16string           text;      // TokenStreamer 的合并缓冲
+    std::u16string           thought;
+    std::vector<llama_token> session;
+    size_t                   flushed = 0;
+
+    explicit Pipeline(const FusedSamplerParams& p) : sampler(p) {}
+
+    // 与 DecodeArena::reserve / TokenStreamer / 会话 token 的预留对应
+    void begin(size_t max_tokens) {
+        stop.reset();
+        think.begin(true);
+        utf8.reset();
+        released.reserve(256);
+        text.reserve(4096);
+        thought.reserve(4096);
+        session.clear();
+        session.reserve(max_tokens);
+    }
+
+    void put_text(std::string_view s, std::u16string& buf) {
+        utf8.feed(s.data(), s.size(), buf);
+        if (buf.size() > 2048) { buf.clear(); ++flushed; }   // 模拟 flush 到 Java
+    }
+
+    // 返回 false = 命中停止串
+    bool step(const std::vector<std::string>& pieces, const float* logits) {
+        const llama_token t = sampler.sample(logits, kVocab);
+        sampler.accept(t);
+        session.push_back(t);
+        bool hit = false;
+        think.feed(pieces[(size_t)t], [&](ThinkFilter::Part part, std::string_view s) {
+            if (part == ThinkFilter::kThought) { put_text(s, thought); return; }
+            if (hit) return;
+            if (stop.empty()) { put_text(s, text); return; }
+            released.clear();
+            hit = stop.feed(s, released);
+            put_text(released, text);
+        });
+        return !hit;
+    }
+};
+
+void run(const char* name, const FusedSamplerParams& p, const std::vector<std::string>& stops, int replies) {
+    static const std::vector<std::string> pieces = make_pieces();
+    static const std::vector<std::vector<float>> logits = make_logits();
+    Pipeline pl(p);
+    pl.stop.build(stops);
+    int tokens = 0;
+    uint64_t allocs = 0;
+    for (int r = 0; r < replies; ++r) {
+        pl.begin(512);
+        pl.sampler.reset();
+        for (int i = 0; i < 512; ++i) {
+            const uint64_t before = alloc_count();
+            const bool go = pl.step(pieces, logits[(size_t)(r * 512 + i) % 16].data());
+            if (i >= kWarmTokens || r > 0) {
+                allocs += alloc_count() - before;
+                ++tokens;
+            }
+            if (!go) break;
+        }
+    }
+    if (allocs != 0) fprintf(stderr, "%s: %llu allocations over %d steady tokens\n", name, (unsigned long long)allocs, tokens);
+    EXPECT_EQ(allocs, 0u);
+    EXPECT_TRUE(tokens > replies * 100);
+}
+
+}  // namespace
+
+int main() {
+    FusedSamplerParams p;
+    p.seed = 1;
+    run("default", p, {"\n\nUser:", "###\n\n"}, 8);
+    run("no-stop", p, {}, 4);
+    FusedSamplerParams g = p;
+    g.temp = 0.0f;
+    run("greedy", g, {"</answer>"}, 4);
+    FusedSamplerParams full = p;
+    full.top_k = 0;
+    run("no-top-k", full, {"User:"}, 2);
+    return test_result();
+}
@@ -0,0 +1,167 @@
+// android/src/test/cpp/test_utf8_stream.cpp
+// Utf8Stream 与参考解码器的差分模糊测试：随机输入 × 随机/穷举切分点（含落在 carry 窗口里的切分）
+#include <random>
+#include <string>
+#include <vector>
+
+#include "test_util.h"
+#include "utf8_reference.h"
+#include "utf8_stream.h"
+
+namespace {
+
+std::mt19937 g_rng(20240601);
+
+uint32_t rnd(uint32_t n) { return std::uniform_int_distribution<uint32_t>(0, n - 1)(g_rng); }
+
+void put_cp(std::string& s, uint32_t cp) {
+    if (cp < 0x80) {
+        s += (char)cp;
+    } else if (cp < 0x800) {
+        s += (char)(0xC0 | (cp >> 6));
+        s += (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        s += (char)(0xE0 | (cp >> 12));
+        s += (char)(0x80 | ((cp >> 6) & 0x3F));
+        s += (char)(0x80 | (cp & 0x3F));
+    } else {
+        s += (char)(0xF0 | (cp >> 18));
+        s += (char)(0x80 | ((cp >> 12) & 0x3F));
+        s += (char)(0x80 | ((cp >> 6) & 0x3F));
+        s += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+// 一段“像模型输出”的字节：ASCII 长段、CJK、emoji，夹杂非法/截断/过短/代理区/越界序列
+std::string gen_input(size_t max_len) {
+    std::string s;
+    const size_t len = rnd((uint32_t)max_len + 1);
+    while (s.size() < len) {
+        switch (rnd(12)) {
+            case 0: case 1: case 2: {   // ASCII 段（触发 16 字节快路径）
+                const uint32_t n = 1 + rnd(40);
+                for (uint32_t i = 0; i < n; ++i) s += (char)(0x20 + rnd(0x5F));
+                break;
+            }
+            case 3: case 4: put_cp(s, 0x4E00 + rnd(0x5200)); break;   // CJK
+            case 5: put_cp(s, 0x80 + rnd(0x780)); break;               // 2 字节
+            case 6: put_cp(s, 0x1F300 + rnd(0x400)); break;            // emoji
+            case 7: put_cp(s, 0x10000 + rnd(0x100000)); break;         // 任意增补平面
+            case 8: s += (char)(0x80 + rnd(0x80)); break;              // 任意高位字节
+            case 9: {                                                  // 截断的多字节序列
+                std::string t;
+                put_cp(t, rnd(2) ? 0x4E00 + rnd(0x5200) : 0x10000 + rnd(0x100000));
+                s.append(t, 0, 1 + rnd((uint32_t)t.size() - 1));
+                break;
+            }
+            case 10: {                                                 // 过短编码 / 代理区 / 越界
+                static const char* const kBad[] = {"\xC0\x80", "\xC1\xBF", "\xE0\x80\x80", "\xE0\x9F\xBF",
+                                                   "\xED\xA0\x80", "\xED\xBF\xBF", "\xF0\x80\x80\x80",
+                                                   "\xF4\x90\x80\x80", "\xF7\xBF\xBF\xBF", "\xF8\x88\x80\x80",
+                                                   "\xFF", "\xFE"};
+                s += kBad[rnd(sizeof(kBad) / sizeof(kBad[0]))];
+                break;
+            }
+            default: s += (char)rnd(256); break;
+        }
+    }
+    return s;
+}
+
+// 按 cuts（升序切分点）分块喂给两边，逐块比较增量输出，最后比较 finish
+bool same_stream(const std::string& in, const std::vector<size_t>& cuts) {
+    Utf8Stream    st;
+    Utf8Reference ref;
+    std::u16string a, b;
+    size_t prev = 0;
+    for (size_t i = 0; i <= cuts.size(); ++i) {
+        const size_t end = i < cuts.size() ? cuts[i] : in.size();
+        const size_t before = a.size();
+        const size_t added = st.feed(in.data() + prev, end - prev, a);
+        ref.feed(in.data() + prev, end - prev, b);
+        if (added != a.size() - before || a != b || st.pending() != ref.pending.size() || st.pending() > 3) return false;
+        prev = end;
+    }
+    st.finish(a);
+    ref.finish(b);
+    return a == b && st.pending() == 0;
+}
+
+void test_fixed_cases() {
+    // 碰到过问题的边界：尾巴 + 不足 4 字节的新数据、尾巴后紧跟非法字节、连续多次不完整
+    const std::vector<std::pair<std::string, std::vector<size_t>>> cases = {
+        {"\xE4\xB8\xAD", {1}},
+        {"\xE4\xB8\xAD", {1, 2}},
+        {"\xF0\x9F\x98\x80", {1, 2, 3}},
+        {"\xF0\x9F\x98\x80" "a", {3}},
+        {"\xE4" "A\xB8\xAD", {1}},
+        {"\xE4\xB8" "A", {2}},
+        {"\xF0\x9F\x98" "\xE4\xB8\xAD", {3, 4}},
+        {"\xF0\x9F" "\xF0\x9F\x98\x80", {2, 3}},
+        {"\xE4\xB8\xAD" "abcdefghijklmnopqrstuvwxyz", {1}},
+        {"\xC3", {}},
+        {"\xE4\xB8", {1}},
+    };
+    for (const auto& c : cases) EXPECT_TRUE(same_stream(c.first, c.second));
+}
+
+// 每个切分点各切一刀，再在切分点后 1..3 字节处补一刀：新数据不足 4 字节时走“窗口仍不完整”的分支
+void test_exhaustive_splits() {
+    for (int it = 0; it < 3000; ++it) {
+        const std::string in = gen_input(48);
+        for (size_t i = 0; i <= in.size(); ++i) {
+            if (!same_stream(in, {i})) { EXPECT_TRUE(false); return; }
+            for (size_t d = 1; d <= 3 && i + d <= in.size(); ++d) {
+                if (!same_stream(in, {i, i + d})) { EXPECT_TRUE(false); return; }
+            }
+        }
+    }
+}
+
+void test_random_chunks() {
+    for (int it = 0; it < 20000; ++it) {
+        const std::string in = gen_input(300);
+        std::vector<size_t> cuts;
+        size_t p = 0;
+        while (true) {
+            // 模拟 token：多数 1~6 字节，偶尔长段
+            p += rnd(8) == 0 ? 1 + rnd(64) : 1 + rnd(6);
+            if (p >= in.size()) break;
+            cuts.push_back(p);
+        }
+        if (!same_stream(in, cuts)) { EXPECT_TRUE(false); return; }
+    }
+}
+
+void test_byte_by_byte() {
+    for (int it = 0; it < 2000; ++it) {
+        const std::string in = gen_input(120);
+        std::vector<size_t> cuts;
+        for (size_t i = 1; i < in.size(); ++i) cuts.push_back(i);
+        if (!same_stream(in, cuts)) { EXPECT_TRUE(false); return; }
+    }
+}
+
+// 整段解码与参考一致，且流结束后可复用
+void test_reset_reuse() {
+    Utf8Stream st;
+    std::u16string out;
+    st.feed("\xE4\xB8", 2, out);
+    EXPECT_EQ(st.pending(), 2u);
+    st.reset();
+    EXPECT_EQ(st.pending(), 0u);
+    out.clear();
+    st.feed("abc", 3, out);
+    EXPECT_TRUE(out == u"abc");
+}
+
+}  // namespace
+
+int main() {
+    test_fixed_cases();
+    test_exhaustive_splits();
+    test_random_chunks();
+    test_byte_by_byte();
+    test_reset_reuse();
+    return test_result();
+}
@@ -0,0 +1,58 @@
+// android/src/test/cpp/test_util.h
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+// ===== 最小断言：失败打印位置并计数，main 末尾 return test_result() =====
+inline int& test_failures() {
+    static int n = 0;
+    return n;
+}
+
+#define EXPECT_TRUE(cond)                                                         \
+    do {                                                                          \
+        if (!(cond)) {                                                            \
+            fprintf(stderr, "%s:%d: EXPECT_TRUE(%s) failed\n", __FILE__, __LINE__, #cond); \
+            ++test_failures();                                                    \
+        }                                                                         \
+    } while (0)
+
+#define EXPECT_EQ(a, b)                                                           \
+    do {                                                                          \
+        if (!((a) == (b))) {                                                      \
+            fprintf(stderr, "%s:%d: EXPECT_EQ(%s, %s) failed\n", __FILE__, __LINE__, #a, #b); \
+            ++test_failures();                                                    \
+        }                                                                         \
+    } while (0)
+
+// 致命断言：后续检查没有意义时直接退出
+#define ASSERT_TRUE(cond)                                                         \
+    do {                                                                          \
+        if (!(cond)) {                                                            \
+            fprintf(stderr, "%s:%d: ASSERT_TRUE(%s) failed\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                              \
+        }                                                                         \
+    } while (0)
+
+inline int test_result() {
+    if (test_failures() == 0) {
+        printf("OK\n");
+        return 0;
+    }
+    fprintf(stderr, "%d failure(s)\n", test_failures());
+    return 1;
+}
+
+// 基准计时：单调时钟，纳秒
+inline long long now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 防止被测结果被优化掉
+template <class T>
+inline void keep(const T& v) {
+    asm volatile("" : : "g"(&v) : "memory");
+}
@@ -0,0 +1,81 @@
+// android/src/test/cpp/utf8_reference.h
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// ===== 参考实现：改写前 llama_jni.cpp 里逐字节的 utf8_decode_to_utf16_partial =====
+// Utf8Stream 必须与它逐单元一致；流式用法是“上次剩下的尾巴 + 新数据”整体重解
+inline size_t utf8_decode_to_utf16_partial(const std::string& in, std::u16string& out_u16) {
+    out_u16.clear();
+    const uint8_t* p = (const uint8_t*)in.data();
+    size_t i = 0, n = in.size();
+
+    auto emit_u16 = [&](uint32_t cp) {
+        if (cp <= 0xFFFF) {
+            if (cp >= 0xD800 && cp <= 0xDFFF) cp = 0xFFFD;
+            out_u16.push_back((char16_t)cp);
+        } else if (cp <= 0x10FFFF) {
+            cp -= 0x10000;
+            out_u16.push_back((char16_t)(0xD800 + (cp >> 10)));
+            out_u16.push_back((char16_t)(0xDC00 + (cp & 0x3FF)));
+        } else {
+            out_u16.push_back((char16_t)0xFFFD);
+        }
+    };
+
+    while (i < n) {
+        uint8_t b0 = p[i];
+        if (b0 < 0x80) {
+            emit_u16(b0);
+            ++i;
+        } else if ((b0 & 0xE0) == 0xC0) {
+            if (i + 1 >= n) break;
+            uint8_t b1 = p[i + 1];
+            if ((b1 & 0xC0) != 0x80) { emit_u16(0xFFFD); ++i; continue; }
+            uint32_t cp = ((b0 & 0x1F) << 6) | (b1 & 0x3F);
+            if (cp < 0x80) cp = 0xFFFD;
+            emit_u16(cp);
+            i += 2;
+        } else if ((b0 & 0xF0) == 0xE0) {
+            if (i + 2 >= n) break;
+            uint8_t b1 = p[i + 1], b2 = p[i + 2];
+            if ((b1 & 0xC0) != 0x80 || (b2 & 0xC0) != 0x80) { emit_u16(0xFFFD); ++i; continue; }
+            uint32_t cp = ((b0 & 0x0F) << 12) | ((b1 & 0x3F) << 6) | (b2 & 0x3F);
+            if (cp < 0x800) cp = 0xFFFD;
+            emit_u16(cp);
+            i += 3;
+        } else if ((b0 & 0xF8) == 0xF0) {
+            if (i + 3 >= n) break;
+            uint8_t b1 = p[i + 1], b2 = p[i + 2], b3 = p[i + 3];
+            if ((b1 & 0xC0) != 0x80 || (b2 & 0xC0) != 0x80 || (b3 & 0xC0) != 0x80) { emit_u16(0xFFFD); ++i; continue; }
+            uint32_t cp = ((b0 & 0x07) << 18) | ((b1 & 0x3F) << 12) | ((b2 & 0x3F) << 6) | (b3 & 0x3F);
+            if (cp < 0x10000 || cp > 0x10FFFF) cp = 0xFFFD;
+            emit_u16(cp);
+            i += 4;
+        } else {
+            emit_u16(0xFFFD);
+            ++i;
+        }
+    }
+    return i;
+}
+
+// 旧的流式用法：pending 拼上新数据整体重解，消费掉的部分从 pending 头部删掉
+struct Utf8Reference {
+    std::string pending;
+    std::u16string tmp;
+
+    void feed(const char* p, size_t n, std::u16string& out) {
+        pending.append(p, n);
+        const size_t consumed = utf8_decode_to_utf16_partial(pending, tmp);
+        pending.erase(0, consumed);
+        out += tmp;
+    }
+
+    void finish(std::u16string& out) {
+        if (!pending.empty()) out.push_back((char16_t)0xFFFD);
+        pending.clear();
+    }
+};
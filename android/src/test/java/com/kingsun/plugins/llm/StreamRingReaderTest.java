@@ -0,0 +1,310 @@
+package com.kingsun.plugins.llm;
+
+import static org.junit.Assert.*;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.Collections;
+import java.util.List;
+import java.util.Random;
+import org.junit.Test;
+
+/**
+ * StreamRingReader 的消费循环：用 Java 写的假生产者代替 native（记录格式、反压等待与 llama_jni.cpp 的
+ * ring_put/ring_write/nativeRingAwait 相同），慢消费者下检查不丢、不乱序、内存不随数据量增长，以及退出路径。
+ */
+public class StreamRingReaderTest {
+
+    /** 假生产者：环满时等消费者回写 tail，断开后不再写 */
+    static final class FakeRing implements StreamRingReader.Source {
+
+        final ByteBuffer ring;
+        final int capacity;
+        private long head;
+        private long tail;
+        private boolean attached = true;
+        long maxInFlight;
+
+        FakeRing(int capacity) {
+            this.capacity = capacity;
+            this.ring = ByteBuffer.allocateDirect(StreamRingReader.HEADER + capacity).order(ByteOrder.nativeOrder());
+        }
+
+        static long recSize(int units) {
+            return (16 + 2L * units + 15) & ~15L;
+        }
+
+        @Override
+        public synchronized long await(long consumed, int timeoutMs) {
+            if (!attached) return consumed;
+            if (consumed <= head && consumed >= tail) {
+                tail = consumed;
+                notifyAll();
+            }
+            long deadline = System.currentTimeMillis() + timeoutMs;
+            while (attached && head == consumed) {
+                long left = deadline - System.currentTimeMillis();
+                if (left <= 0) break;
+                try {
+                    wait(left);
+                } catch (InterruptedException e) {
+                    Thread.currentThread().interrupt();
+                    break;
+                }
+            }
+            return attached ? head : consumed;
+        }
+
+        @Override
+        public synchronized void detach() {
+            attached = false;
+            notifyAll();
+        }
+
+        /** 一条记录；返回 false = 等待中被断开 */
+        synchronized boolean put(int kind, char[] text, int from, int units, long value) throws InterruptedException {
+            long need = recSize(units);
+            long toEnd = capacity - (head & (capacity - 1));
+            long total = need > toEnd ? toEnd + need : need;
+            while (capacity - (head - tail) < total) {
+                if (!attached) return false;
+                wait(10);
+            }
+            if (!attached) return false;
+            if (need > toEnd) {
+                ring.putInt(StreamRingReader.HEADER + (int) (head & (capacity - 1)), StreamRingReader.REC_PAD);
+                head += toEnd;
+            }
+            int off = StreamRingReader.HEADER + (int) (head & (capacity - 1));
+            ring.putInt(off, kind);
+            ring.putInt(off + 4, units);
+            ring.putLong(off + 8, value);
+            for (int i = 0; i < units; i++) ring.putChar(off + 16 + 2 * i, text[from + i]);
+            head += need;
+            ring.putLong(0, head);
+            maxInFlight = Math.max(maxInFlight, head - tail);
+            notifyAll();
+            return true;
+        }
+
+        /** 与 ring_write 相同：文本超过半个环时切成多条，token 数记在第一条上 */
+        boolean write(int kind, String s, long value) throws InterruptedException {
+            char[] text = s.toCharArray();
+            int maxUnits = (capacity / 2 - 16) / 2;
+            int done = 0;
+            do {
+                int n = Math.min(text.length - done, maxUnits);
+                if (!put(kind, text, done, n, done == 0 ? value : 0)) return false;
+                done += n;
+            } while (done < text.length);
+            return true;
+        }
+
+        synchronized long head() {
+            return head;
+        }
+    }
+
+    /** 记下收到的一切；每隔 slowEvery 条停 slowMs 模拟慢消费者 */
+    static class Recorder implements LlamaNative.Listener {
+
+        final StringBuilder text = new StringBuilder();
+        final StringBuilder thought = new StringBuilder();
+        final List<String> events = new ArrayList<>();
+        int tokens;
+        int calls;
+        int slowEvery;
+        int slowMs;
+
+        private void maybeSleep() {
+            if (slowEvery > 0 && ++calls % slowEvery == 0) {
+                try {
+                    Thread.sleep(slowMs);
+                } catch (InterruptedException e) {
+                    Thread.currentThread().interrupt();
+                }
+            }
+        }
+
+        @Override
+        public void onToken(String t, int nTokens) {
+            maybeSleep();
+            text.append(t);
+            tokens += nTokens;
+        }
+
+        @Override
+        public void onThinking(String t, int nTokens) {
+            thought.append(t);
+            tokens += nTokens;
+        }
+
+        @Override
+        public void onDone(long requestId) {
+            events.add("done " + requestId);
+        }
+
+        @Override
+        public void onBegin(long requestId) {
+            events.add("begin " + requestId);
+        }
+
+        @Override
+        public void onSegment(int kind, int index, String t) {
+            events.add((kind == LlamaNative.SEGMENT_SENTENCE ? "sentence " : "paragraph ") + index + " " + t);
+        }
+    }
+
+    private static String randomText(Random rnd, int maxLen) {
+        int n = 1 + rnd.nextInt(maxLen);
+        StringBuilder sb = new StringBuilder(n);
+        for (int i = 0; i < n; i++) {
+            int r = rnd.nextInt(10);
+            if (r < 6) sb.append((char) ('a' + rnd.nextInt(26)));
+            else if (r < 9) sb.append((char) (0x4E00 + rnd.nextInt(0x5000)));
+            else sb.append(' ');
+        }
+        return sb.toString();
+    }
+
+    private static Thread start(StreamRingReader reader) {
+        Thread t = new Thread(reader, "llm-stream-test");
+        t.setDaemon(true);
+        t.start();
+        return t;
+    }
+
+    @Test
+    public void slowConsumerReceivesEverythingInOrder() throws Exception {
+        FakeRing ring = new FakeRing(4096);
+        Recorder rec = new Recorder();
+        rec.slowEvery = 200;
+        rec.slowMs = 2;
+        StreamRingReader reader = new StreamRingReader(ring.ring, ring.capacity, ring, rec);
+        Thread consumer = start(reader);
+
+        Random rnd = new Random(42);
+        StringBuilder expected = new StringBuilder();
+        List<String> expectedEvents = new ArrayList<>();
+        int expectedTokens = 0;
+        int maxUnits = 0;
+        for (int req = 1; req <= 200; req++) {
+            assertTrue(ring.write(StreamRingReader.REC_BEGIN, "", req));
+            expectedEvents.add("begin " + req);
+            for (int k = 0; k < 50; k++) {
+                // 偶尔来一段超过半个环的文本，走切分路径
+                String t = rnd.nextInt(100) == 0 ? randomText(rnd, 3000) : randomText(rnd, 40);
+                int n = 1 + rnd.nextInt(4);
+                assertTrue(ring.write(StreamRingReader.REC_TEXT, t, n));
+                expected.append(t);
+                expectedTokens += n;
+                maxUnits = Math.max(maxUnits, Math.min(t.length(), (ring.capacity / 2 - 16) / 2));
+            }
+            String sentence = randomText(rnd, 60);
+            assertTrue(ring.write(StreamRingReader.REC_SENTENCE, sentence, 0));
+            expectedEvents.add("sentence 0 " + sentence);
+            assertTrue(ring.write(StreamRingReader.REC_END, "", req));
+            expectedEvents.add("done " + req);
+        }
+
+        reader.stop();
+        consumer.join(10_000);
+        assertFalse(consumer.isAlive());
+
+        assertEquals(expected.toString(), rec.text.toString());
+        assertEquals(expectedTokens, rec.tokens);
+        assertEquals(expectedEvents, rec.events);
+        assertEquals(ring.head(), reader.consumed());
+        // 内存恒定：生产者最多领先一个环，消费端暂存不超过单条记录
+        assertTrue(ring.maxInFlight <= ring.capacity);
+        assertTrue(reader.scratchChars() <= Math.max(512, maxUnits));
+        assertEquals(0, reader.dispatchErrors());
+    }
+
+    @Test
+    public void stopDeliversRecordsThenDetaches() throws Exception {
+        FakeRing ring = new FakeRing(4096);
+        Recorder rec = new Recorder();
+        StreamRingReader reader = new StreamRingReader(ring.ring, ring.capacity, ring, rec);
+        assertTrue(ring.write(StreamRingReader.REC_TEXT, "hello ", 1));
+        assertTrue(ring.write(StreamRingReader.REC_THOUGHT, "hmm", 1));
+        assertTrue(ring.write(StreamRingReader.REC_END, "", 7));
+
+        reader.stop();
+        Thread consumer = start(reader);
+        consumer.join(10_000);
+        assertFalse(consumer.isAlive());
+
+        assertEquals("hello ", rec.text.toString());
+        assertEquals("hmm", rec.thought.toString());
+        assertEquals(Collections.singletonList("done 7"), rec.events);
+        // 断开后生产者写不进（native 侧改走回调）
+        assertFalse(ring.write(StreamRingReader.REC_TEXT, "late", 1));
+    }
+
+    @Test
+    public void producerBlockedOnFullRingResumesWhenConsumerStarts() throws Exception {
+        FakeRing ring = new FakeRing(4096);
+        Recorder rec = new Recorder();
+        StreamRingReader reader = new StreamRingReader(ring.ring, ring.capacity, ring, rec);
+        // 消费者还没启动：写满后生产者只能等
+        char[] xs = new char[1000];
+        Arrays.fill(xs, 'x');
+        String chunk = new String(xs);
+        int written = 0;
+        while (ring.capacity - ring.head() >= FakeRing.recSize(chunk.length())) {
+            assertTrue(ring.write(StreamRingReader.REC_TEXT, chunk, 1));
+            written++;
+        }
+        final boolean[] lastOk = new boolean[1];
+        Thread producer = new Thread(() -> {
+            try {
+                lastOk[0] = ring.write(StreamRingReader.REC_TEXT, chunk, 1);
+            } catch (InterruptedException e) {
+                Thread.currentThread().interrupt();
+            }
+        });
+        producer.start();
+        Thread.sleep(50);
+        assertTrue(producer.isAlive());
+
+        Thread consumer = start(reader);
+        producer.join(10_000);
+        assertFalse(producer.isAlive());
+        assertTrue(lastOk[0]);
+        reader.stop();
+        consumer.join(10_000);
+        assertFalse(consumer.isAlive());
+        assertEquals((written + 1) * chunk.length(), rec.text.length());
+    }
+
+    @Test
+    public void listenerExceptionDoesNotStopConsumer() throws Exception {
+        FakeRing ring = new FakeRing(4096);
+        Recorder rec = new Recorder() {
+            boolean thrown;
+
+            @Override
+            public void onToken(String t, int nTokens) {
+                if (!thrown) {
+                    thrown = true;
+                    throw new IllegalStateException("listener bug");
+                }
+                super.onToken(t, nTokens);
+            }
+        };
+        StreamRingReader reader = new StreamRingReader(ring.ring, ring.capacity, ring, rec);
+        Thread consumer = start(reader);
+        assertTrue(ring.write(StreamRingReader.REC_TEXT, "lost", 1));
+        assertTrue(ring.write(StreamRingReader.REC_TEXT, "kept", 1));
+        assertTrue(ring.write(StreamRingReader.REC_END, "", 1));
+        reader.stop();
+        consumer.join(10_000);
+        assertFalse(consumer.isAlive());
+        assertEquals("kept", rec.text.toString());
+        assertEquals(Collections.singletonList("done 1"), rec.events);
+        assertEquals(1, reader.dispatchErrors());
+    }
+}
@@ -1,19 +1,98 @@
+/** token：本次合并送出的文本；tokens：其中包含的 token 数；totalTokens：本次请求累计；requestId：所属请求 */
 export declare type LLMTokenEvent = {
     token: string;
+    tokens: number;
+    totalTokens: number;
+    requestId: number;
+};
+export declare type LLMDoneEvent = {
+    requestId: number;
 };
-export declare type LLMDoneEvent = Record<string, never>;
 export declare type LLMErrorEvent = {
     message: string;
 };
+export declare type LLMPrefillEvent = {
+    done: number;
+    total: number;
+    percent: number;
+    requestId: number;
+};
+/** 流式作文的整句/整段：index 从 0 计，text 已去掉首尾空白 */
+export declare type LLMSegmentEvent = {
+    index: number;
+    text: string;
+    requestId: number;
+};
+/** 请求已进入 native 调度队列（与调用顺序一致），requestId 可用于 cancel()；generateEssays 的各条另带 index（items 下标） */
+export declare type LLMQueuedEvent = {
+    requestId: number;
+    kind: 'chat' | 'essay';
+    index?: number;
+};
+/** chat 的推理段（thinking: 'separate'），标签已去掉；合并策略同 llmToken */
+export declare type LLMThinkingEvent = {
+    text: string;
+    tokens: number;
+    requestId: number;
+};
+/** generateEssays 的一条完成（不等同批其他条目） */
+export declare type LLMEssayResultEvent = {
+    index: number;
+    requestId: number;
+    text: string;
+};
+/** interactive 排在 background 前面；后台作文会在 token 边界让位给新来的交互请求 */
+export declare type RequestPriority = 'interactive' | 'background';
+/**
+ * Qwen3 推理段（<think>…</think>）的处理：inline = 原样混在 llmToken 里（默认）；off = 模板里预填空推理段、直接回答；
+ * separate = 推理段走 llmThinking，llmToken 只有回答；hidden = 推理段丢弃
+ */
+export declare type ThinkingMode = 'inline' | 'off' | 'separate' | 'hidden';
+/** 语法约束的内置格式（text = 不约束） */
+export declare type OutputFormat = 'text' | 'json' | 'feedback';
 export interface InitOptions {
     assetPath?: string;
     expectedSha256?: string;
     modelPath?: string;
     remoteUrl?: string;
     nCtx?: number;
+    /** 单次 decode 的逻辑上限（prefill 块上限），默认由 llama.cpp 决定 */
+    nBatch?: number;
+    /** 单次 decode 的物理上限，决定计算缓冲区大小 */
+    nUbatch?: number;
+    /** prefill 每块 token 数，0 = 跟随 nBatch */
+    prefillChunk?: number;
+    /** 额外预热一份备用上下文，上下文损坏时直接换上（多占一份 KV 内存），默认 false */
+    keepStandbyContext?: boolean;
+    /** 固定 prompt 头（system 段/作文要求段）的 KV 快照缓存预算（MB），0 关闭，默认 32 */
+    prefixCacheMb?: number;
+    /** 同批生成的作文数（1-16），>1 时多个 generateEssay 共用一次 decode，共享 nCtx（需相应调大）；默认 1 */
+    parallel?: number;
+}
+export interface ChatMessage {
+    role: 'system' | 'user' | 'assistant';
+    content: string;
 }
 export interface ChatOptions {
-    prompt: string;
+    prompt?: string;
+    /** 整段对话（含历史）；native 侧与已缓存的 KV 做 diff，只 prefill 新增的一轮 */
+    messages?: ChatMessage[];
+    /** 截止时间（毫秒，从提交算起，含排队），到期与 stop() 一样在计算中途打断；默认不限 */
+    timeoutMs?: number;
+    /** 调度优先级，默认 interactive */
+    priority?: RequestPriority;
+    /** 约束输出格式：json = 任意 JSON 对象；feedback = 批改结果 {errors:[{start,end,type,suggestion}],comment}；默认不约束 */
+    format?: OutputFormat;
+    /** 自定义 GBNF（llama.cpp 语法，根规则 root），优先于 format；语法解析失败时 reject、不入队 */
+    grammar?: string;
+    /** 停止串（最多 16 个，每个不超过 128 字节），可跨 token 匹配，命中即结束且不输出停止串；结束符（<|im_end|> 等）总会停 */
+    stop?: string[];
+    /** 推理段处理方式，默认 inline；简单的辅导回复用 off 最省 token 与延迟。带 format/grammar 时总是 off */
+    thinking?: ThinkingMode;
+    /** 回答的 token 上限（推理段不计入），默认 512 */
+    maxNewTokens?: number;
+    /** 推理段 token 上限（off 以外生效），到了补上 </think> 让模型转入回答；0 = 与 maxNewTokens 相同 */
+    maxThinkingTokens?: number;
 }
 export interface GenerateEssayOptions {
     title?: string;
@@ -24,6 +103,42 @@ export interface GenerateEssayOptions {
         high_freq_words?: string[];
     };
     max_new_tokens?: number;
+    /** 截止时间（毫秒，从提交算起，含排队），到期与 stop() 一样在计算中途打断；默认不限 */
+    timeoutMs?: number;
+    /** 调度优先级，默认 background */
+    priority?: RequestPriority;
+    /** 边生成边推送：token 走 llmToken，另发 llmSentence/llmParagraph，llmDone 之后 resolve 全文；默认 false */
+    stream?: boolean;
+    /** 确定性解码（批改/纠错等）：不抽样，重复惩罚后直接取最大 logit；默认 false */
+    greedy?: boolean;
+    /** 同 ChatOptions.format；带格式约束的请求不参与同批生成 */
+    format?: OutputFormat;
+    /** 同 ChatOptions.grammar */
+    grammar?: string;
+    /** 同 ChatOptions.stop */
+    stop?: string[];
+}
+/** generateEssays 的一条：字段同 GenerateEssayOptions */
+export interface EssayItem {
+    title?: string;
+    word_limit?: number;
+    lang?: string;
+    constraints?: {
+        high_error_words?: string[];
+        high_freq_words?: string[];
+    };
+    max_new_tokens?: number;
+}
+export interface GenerateEssaysOptions {
+    items: EssayItem[];
+    /** 对每一条生效，从提交算起（含排队） */
+    timeoutMs?: number;
+    /** 调度优先级，默认 background */
+    priority?: RequestPriority;
+    /** 各条的 token/整句/整段事件按 requestId 区分；默认 false */
+    stream?: boolean;
+    /** 同 ChatOptions.stop，对每一条生效 */
+    stop?: string[];
 }
 export interface SetSamplingOptions {
     temp?: number;
@@ -33,20 +148,87 @@ export interface SetSamplingOptions {
     repeatLastN?: number;
     minP?: number;
 }
+export interface StreamPolicyOptions {
+    /** 距本批第一个 token 超过该毫秒数即送出，0 不按时间 */
+    flushMs?: number;
+    /** 攒够该字符数（UTF-16）即送出，0 不按长度 */
+    flushChars?: number;
+    /** 额外在词/句边界处送出；三项都不设时每个 token 送一次（默认） */
+    boundary?: 'none' | 'word' | 'sentence';
+}
+export interface SessionOptions {
+    /** 会话名（文件名），仅限字母数字与 ._- ，默认 default */
+    name?: string;
+    /** 落盘时是否 zlib 压缩 KV，默认 false */
+    compress?: boolean;
+}
+/** native 侧性能统计（计数与毫秒） */
+export declare type LLMPerfStats = Record<string, number>;
 export interface PluginListenerHandle {
     remove: () => Promise<void>;
 }
 export interface LLMPlugin {
     init(options: InitOptions): Promise<void>;
-    chat(options: ChatOptions): Promise<void>;
+    /** 排队执行（不再拒绝并发请求），生成结束后 resolve */
+    chat(options: ChatOptions): Promise<{
+        requestId: number;
+    }>;
+    /** 停掉正在跑的请求并取消所有排队请求 */
     stop(): Promise<void>;
+    /** 按 id 取消单个请求（排队中或正在跑）；已结束返回 cancelled=false */
+    cancel(options: {
+        requestId: number;
+    }): Promise<{
+        cancelled: boolean;
+    }>;
+    /** 释放模型；排队中与正在跑的请求先按取消结束（chat 发 llmDone，作文 resolve 已生成的部分），之后才 resolve */
     free(): Promise<void>;
+    /**
+     * 作文 prompt 以固定要求段开头（所有作文请求逐字相同，作为共享前缀命中 KV 缓存），之后是易错词/高频词约束，最后是 Language/Title/Length 行。
+     * 与早先版本相比措辞有变：开头不再是 “Write a <lang> essay.”，语言改为末尾的 Language: 行；“Avoid overly complex grammar” 移到了约束之前。同样的输入生成结果可能与旧版不同
+     */
     generateEssay(options: GenerateEssayOptions): Promise<{
         text: string;
+        requestId: number;
     }>;
-    /** 新增：动态调采样参数（映射到 nativeSetSampling） */
+    /**
+     * 批量作文（如整班同一题目要求、不同标题/约束）：共同的要求段只 prefill 一次，分叉到各序列同批 decode。
+     * 需 init 时 parallel > 1，否则逐条生成；每条完成发 llmEssayResult，全部完成后按 items 顺序 resolve
+     */
+    generateEssays(options: GenerateEssaysOptions): Promise<{
+        results: {
+            text: string;
+            requestId: number;
+        }[];
+    }>;
+    /** 新增：动态调采样参数（映射到 nativeSetSampling）；生成中调用也立即返回，下一个 token 生效 */
     setSampling(options: SetSamplingOptions): Promise<void>;
+    /** 调整 prefill 分块大小（不超过 nBatch），0 = 跟随 nBatch；配合 getPerfStats 测吞吐/峰值内存 */
+    setPrefillChunk(options: {
+        chunk: number;
+    }): Promise<void>;
+    /** llmToken 合并策略：把多个 token 合成一次事件，减少桥调用；下个请求生效 */
+    setStreamPolicy(options: StreamPolicyOptions): Promise<void>;
+    /** 把当前会话（KV + token 历史）落盘，App 重启后可恢复 */
+    saveSession(options?: SessionOptions): Promise<void>;
+    /** 恢复会话；文件与当前模型/n_ctx/KV 类型不匹配，或是旧版（v1/v2）格式、校验不通过时 restored=false，当前会话保持不变（重新 saveSession 即可） */
+    loadSession(options?: SessionOptions): Promise<{
+        restored: boolean;
+        tokens: number;
+    }>;
+    /** 性能统计：上下文分配次数、请求准备耗时等 */
+    getPerfStats(): Promise<LLMPerfStats>;
+    addListener(eventName: 'llmQueued', listenerFunc: (event: LLMQueuedEvent) => void): Promise<PluginListenerHandle>;
     addListener(eventName: 'llmToken', listenerFunc: (event: LLMTokenEvent) => void): Promise<PluginListenerHandle>;
     addListener(eventName: 'llmDone', listenerFunc: (event: LLMDoneEvent) => void): Promise<PluginListenerHandle>;
     addListener(eventName: 'llmError', listenerFunc: (event: LLMErrorEvent) => void): Promise<PluginListenerHandle>;
+    /** prefill 进度（每块一次） */
+    addListener(eventName: 'llmPrefill', listenerFunc: (event: LLMPrefillEvent) => void): Promise<PluginListenerHandle>;
+    /** 流式作文：每完成一句/一段一次（排在对应 llmToken 之后） */
+    addListener(eventName: 'llmSentence', listenerFunc: (event: LLMSegmentEvent) => void): Promise<PluginListenerHandle>;
+    addListener(eventName: 'llmParagraph', listenerFunc: (event: LLMSegmentEvent) => void): Promise<PluginListenerHandle>;
+    /** chat 的推理段（thinking: 'separate'） */
+    addListener(eventName: 'llmThinking', listenerFunc: (event: LLMThinkingEvent) => void): Promise<PluginListenerHandle>;
+    /** generateEssays：每完成一条一次 */
+    addListener(eventName: 'llmEssayResult', listenerFunc: (event: LLMEssayResultEvent) => void): Promise<PluginListenerHandle>;
 }
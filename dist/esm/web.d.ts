@@ -1,14 +1,39 @@
 import { WebPlugin } from '@capacitor/core';
-import type { LLMPlugin, InitOptions, ChatOptions, GenerateEssayOptions, SetSamplingOptions } from './definitions';
+import type { LLMPlugin, InitOptions, ChatOptions, GenerateEssayOptions, GenerateEssaysOptions, SetSamplingOptions, LLMPerfStats, SessionOptions, StreamPolicyOptions } from './definitions';
 export declare class LLMWeb extends WebPlugin implements LLMPlugin {
     private abort?;
+    private nextId;
     init(_options: InitOptions): Promise<void>;
-    chat(options: ChatOptions): Promise<void>;
+    chat(options: ChatOptions): Promise<{
+        requestId: number;
+    }>;
     stop(): Promise<void>;
+    cancel(_options: {
+        requestId: number;
+    }): Promise<{
+        cancelled: boolean;
+    }>;
     free(): Promise<void>;
     setSampling(_options: SetSamplingOptions): Promise<void>;
+    setPrefillChunk(_options: {
+        chunk: number;
+    }): Promise<void>;
+    setStreamPolicy(_options: StreamPolicyOptions): Promise<void>;
+    saveSession(_options?: SessionOptions): Promise<void>;
+    loadSession(_options?: SessionOptions): Promise<{
+        restored: boolean;
+        tokens: number;
+    }>;
+    getPerfStats(): Promise<LLMPerfStats>;
     generateEssay(options: GenerateEssayOptions): Promise<{
         text: string;
+        requestId: number;
+    }>;
+    generateEssays(options: GenerateEssaysOptions): Promise<{
+        results: {
+            text: string;
+            requestId: number;
+        }[];
     }>;
 }
 export default LLMWeb;
@@ -8,35 +8,84 @@ const LLM = core.registerPlugin('LLM', {
 
 // web.ts
 class LLMWeb extends core.WebPlugin {
+    constructor() {
+        super(...arguments);
+        this.nextId = 1;
+    }
     async init(_options) {
         return;
     }
     async chat(options) {
-        const text = `[LLMWeb mock] ${options.prompt}`;
+        var _a, _b, _c;
+        const requestId = this.nextId++;
+        this.notifyListeners('llmQueued', { requestId, kind: 'chat' });
+        const last = (_b = (_a = options.messages) === null || _a === void 0 ? void 0 : _a[options.messages.length - 1]) === null || _b === void 0 ? void 0 : _b.content;
+        const text = `[LLMWeb mock] ${(_c = last !== null && last !== void 0 ? last : options.prompt) !== null && _c !== void 0 ? _c : ''}`;
         this.abort = new AbortController();
+        let total = 0;
         for (const ch of text) {
             if (this.abort.signal.aborted)
                 break;
             await new Promise((r) => setTimeout(r, 8));
-            this.notifyListeners('llmToken', { token: ch });
+            total++;
+            this.notifyListeners('llmToken', { token: ch, tokens: 1, totalTokens: total, requestId });
         }
-        this.notifyListeners('llmDone', {});
+        this.notifyListeners('llmDone', { requestId });
+        return { requestId };
     }
     async stop() {
         var _a;
         (_a = this.abort) === null || _a === void 0 ? void 0 : _a.abort();
     }
+    async cancel(_options) {
+        var _a;
+        (_a = this.abort) === null || _a === void 0 ? void 0 : _a.abort();
+        return { cancelled: true };
+    }
     async free() {
         return;
     }
     async setSampling(_options) {
         return;
     }
+    async setPrefillChunk(_options) {
+        return;
+    }
+    async setStreamPolicy(_options) {
+        return;
+    }
+    async saveSession(_options) {
+        return;
+    }
+    async loadSession(_options) {
+        return { restored: false, tokens: 0 };
+    }
+    async getPerfStats() {
+        return {};
+    }
     async generateEssay(options) {
         var _a, _b;
+        const requestId = this.nextId++;
+        this.notifyListeners('llmQueued', { requestId, kind: 'essay' });
         const title = (_a = options.title) !== null && _a !== void 0 ? _a : 'An Essay';
         const len = (_b = options.word_limit) !== null && _b !== void 0 ? _b : 200;
-        return { text: `[LLMWeb mock essay] ${title} (~${len} words)` };
+        const text = `[LLMWeb mock essay] ${title} (~${len} words).`;
+        if (options.stream) {
+            this.notifyListeners('llmToken', { token: text, tokens: 1, totalTokens: 1, requestId });
+            this.notifyListeners('llmSentence', { index: 0, text, requestId });
+            this.notifyListeners('llmParagraph', { index: 0, text, requestId });
+            this.notifyListeners('llmDone', { requestId });
+        }
+        return { text, requestId };
+    }
+    async generateEssays(options) {
+        const results = [];
+        for (const [index, item] of options.items.entries()) {
+            const r = await this.generateEssay(Object.assign(Object.assign({}, item), { stream: options.stream, priority: options.priority }));
+            this.notifyListeners('llmEssayResult', Object.assign({ index }, r));
+            results.push(r);
+        }
+        return { results };
     }
 }
 
@@ -6,32 +6,51 @@ import type {
   InitOptions,
   ChatOptions,
   GenerateEssayOptions,
+  GenerateEssaysOptions,
+  LLMEssayResultEvent,
   LLMTokenEvent,
   LLMDoneEvent,
+  LLMSegmentEvent,
+  LLMQueuedEvent,
   SetSamplingOptions,
+  LLMPerfStats,
+  SessionOptions,
+  StreamPolicyOptions,
 } from './definitions';
 
 export class LLMWeb extends WebPlugin implements LLMPlugin {
   private abort?: AbortController;
+  private nextId = 1;
 
   async init(_options: InitOptions): Promise<void> {
     return;
   }
 
-  async chat(options: ChatOptions): Promise<void> {
-    const text = `[LLMWeb mock] ${options.prompt}`;
+  async chat(options: ChatOptions): Promise<{ requestId: number }> {
+    const requestId = this.nextId++;
+    this.notifyListeners('llmQueued', { requestId, kind: 'chat' } as LLMQueuedEvent);
+    const last = options.messages?.[options.messages.length - 1]?.content;
+    const text = `[LLMWeb mock] ${last ?? options.prompt ?? ''}`;
     this.abort = new AbortController();
+    let total = 0;
     for (const ch of text) {
       if (this.abort.signal.aborted) break;
       await new Promise((r) => setTimeout(r, 8));
-      this.notifyListeners('llmToken', { token: ch } as LLMTokenEvent);
+      total++;
+      this.notifyListeners('llmToken', { token: ch, tokens: 1, totalTokens: total, requestId } as LLMTokenEvent);
     }
-    this.notifyListeners('llmDone', {} as LLMDoneEvent);
+    this.notifyListeners('llmDone', { requestId } as LLMDoneEvent);
+    return { requestId };
   }
 
   async stop(): Promise<void> {
     this.abort?.abort();
   }
+
+  async cancel(_options: { requestId: number }): Promise<{ cancelled: boolean }> {
+    this.abort?.abort();
+    return { cancelled: true };
+  }
   async free(): Promise<void> {
     return;
   }
@@ -40,10 +59,49 @@ export class LLMWeb extends WebPlugin implements LLMPlugin {
     return;
   }
 
-  async generateEssay(options: GenerateEssayOptions): Promise<{ text: string }> {
+  async setPrefillChunk(_options: { chunk: number }): Promise<void> {
+    return;
+  }
+
+  async setStreamPolicy(_options: StreamPolicyOptions): Promise<void> {
+    return;
+  }
+
+  async saveSession(_options?: SessionOptions): Promise<void> {
+    return;
+  }
+
+  async loadSession(_options?: SessionOptions): Promise<{ restored: boolean; tokens: number }> {
+    return { restored: false, tokens: 0 };
+  }
+
+  async getPerfStats(): Promise<LLMPerfStats> {
+    return {};
+  }
+
+  async generateEssay(options: GenerateEssayOptions): Promise<{ text: string; requestId: number }> {
+    const requestId = this.nextId++;
+    this.notifyListeners('llmQueued', { requestId, kind: 'essay' } as LLMQueuedEvent);
     const title = options.title ?? 'An Essay';
     const len = options.word_limit ?? 200;
-    return { text: `[LLMWeb mock essay] ${title} (~${len} words)` };
+    const text = `[LLMWeb mock essay] ${title} (~${len} words).`;
+    if (options.stream) {
+      this.notifyListeners('llmToken', { token: text, tokens: 1, totalTokens: 1, requestId } as LLMTokenEvent);
+      this.notifyListeners('llmSentence', { index: 0, text, requestId } as LLMSegmentEvent);
+      this.notifyListeners('llmParagraph', { index: 0, text, requestId } as LLMSegmentEvent);
+      this.notifyListeners('llmDone', { requestId } as LLMDoneEvent);
+    }
+    return { text, requestId };
+  }
+
+  async generateEssays(options: GenerateEssaysOptions): Promise<{ results: { text: string; requestId: number }[] }> {
+    const results: { text: string; requestId: number }[] = [];
+    for (const [index, item] of options.items.entries()) {
+      const r = await this.generateEssay({ ...item, stream: options.stream, priority: options.priority });
+      this.notifyListeners('llmEssayResult', { index, ...r } as LLMEssayResultEvent);
+      results.push(r);
+    }
+    return { results };
   }
 }
 export default LLMWeb;